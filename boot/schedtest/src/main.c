@@ -0,0 +1,77 @@
+#include "syscalls.h"
+
+// Runs this many cloned workers, enough to keep 8 harts busy
+#define SCHEDTEST_WORKERS    8
+#define SCHEDTEST_ITERATIONS 200000000
+
+#define SCHEDTEST_MAX_HARTS  64
+
+// format_hex(char*, const char*, uint64_t) -> void
+// Writes a label followed by a value in hex into a buffer of at least 64 bytes.
+static void format_hex(char* buffer, const char* label, uint64_t value) {
+    size_t i = 0;
+    for (; label[i] != 0 && i < 40; i++)
+        buffer[i] = label[i];
+    buffer[i++] = '0';
+    buffer[i++] = 'x';
+    for (int shift = 60; shift >= 0; shift -= 4)
+        buffer[i++] = "0123456789abcdef"[(value >> shift) & 0xf];
+    buffer[i] = 0;
+}
+
+// get_time() -> uint64_t
+// Returns the current time in timer ticks, or 0 if the scheduler has nothing to report.
+static uint64_t get_time() {
+    struct scheduler_stats stats;
+    for (int64_t hart = 0; hart < SCHEDTEST_MAX_HARTS; hart++) {
+        if (scheduler_stats(hart, &stats) == 0)
+            return stats.time;
+    }
+    return 0;
+}
+
+void _start() {
+    int64_t cap = shm_create(1);
+    volatile uint64_t* done = cap >= 0 ? shm_map(cap) : NULL;
+    if (done == NULL) {
+        uart_puts("schedtest: unable to create shared memory");
+        exit(1);
+    }
+
+    uint64_t start = get_time();
+    for (size_t i = 0; i < SCHEDTEST_WORKERS; i++) {
+        int64_t pid = clone();
+        if (pid < 0) {
+            uart_puts("schedtest: unable to clone");
+            exit(1);
+        }
+
+        // Every worker does the same fixed amount of work, so the elapsed time only depends on how well they are spread over the harts
+        if (pid == 0) {
+            volatile uint64_t sink = 0;
+            for (uint64_t j = 0; j < SCHEDTEST_ITERATIONS; j++)
+                sink += j;
+            __atomic_fetch_add(done, 1, __ATOMIC_SEQ_CST);
+            exit(0);
+        }
+    }
+
+    while (__atomic_load_n(done, __ATOMIC_SEQ_CST) < SCHEDTEST_WORKERS);
+
+    char buffer[64];
+    format_hex(buffer, "schedtest: elapsed ticks ", get_time() - start);
+    uart_puts(buffer);
+
+    struct scheduler_stats stats;
+    for (int64_t hart = 0; hart < SCHEDTEST_MAX_HARTS; hart++) {
+        if (scheduler_stats(hart, &stats) != 0)
+            continue;
+        format_hex(buffer, "schedtest: hart ", hart);
+        uart_puts(buffer);
+        format_hex(buffer, "schedtest:     picks ", stats.picks);
+        uart_puts(buffer);
+        format_hex(buffer, "schedtest:     steals ", stats.steals);
+        uart_puts(buffer);
+    }
+    exit(0);
+}
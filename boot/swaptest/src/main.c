@@ -0,0 +1,45 @@
+#include "syscalls.h"
+
+// Touches this many pages, which is more memory than a machine started with make run MEMORY=64m has
+#define SWAPTEST_PAGES  24576
+#define SWAPTEST_PASSES 2
+
+#define WORDS_PER_PAGE  (4096 / sizeof(uint64_t))
+
+// pattern(size_t, size_t) -> uint64_t
+// Returns the value the test stores in a page on a given pass.
+static uint64_t pattern(size_t page, size_t pass) {
+    return (page * 0x9e3779b97f4a7c15) ^ pass;
+}
+
+void _start() {
+    uint64_t* words = page_alloc(SWAPTEST_PAGES, PAGE_PERM_READ | PAGE_PERM_WRITE);
+    if (words == NULL) {
+        uart_puts("swaptest: unable to reserve memory");
+        exit(1);
+    }
+
+    // Every pass rewrites the first and last word of each page, then checks all of them, so every page goes out to swap and back
+    for (size_t pass = 0; pass < SWAPTEST_PASSES; pass++) {
+        for (size_t page = 0; page < SWAPTEST_PAGES; page++) {
+            words[page * WORDS_PER_PAGE] = pattern(page, pass);
+            words[(page + 1) * WORDS_PER_PAGE - 1] = ~pattern(page, pass);
+        }
+
+        for (size_t page = 0; page < SWAPTEST_PAGES; page++) {
+            if (words[page * WORDS_PER_PAGE] != pattern(page, pass)
+                || words[(page + 1) * WORDS_PER_PAGE - 1] != ~pattern(page, pass)) {
+                uart_puts("swaptest: page contents lost");
+                exit(1);
+            }
+        }
+        uart_puts("swaptest: pass verified");
+    }
+
+    struct working_set_stats stats;
+    if (working_set(-1, &stats) == 0 && stats.swapped != 0)
+        uart_puts("swaptest: done, with pages still in swap");
+    else
+        uart_puts("swaptest: done");
+    exit(0);
+}
@@ -0,0 +1,27 @@
+#ifndef MEMOPS_H
+#define MEMOPS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// memcpy(void*, const void*, unsigned long int) -> void*
+// Copys the data from one pointer to another.
+void* memcpy(void* dest, const void* src, unsigned long int n);
+
+// memset(void*, int, unsigned long int) -> void*
+// Sets a value over a space. Returns the original pointer.
+void* memset(void* p, int i, unsigned long int n);
+
+// memeq(void*, void*, size_t) -> bool
+// Returns true if the two pointers have identical data.
+bool memeq(void* p, void* q, size_t size);
+
+// memops_use_vector(bool) -> void
+// Selects the RVV versions of memcpy, memset and memeq for large sizes. Only the kernel can enable this, since it toggles sstatus.VS.
+void memops_use_vector(bool enable);
+
+// memops_vector_enabled() -> bool
+// Returns true if the RVV versions of memcpy, memset and memeq are in use.
+bool memops_vector_enabled();
+
+#endif /* MEMOPS_H */
@@ -0,0 +1,32 @@
+#ifndef SCHEDULER_STATS_H
+#define SCHEDULER_STATS_H
+
+#include <stdint.h>
+
+// Scheduling counters of one hart since boot.
+struct scheduler_stats {
+    // Time the counters were read, in timer ticks
+    uint64_t time;
+
+    // Tasks handed to the hart to run, and how many of them it took from another hart's queue
+    uint64_t picks;
+    uint64_t steals;
+
+    // Times the hart found nothing to run and went idle
+    uint64_t idle;
+
+    // Tasks waiting to run on the hart right now
+    uint64_t queued;
+};
+
+// Scheduling history of one task since it was created, kept the same way whichever scheduler is built in. Times are in timer ticks.
+struct task_scheduler_stats {
+    // Time spent running, and time spent ready but waiting for a hart
+    uint64_t runtime;
+    uint64_t wait;
+
+    // Times the task was picked to run
+    uint64_t runs;
+};
+
+#endif /* SCHEDULER_STATS_H */
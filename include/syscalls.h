@@ -5,6 +5,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "scheduler_stats.h"
+#include "working_set.h"
+
 // uart_puts(char*) -> void
 // Prints out a message onto the UART.
 void uart_puts(char* msg);
@@ -13,21 +16,21 @@ void uart_puts(char* msg);
 // // Prints out a message onto the UART.
 // void uart_puts(char* msg);
 
-// #define PAGE_PERM_READ  4
-// #define PAGE_PERM_WRITE 2
-// #define PAGE_PERM_EXEC  1
+#define PAGE_PERM_READ  4
+#define PAGE_PERM_WRITE 2
+#define PAGE_PERM_EXEC  1
 
-// // page_alloc(size_t page_count, int permissions) -> void*
-// // Allocates a page with the given permissions.
-// void* page_alloc(size_t page_count, int permissions);
+// page_alloc(size_t page_count, int permissions) -> void*
+// Allocates pages with the given permissions. The pages are zeroed and only backed by memory once touched. Returns NULL if the permissions are empty or writable without being readable.
+void* page_alloc(size_t page_count, int permissions);
 
-// // page_perms(void* page, size_t page_count, int permissions) -> int
-// // Changes the page's permissions. Returns 0 if successful and 1 if not.
-// int page_perms(void* page, size_t page_count, int permissions);
+// page_perms(void* page, size_t page_count, int permissions) -> int
+// Changes the page's permissions. Returns 0 if successful and 1 if not, including when the permissions are empty or writable without being readable.
+int page_perms(void* page, size_t page_count, int permissions);
 
-// // page_dealloc(void* page, size_t page_count) -> int
-// // Deallocates a page. Returns 0 if successful and 1 if not.
-// int page_dealloc(void* page, size_t page_count);
+// page_dealloc(void* page, size_t page_count) -> int
+// Deallocates a page. Returns 0 if successful and 1 if not.
+int page_dealloc(void* page, size_t page_count);
 
 // // sleep(uint64_t seconds, uint64_t micros) -> void
 // // Sleeps for the given amount of time.
@@ -43,10 +46,10 @@ void uart_puts(char* msg);
 // // Spawns a new process in the same address space, executing the given function.
 // pid_t spawn_thread(void (*func)(void* data), void* data);
 
-// // exit(int64_t code) -> !
-// // Exits the current process.
-// __attribute__((noreturn))
-// void exit(int64_t code);
+// exit(int64_t code) -> !
+// Exits the current process.
+__attribute__((noreturn))
+void exit(int64_t code);
 
 // struct allowed_memory {
 //      char name[16];
@@ -108,4 +111,52 @@ void uart_puts(char* msg);
 // //      The capability is an ability to kll another process.
 // int capability_data(size_t* index, char* name, uint64_t* data_top, uint64_t* data_bot);
 
+// clone() -> int64_t
+// Creates a copy of the current process that shares its memory copy on write. Returns the pid of the copy in the original, 0 in the copy and -1 on failure.
+int64_t clone();
+
+// working_set(int64_t pid, struct working_set_stats* stats) -> int
+// Gets the working set stats of a task, or of the current task if pid is -1. The stats are sampled from the accessed and dirty bits of its pages while it runs. Returns 0 if successful and -1 if not.
+int working_set(int64_t pid, struct working_set_stats* stats);
+
+// map_file(char* name, size_t offset, size_t page_count, int permissions) -> void*
+// Maps page_count pages of a file in the initrd, starting at the page aligned offset, with the given permissions. Pages are only read in once touched. Read only pages share memory with the initrd, and writable pages are private copies made on the first write. Pages past the end of the file are zeroed. Returns NULL on failure, including when the permissions are empty or writable without being readable.
+void* map_file(char* name, size_t offset, size_t page_count, int permissions);
+
+// shm_create(size_t page_count) -> int64_t
+// Creates page_count zeroed pages of shared memory owned by the current process. Returns a capability for it with read and write rights, or -1 on failure.
+int64_t shm_create(size_t page_count);
+
+// shm_map(int64_t cap) -> void*
+// Maps the shared memory of a capability with the capability's rights. Returns NULL on failure or if it is mapped already.
+void* shm_map(int64_t cap);
+
+// shm_unmap(int64_t cap) -> int
+// Unmaps the shared memory of a capability, keeping the capability. Returns 0 if successful and -1 if not.
+int shm_unmap(int64_t cap);
+
+// shm_grant(int64_t cap, int64_t pid, int rights) -> int64_t
+// Gives another process a capability for the same shared memory. The rights are PAGE_PERM_READ, optionally with PAGE_PERM_WRITE, and can't be more than the capability's own. Returns the capability in the other process, or -1 on failure.
+int64_t shm_grant(int64_t cap, int64_t pid, int rights);
+
+// shm_revoke(int64_t cap) -> int
+// Takes back every capability granted for shared memory the current process created, unmapping it from every other process. Returns 0 if successful and -1 if the capability isn't the creator's.
+int shm_revoke(int64_t cap);
+
+// shm_info(int64_t cap, size_t* page_count) -> int
+// Gets the page count of the shared memory of a capability. Returns the capability's rights, or -1 if it isn't a shared memory capability.
+int shm_info(int64_t cap, size_t* page_count);
+
+// scheduler_stats(int64_t hartid, struct scheduler_stats* stats) -> int
+// Gets the scheduling counters of a hart since boot, along with the current time in timer ticks. Returns 0 if successful and -1 if the hart doesn't exist or hasn't scheduled anything yet.
+int scheduler_stats(int64_t hartid, struct scheduler_stats* stats);
+
+// task_scheduler_stats(int64_t pid, struct task_scheduler_stats* stats) -> int
+// Gets how long a task has run and waited to run since it was created, or of the current task if pid is -1. Returns 0 if successful and -1 if not.
+int task_scheduler_stats(int64_t pid, struct task_scheduler_stats* stats);
+
+// yield() -> void
+// Gives up the rest of the current slice, letting other ready tasks run. Tasks that yield early are favoured by schedulers that track bursts.
+void yield();
+
 #endif /* SYSCALL_H */
@@ -0,0 +1,29 @@
+#ifndef WORKING_SET_H
+#define WORKING_SET_H
+
+#include <stdint.h>
+
+// Memory use of a task sampled from the accessed and dirty bits of its pages. Page counts are in 4 KiB pages and are from the last scan.
+struct working_set_stats {
+    // Number of scans so far and the time of the last one, in timer ticks
+    uint64_t scans;
+    uint64_t last_scan;
+
+    // Pages mapped for the task
+    uint64_t resident;
+
+    // Pages accessed since the scan before, which estimates the working set
+    uint64_t accessed;
+
+    // Pages not accessed for one scan interval, and for two or more
+    uint64_t idle;
+    uint64_t cold;
+
+    // Pages written to since they were mapped
+    uint64_t dirty;
+
+    // Pages in swap, which aren't counted as resident
+    uint64_t swapped;
+};
+
+#endif /* WORKING_SET_H */
@@ -0,0 +1,468 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bench.h"
+#include "console.h"
+#include "elf.h"
+#include "memory.h"
+#include "mmu.h"
+#include "process.h"
+#include "shared_memory.h"
+#include "time.h"
+
+#ifdef KERNEL_BENCH
+
+#define BENCH_HEAP_ROUNDS   256
+#define BENCH_HEAP_BATCH    64
+
+// 4 MiB touched one word per page, mapped once with pages and once with megapages at otherwise unused addresses
+#define BENCH_TLB_PAGES     1024
+#define BENCH_TLB_ROUNDS    64
+#define BENCH_TLB_SMALL     ((void*) 0x100000000)
+#define BENCH_TLB_HUGE      ((void*) 0x140000000)
+
+#define BENCH_SPAWN_TABLES  64
+
+// Pages allocated and freed per round, one call per page against one call per range
+#define BENCH_RANGE_PAGES   256
+#define BENCH_RANGE_ROUNDS  16
+#define BENCH_RANGE_ADDR    ((void*) 0x180000000)
+
+// Two address spaces with the same pages mapped, switched between after touching each page
+#define BENCH_SWITCH_PAGES  64
+#define BENCH_SWITCH_ROUNDS 256
+#define BENCH_SWITCH_ADDR   ((void*) 0x100000000)
+
+// A generated executable with one read-write segment of data pages followed by bss, spawned and cloned this many times
+#define BENCH_CLONE_TASKS       16
+#define BENCH_CLONE_DATA_PAGES  64
+#define BENCH_CLONE_BSS_PAGES   1024
+#define BENCH_CLONE_ADDR        0x10000
+
+// Data moved between two tasks in messages of each size, copied through a kernel buffer or written once into shared memory
+#define BENCH_SHM_PAGES     64
+#define BENCH_SHM_ROUNDS    16
+#define BENCH_SHM_MESSAGE   PAGE_SIZE
+
+// Each memory routine measurement moves BENCH_MEMOPS_BYTES in total, split into calls of one size
+#define BENCH_MEMOPS_PAGES  16
+#define BENCH_MEMOPS_BYTES  0x100000
+
+// bench_heap() -> void
+// Measures the cost of a malloc/free pair for a few object sizes.
+static void bench_heap() {
+    static const size_t sizes[] = { 16, 64, 256, 864, 2016, 8192 };
+    void* objects[BENCH_HEAP_BATCH];
+
+#ifdef HEAP_TRACK_ORIGINS
+    const char* mode = "with origin tracking";
+#else
+    const char* mode = "without origin tracking";
+#endif
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); i++) {
+        time_t start = get_time();
+        for (size_t round = 0; round < BENCH_HEAP_ROUNDS; round++) {
+            for (size_t j = 0; j < BENCH_HEAP_BATCH; j++) {
+                objects[j] = malloc(sizes[i]);
+            }
+            for (size_t j = 0; j < BENCH_HEAP_BATCH; j++) {
+                free(objects[j]);
+            }
+        }
+        time_t ticks = get_time() - start;
+
+        console_printf("[bench] malloc/free 0x%lx bytes %s: 0x%lx ticks per 0x1000 pairs\n",
+            sizes[i], mode, ticks * 0x1000 / (BENCH_HEAP_ROUNDS * BENCH_HEAP_BATCH));
+    }
+}
+
+// bench_tlb_walk(void*) -> time_t
+// Reads one word from every page of the mapped buffer a number of times and returns how long it took.
+static time_t bench_tlb_walk(void* base) {
+    volatile uint64_t* words = base;
+    uint64_t sum = 0;
+
+    time_t start = get_time();
+    for (size_t round = 0; round < BENCH_TLB_ROUNDS; round++) {
+        for (size_t i = 0; i < BENCH_TLB_PAGES; i++) {
+            sum += words[i * PAGE_SIZE / sizeof(uint64_t)];
+        }
+    }
+    time_t ticks = get_time() - start;
+
+    (void) sum;
+    return ticks;
+}
+
+// bench_tlb() -> void
+// Compares strided reads through page mappings against the same memory mapped with megapages.
+static void bench_tlb() {
+    struct mmu_root root = get_mmu();
+    page_t* pages = alloc_pages(BENCH_TLB_PAGES);
+    if (pages == NULL)
+        return;
+
+    for (size_t i = 0; i < BENCH_TLB_PAGES; i++) {
+        mmu_map(root, BENCH_TLB_SMALL + i * PAGE_SIZE, pages + i, MMU_BIT_READ | MMU_BIT_WRITE);
+    }
+    for (size_t i = 0; i < BENCH_TLB_PAGES; i += MMU_MEGAPAGE_SIZE / PAGE_SIZE) {
+        mmu_map_huge(root, BENCH_TLB_HUGE + i * PAGE_SIZE, pages + i, MMU_MEGAPAGE_SIZE, MMU_BIT_READ | MMU_BIT_WRITE);
+    }
+    flush_mmu();
+
+    time_t small = bench_tlb_walk(BENCH_TLB_SMALL);
+    time_t huge = bench_tlb_walk(BENCH_TLB_HUGE);
+    console_printf("[bench] strided reads over 0x%lx pages: 0x%lx ticks with pages, 0x%lx ticks with megapages\n",
+        (uint64_t) BENCH_TLB_PAGES, small, huge);
+
+    for (size_t i = 0; i < BENCH_TLB_PAGES; i++) {
+        mmu_remove(root, BENCH_TLB_SMALL + i * PAGE_SIZE);
+    }
+    for (size_t i = 0; i < BENCH_TLB_PAGES; i += MMU_MEGAPAGE_SIZE / PAGE_SIZE) {
+        mmu_remove_huge(root, BENCH_TLB_HUGE + i * PAGE_SIZE, MMU_MEGAPAGE_SIZE);
+    }
+    flush_mmu();
+
+    dealloc_pages(pages, BENCH_TLB_PAGES);
+}
+
+// bench_byte_copy(void*, const void*, size_t) -> void
+// The byte at a time copy the memory routines replaced, kept as a baseline.
+static void bench_byte_copy(void* dest, const void* src, size_t n) {
+    volatile unsigned char* d = dest;
+    const unsigned char* s = src;
+    for (size_t i = 0; i < n; i++) {
+        d[i] = s[i];
+    }
+}
+
+// bench_memops_mode(const char*, char*, char*) -> void
+// Times memcpy, memset and memeq across sizes with whichever versions are currently selected.
+static void bench_memops_mode(const char* mode, char* a, char* b) {
+    static const size_t sizes[] = { 16, 64, 256, 0x1000, 0x10000 };
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); i++) {
+        size_t size = sizes[i];
+        size_t calls = BENCH_MEMOPS_BYTES / size;
+
+        time_t start = get_time();
+        for (size_t j = 0; j < calls; j++) {
+            memcpy(a, b, size);
+        }
+        time_t copy = get_time() - start;
+
+        start = get_time();
+        for (size_t j = 0; j < calls; j++) {
+            memset(a, (int) j, size);
+        }
+        time_t set = get_time() - start;
+
+        memcpy(a, b, size);
+        start = get_time();
+        for (size_t j = 0; j < calls; j++) {
+            memeq(a, b, size);
+        }
+        time_t equal = get_time() - start;
+
+        start = get_time();
+        for (size_t j = 0; j < calls; j++) {
+            bench_byte_copy(a, b, size);
+        }
+        time_t baseline = get_time() - start;
+
+        console_printf("[bench] %s 0x%lx byte calls over 0x%lx bytes: memcpy 0x%lx, memset 0x%lx, memeq 0x%lx, byte loop 0x%lx ticks\n",
+            mode, size, (uint64_t) BENCH_MEMOPS_BYTES, copy, set, equal, baseline);
+    }
+}
+
+// bench_memops() -> void
+// Measures memory routine throughput with the scalar versions and, if the harts have them, the vector versions.
+static void bench_memops() {
+    char* a = alloc_pages(BENCH_MEMOPS_PAGES);
+    char* b = alloc_pages(BENCH_MEMOPS_PAGES);
+    if (a == NULL || b == NULL) {
+        dealloc_pages(a, BENCH_MEMOPS_PAGES);
+        dealloc_pages(b, BENCH_MEMOPS_PAGES);
+        return;
+    }
+
+    a = phys2safe(a);
+    b = phys2safe(b);
+
+    bool vector = memops_vector_enabled();
+    memops_use_vector(false);
+    bench_memops_mode("scalar", a, b);
+    if (vector) {
+        memops_use_vector(true);
+        bench_memops_mode("vector", a, b);
+    }
+
+    dealloc_pages(a, BENCH_MEMOPS_PAGES);
+    dealloc_pages(b, BENCH_MEMOPS_PAGES);
+}
+
+// bench_mmu_tables() -> void
+// Measures how long creating a new address space's page table takes.
+static void bench_mmu_tables() {
+    time_t start = get_time();
+    for (size_t i = 0; i < BENCH_SPAWN_TABLES; i++) {
+        struct mmu_root root = create_mmu_table();
+        clean_mmu_table(root);
+    }
+    time_t ticks = get_time() - start;
+
+    console_printf("[bench] create_mmu_table: 0x%lx ticks for 0x%lx tables\n", ticks, (uint64_t) BENCH_SPAWN_TABLES);
+}
+
+// bench_map_range() -> void
+// Compares mapping and unmapping freshly allocated pages one page at a time against the range operations.
+static void bench_map_range() {
+    struct mmu_root root = create_mmu_table();
+    if (!mmu_root_valid(root))
+        return;
+
+    time_t start = get_time();
+    for (size_t round = 0; round < BENCH_RANGE_ROUNDS; round++) {
+        for (size_t i = 0; i < BENCH_RANGE_PAGES; i++) {
+            mmu_alloc(root, BENCH_RANGE_ADDR + i * PAGE_SIZE, MMU_BIT_READ | MMU_BIT_WRITE);
+        }
+        for (size_t i = 0; i < BENCH_RANGE_PAGES; i++) {
+            dealloc_pages(mmu_remove(root, BENCH_RANGE_ADDR + i * PAGE_SIZE), 1);
+        }
+    }
+    time_t single = get_time() - start;
+
+    start = get_time();
+    for (size_t round = 0; round < BENCH_RANGE_ROUNDS; round++) {
+        mmu_alloc_range(root, BENCH_RANGE_ADDR, BENCH_RANGE_PAGES, MMU_BIT_READ | MMU_BIT_WRITE);
+        mmu_remove_range(root, BENCH_RANGE_ADDR, BENCH_RANGE_PAGES, true);
+    }
+    time_t ranged = get_time() - start;
+
+    console_printf("[bench] 0x%lx page mappings: 0x%lx ticks one page at a time, 0x%lx ticks as ranges\n",
+        (uint64_t) BENCH_RANGE_PAGES * BENCH_RANGE_ROUNDS, single, ranged);
+    clean_mmu_table(root);
+}
+
+// bench_context_switch_run(struct mmu_root*, bool) -> time_t
+// Switches between two address spaces, touching every mapped page after each switch.
+static time_t bench_context_switch_run(struct mmu_root* roots, bool flush) {
+    time_t start = get_time();
+    for (size_t i = 0; i < BENCH_SWITCH_ROUNDS; i++) {
+        set_mmu(&roots[i & 1]);
+        if (flush)
+            flush_mmu();
+
+        for (size_t j = 0; j < BENCH_SWITCH_PAGES; j++) {
+            (void) *(volatile uint64_t*) (BENCH_SWITCH_ADDR + j * PAGE_SIZE);
+        }
+    }
+    return get_time() - start;
+}
+
+// bench_context_switch() -> void
+// Compares address space switches using ASIDs against switches that flush the whole TLB, as switching did before ASIDs.
+static void bench_context_switch() {
+    page_t* pages = alloc_pages(BENCH_SWITCH_PAGES);
+    if (pages == NULL)
+        return;
+
+    struct mmu_root roots[2] = { create_mmu_table(), create_mmu_table() };
+    for (size_t i = 0; i < 2; i++) {
+        for (size_t j = 0; j < BENCH_SWITCH_PAGES; j++) {
+            mmu_map(roots[i], BENCH_SWITCH_ADDR + j * PAGE_SIZE, pages + j, MMU_BIT_READ | MMU_BIT_WRITE);
+        }
+    }
+
+    uint64_t satp;
+    asm volatile("csrr %0, satp" : "=r" (satp));
+
+    time_t tagged = bench_context_switch_run(roots, false);
+    time_t flushed = bench_context_switch_run(roots, true);
+
+    asm volatile("csrw satp, %0" : : "r" (satp));
+    flush_mmu();
+
+    console_printf("[bench] 0x%lx address space switches: 0x%lx ticks with asids, 0x%lx ticks flushing\n",
+        (uint64_t) BENCH_SWITCH_ROUNDS, tagged, flushed);
+
+    for (size_t i = 0; i < 2; i++) {
+        for (size_t j = 0; j < BENCH_SWITCH_PAGES; j++) {
+            mmu_remove(roots[i], BENCH_SWITCH_ADDR + j * PAGE_SIZE);
+        }
+        clean_mmu_table(roots[i]);
+    }
+    dealloc_pages(pages, BENCH_SWITCH_PAGES);
+}
+
+// bench_kill_tasks(struct s_task**) -> void
+// Kills the tasks spawned by a benchmark and finishes tearing down their address spaces.
+static void bench_kill_tasks(struct s_task** tasks) {
+    for (size_t i = 0; i < BENCH_CLONE_TASKS; i++) {
+        if (tasks[i] != NULL)
+            kill_process(tasks[i]->pid);
+    }
+    while (reap_mmu_tables(SIZE_MAX));
+}
+
+// bench_make_image(size_t, size_t, elf_t*) -> void*
+// Generates an executable with one read-write segment of data pages followed by bss, for spawning tasks. Returns the buffer to free afterwards, or null on failure.
+static void* bench_make_image(size_t data_pages, size_t bss_pages, elf_t* elf) {
+    size_t size = (data_pages + 1) * PAGE_SIZE;
+    void* image = malloc(size);
+    if (image == NULL)
+        return NULL;
+    memset(image, 0, size);
+
+    elf_header_t* header = image;
+    header->type = ELF_EXECUTABLE;
+    header->entry = BENCH_CLONE_ADDR;
+    header->program_header_offset = sizeof(elf_header_t);
+    header->program_header_entry_size = sizeof(elf_program_header_t);
+    header->program_header_num = 1;
+    *(elf_program_header_t*) (image + sizeof(elf_header_t)) = (elf_program_header_t) {
+        .type = 1,
+        .flags = 0x6,
+        .offset = PAGE_SIZE,
+        .virtual_addr = BENCH_CLONE_ADDR,
+        .file_size = data_pages * PAGE_SIZE,
+        .memory_size = (data_pages + bss_pages) * PAGE_SIZE,
+        .align = PAGE_SIZE,
+    };
+    *elf = (elf_t) { .header = header, .string_table = NULL, .size = size };
+    return image;
+}
+
+// bench_clone() -> void
+// Compares creating tasks by loading an executable against cloning an already loaded task copy on write.
+static void bench_clone() {
+    elf_t elf;
+    void* image = bench_make_image(BENCH_CLONE_DATA_PAGES, BENCH_CLONE_BSS_PAGES, &elf);
+    if (image == NULL)
+        return;
+
+    struct s_task* tasks[BENCH_CLONE_TASKS] = { NULL };
+    time_t start = get_time();
+    for (size_t i = 0; i < BENCH_CLONE_TASKS; i++) {
+        tasks[i] = spawn_task_from_elf("bench", 5, &elf, 2, 0, NULL);
+    }
+    time_t spawned = get_time() - start;
+    bench_kill_tasks(tasks);
+
+    struct s_task* parent = spawn_task_from_elf("bench", 5, &elf, 2, 0, NULL);
+    if (parent != NULL) {
+        start = get_time();
+        for (size_t i = 0; i < BENCH_CLONE_TASKS; i++) {
+            tasks[i] = clone_task(parent->pid);
+        }
+        time_t cloned = get_time() - start;
+        bench_kill_tasks(tasks);
+        kill_process(parent->pid);
+        while (reap_mmu_tables(SIZE_MAX));
+
+        console_printf("[bench] 0x%lx tasks: 0x%lx ticks spawning from an elf file, 0x%lx ticks cloning\n",
+            (uint64_t) BENCH_CLONE_TASKS, spawned, cloned);
+    }
+
+    free(image);
+}
+
+// bench_shared_memory() -> void
+// Compares moving data between two tasks in messages copied through a kernel buffer, like a channel does, against writing it once into shared memory mapped in both. The shared memory time includes creating, granting, mapping and revoking it.
+static void bench_shared_memory() {
+    elf_t elf;
+    void* image = bench_make_image(1, 0, &elf);
+    if (image == NULL)
+        return;
+
+    struct s_task* tasks[BENCH_CLONE_TASKS] = { NULL };
+    tasks[0] = spawn_task_from_elf("bench", 5, &elf, 2, 0, NULL);
+    tasks[1] = spawn_task_from_elf("bench", 5, &elf, 2, 0, NULL);
+    void* source = alloc_pages(BENCH_SHM_PAGES);
+    void* dest = alloc_pages(BENCH_SHM_PAGES);
+    void* buffer = malloc(BENCH_SHM_MESSAGE);
+    if (tasks[0] == NULL || tasks[1] == NULL || source == NULL || dest == NULL || buffer == NULL)
+        goto done;
+
+    static const size_t sizes[] = { 64, 512, BENCH_SHM_MESSAGE };
+    size_t bytes = BENCH_SHM_PAGES * PAGE_SIZE;
+    char* from = phys2safe(source);
+    char* to = phys2safe(dest);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); i++) {
+        time_t start = get_time();
+        for (size_t round = 0; round < BENCH_SHM_ROUNDS; round++) {
+            for (size_t offset = 0; offset < bytes; offset += sizes[i]) {
+                memcpy(buffer, from + offset, sizes[i]);
+                memcpy(to + offset, buffer, sizes[i]);
+            }
+        }
+        time_t copied = get_time() - start;
+
+        time_t setup = 0;
+        start = get_time();
+        for (size_t round = 0; round < BENCH_SHM_ROUNDS; round++) {
+            time_t setup_start = get_time();
+            int64_t cap = create_shared_memory(tasks[0], BENCH_SHM_PAGES);
+            int64_t granted = grant_shared_memory(tasks[0], cap, tasks[1]->pid, SHARED_MEMORY_READ);
+            if (cap < 0 || granted < 0 || map_shared_memory(tasks[0], cap) == NULL || map_shared_memory(tasks[1], granted) == NULL) {
+                console_puts("[bench] unable to share memory\n");
+                goto done;
+            }
+            struct shared_memory* memory = tasks[0]->capabilities[cap].data.shared_memory.memory;
+            setup += get_time() - setup_start;
+
+            // The sender writes each message straight into the pages the receiver has mapped
+            for (size_t offset = 0; offset < bytes; offset += sizes[i]) {
+                char* frame = phys2safe(memory->frames[offset / PAGE_SIZE]);
+                memcpy(frame + offset % PAGE_SIZE, from + offset, sizes[i]);
+            }
+
+            setup_start = get_time();
+            revoke_shared_memory(tasks[0], cap);
+            unmap_shared_memory(tasks[0], cap);
+            setup += get_time() - setup_start;
+        }
+        time_t shared = get_time() - start;
+
+        // Revoked capabilities stay in the owner's table until it dies
+        release_shared_memory(tasks[0]);
+
+        console_printf("[bench] 0x%lx bytes in 0x%lx byte messages: 0x%lx ticks copying through the kernel, 0x%lx ticks through shared memory (0x%lx of them setting it up)\n",
+            bytes * BENCH_SHM_ROUNDS, sizes[i], copied, shared, setup);
+    }
+
+done:
+    free(buffer);
+    if (dest != NULL)
+        dealloc_pages(dest, BENCH_SHM_PAGES);
+    if (source != NULL)
+        dealloc_pages(source, BENCH_SHM_PAGES);
+    bench_kill_tasks(tasks);
+    free(image);
+}
+
+// run_benchmarks() -> void
+// Runs the kernel benchmarks and prints the results. Only does anything in kernels built with KERNEL_BENCH.
+void run_benchmarks() {
+    console_puts("[bench] starting kernel benchmarks\n");
+    bench_heap();
+    bench_tlb();
+    bench_memops();
+    bench_mmu_tables();
+    bench_map_range();
+    bench_context_switch();
+    bench_clone();
+    bench_shared_memory();
+    console_puts("[bench] finished kernel benchmarks\n");
+}
+
+#else
+
+// run_benchmarks() -> void
+// Runs the kernel benchmarks and prints the results. Only does anything in kernels built with KERNEL_BENCH.
+void run_benchmarks() {
+}
+
+#endif /* KERNEL_BENCH */
@@ -0,0 +1,8 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// run_benchmarks() -> void
+// Runs the kernel benchmarks and prints the results. Only does anything in kernels built with KERNEL_BENCH.
+void run_benchmarks();
+
+#endif /* BENCH_H */
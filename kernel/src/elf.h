@@ -1,6 +1,7 @@
 #ifndef ELF_H
 #define ELF_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -51,6 +52,12 @@ typedef struct {
     elf_header_t* header;
     char* string_table;
     size_t size;
+
+    // Set if the file starts on a page boundary in memory that is never freed, so its pages can be mapped into tasks directly
+    bool mappable;
+
+    // Physical pages with the loaded contents of each segment, indexed like the program headers, or null for segments loaded from the file. Filled in by the image cache
+    void** segment_frames;
 } elf_t;
 
 // verify_elf(void* data, size_t size) -> elf_t
@@ -175,3 +175,57 @@ void* read_file_full(fat16_fs_t* fs, char* name, size_t* size_ptr) {
     *size_ptr = entry->file.file_size;
     return data;
 }
+
+// get_file_contiguous(fat16_fs_t*, char*, size_t*) -> void*
+// Returns a pointer to the data of a file in the image itself if its clusters are consecutive, storing the size in the given buffer. Returns NULL if the file doesn't exist or is fragmented.
+void* get_file_contiguous(fat16_fs_t* fs, char* name, size_t* size_ptr) {
+    fat_root_dir_entry_t* entry = find_file_in_root_directory(fs, name);
+    if (entry == NULL)
+        return NULL;
+
+    size_t size = fs->sectors_per_cluster * fs->bytes_per_sector;
+    size_t clusters = (entry->file.file_size + size - 1) / size;
+    uint32_t first = entry->file.first_cluster_low;
+    uint32_t cluster_id = first;
+    for (size_t i = 1; i < clusters; i++) {
+        uint32_t next = get_next_cluster(fs, cluster_id);
+        if (next != cluster_id + 1)
+            return NULL;
+        cluster_id = next;
+    }
+
+    void* data = get_fat_cluster_data(fs, first);
+    if (data == NULL)
+        return NULL;
+
+    *size_ptr = entry->file.file_size;
+    return data;
+}
+
+// get_file_data(fat16_fs_t*, fat_root_dir_entry_t*, size_t, size_t*) -> void*
+// Returns a pointer to the byte at the given offset of a file in the image itself, storing how many bytes of the file from there on are in consecutive clusters. Returns NULL if the offset is past the end of the file.
+void* get_file_data(fat16_fs_t* fs, fat_root_dir_entry_t* file, size_t offset, size_t* contiguous_ptr) {
+    if (offset >= file->file.file_size)
+        return NULL;
+
+    size_t size = fs->sectors_per_cluster * fs->bytes_per_sector;
+    uint32_t cluster_id = file->file.first_cluster_low;
+    for (size_t i = offset / size; i > 0 && cluster_id != 0; i--)
+        cluster_id = get_next_cluster(fs, cluster_id);
+
+    void* data = get_fat_cluster_data(fs, cluster_id);
+    if (data == NULL)
+        return NULL;
+
+    // The run ends at the first cluster that isn't the next one over, or at the end of the file
+    size_t remaining = file->file.file_size - offset;
+    size_t contiguous = size - offset % size;
+    uint32_t next;
+    while (contiguous < remaining && (next = get_next_cluster(fs, cluster_id)) == cluster_id + 1) {
+        contiguous += size;
+        cluster_id = next;
+    }
+
+    *contiguous_ptr = contiguous < remaining ? contiguous : remaining;
+    return data + offset % size;
+}
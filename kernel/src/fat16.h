@@ -79,4 +79,12 @@ uint32_t get_next_cluster(fat16_fs_t* fs, uint32_t cluster_id);
 // Reads a file into a buffer, storing the size in the given buffer. Returns NULL on failure.
 void* read_file_full(fat16_fs_t* fs, char* name, size_t* size_ptr);
 
+// get_file_contiguous(fat16_fs_t*, char*, size_t*) -> void*
+// Returns a pointer to the data of a file in the image itself if its clusters are consecutive, storing the size in the given buffer. Returns NULL if the file doesn't exist or is fragmented.
+void* get_file_contiguous(fat16_fs_t* fs, char* name, size_t* size_ptr);
+
+// get_file_data(fat16_fs_t*, fat_root_dir_entry_t*, size_t, size_t*) -> void*
+// Returns a pointer to the byte at the given offset of a file in the image itself, storing how many bytes of the file from there on are in consecutive clusters. Returns NULL if the offset is past the end of the file.
+void* get_file_data(fat16_fs_t* fs, fat_root_dir_entry_t* file, size_t offset, size_t* contiguous_ptr);
+
 #endif /* FAT16_H */
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stddef.h>
 
 #include "fdt.h"
@@ -277,6 +278,62 @@ void* fdt_path(fdt_t* fdt, char* path, void* last) {
     return (void*) 0;
 }
 
+// fdt_next_child(fdt_t*, void*, void*) -> void*
+// Finds the next direct child of a device tree node, or the first child if last is null. Returns null when there are no more children.
+void* fdt_next_child(fdt_t* fdt, void* node, void* last) {
+    (void) fdt;
+    void* ptr = last != (void*) 0 ? last : node;
+    if (be_to_le(32, ptr) != FDT_BEGIN_NODE)
+        return (void*) 0;
+
+    // Skip the whole previous child first, if there is one
+    bool skipping = last != (void*) 0;
+    uint64_t depth = 0;
+    uint64_t current;
+    while ((current = be_to_le(32, ptr)) != FDT_END) {
+        switch ((fdt_node_type_t) current) {
+            case FDT_BEGIN_NODE: {
+                if (!skipping && depth == 1)
+                    return ptr;
+
+                depth++;
+                char* c = ptr + 4;
+                while (*c++);
+                ptr = (void*) ((uint64_t) (c + 3) & ~0x3);
+                break;
+            }
+
+            case FDT_END_NODE:
+                ptr += 4;
+                if (!skipping)
+                    return (void*) 0;
+
+                depth--;
+                if (depth == 0) {
+                    skipping = false;
+                    depth = 1;
+                }
+                break;
+
+            case FDT_PROP:
+                ptr += 4;
+                uint32_t len = be_to_le(32, ptr);
+                ptr += 8;
+                ptr = (void*) ((uint64_t) (ptr + len + 3) & ~0x3);
+                break;
+
+            case FDT_NOP:
+                ptr += 4;
+                break;
+
+            case FDT_END:
+                break;
+        }
+    }
+
+    return (void*) 0;
+}
+
 // fdt_get_node_addr(void*) -> uint64_t
 // Gets the address after the @ sign in a device tree node.
 uint64_t fdt_get_node_addr(void* node) {
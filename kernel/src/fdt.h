@@ -66,6 +66,10 @@ void* fdt_find(fdt_t* fdt, char* name, void* last);
 // Finds a device tree node with the given path. Returns null on failure.
 void* fdt_path(fdt_t* fdt, char* path, void* last);
 
+// fdt_next_child(fdt_t*, void*, void*) -> void*
+// Finds the next direct child of a device tree node, or the first child if last is null. Returns null when there are no more children.
+void* fdt_next_child(fdt_t* fdt, void* node, void* last);
+
 // fdt_get_node_addr(void*) -> uint64_t
 // Gets the address after the @ sign in a device tree node.
 uint64_t fdt_get_node_addr(void* node);
@@ -0,0 +1,78 @@
+#include <stdbool.h>
+
+#include "file_map.h"
+#include "memory.h"
+
+static fat16_fs_t initrd = { 0 };
+
+// init_file_maps(fat16_fs_t*) -> void
+// Keeps the initrd file system for mapping its files into tasks.
+void init_file_maps(fat16_fs_t* fs) {
+    initrd = *fs;
+}
+
+// map_file(struct s_task*, char*, size_t, size_t, int) -> void*
+// Reserves page_count pages in the task's address space for the file in the initrd with the given name, starting at the page aligned offset. The pages are populated by handle_page_fault. Returns NULL on failure.
+void* map_file(struct s_task* task, char* name, size_t offset, size_t page_count, int flags) {
+    if (initrd.fat == NULL || page_count == 0)
+        return NULL;
+
+    fat_root_dir_entry_t* file = find_file_in_root_directory(&initrd, name);
+    if (file == NULL || offset >= file->file.file_size)
+        return NULL;
+
+    void* result = task->last_virtual_page;
+    if (!reserve_file_range(task, result, page_count, flags | MMU_BIT_USER, file, offset))
+        return NULL;
+    task->last_virtual_page += page_count * PAGE_SIZE;
+    return result;
+}
+
+// populate_file_range(struct mmu_root, struct lazy_region*, void*, size_t) -> int
+// Maps page_count pages of a file region. Whole pages of the file are mapped straight from the initrd, copy on write if the region is writable, and the rest are copied into zeroed pages. Returns 0 on success.
+int populate_file_range(struct mmu_root root, struct lazy_region* region, void* start, size_t page_count) {
+    int flags = region->flags | MMU_BIT_USER;
+    int shared_flags = flags & MMU_BIT_WRITE ? (flags & ~MMU_BIT_WRITE) | MMU_BIT_COW : flags;
+
+    void* page = start;
+    void* end = start + page_count * PAGE_SIZE;
+    while (page < end) {
+        size_t offset = region->file_offset + (page - region->start);
+        size_t contiguous;
+        void* data = get_file_data(&initrd, region->file, offset, &contiguous);
+
+        // Every task mapping the file shares the initrd's frames, which the allocator doesn't own, so they are never written or freed
+        if (data != NULL && ((intptr_t) data & (PAGE_SIZE - 1)) == 0 && contiguous >= PAGE_SIZE) {
+            size_t count = contiguous / PAGE_SIZE;
+            if (count > (size_t) (end - page) / PAGE_SIZE)
+                count = (end - page) / PAGE_SIZE;
+            if (mmu_map_range(root, page, safe2phys(data), count, shared_flags))
+                return -1;
+            page += count * PAGE_SIZE;
+            continue;
+        }
+
+        // The last page of the file, pages past its end, and files with clusters smaller than a page are copied, so that nothing past the end of the file shows
+        void* frame = alloc_pages(1);
+        if (frame == NULL)
+            return -1;
+
+        void* copy = phys2safe(frame);
+        size_t copied = 0;
+        while (data != NULL && copied < PAGE_SIZE) {
+            size_t size = PAGE_SIZE - copied;
+            if (size > contiguous)
+                size = contiguous;
+            memcpy(copy + copied, data, size);
+            copied += size;
+            data = get_file_data(&initrd, region->file, offset + copied, &contiguous);
+        }
+
+        if (mmu_map_range(root, page, frame, 1, flags)) {
+            dealloc_pages(frame, 1);
+            return -1;
+        }
+        page += PAGE_SIZE;
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <stddef.h>
+
+#include "fat16.h"
+#include "mmu.h"
+#include "process.h"
+
+// init_file_maps(fat16_fs_t*) -> void
+// Keeps the initrd file system for mapping its files into tasks.
+void init_file_maps(fat16_fs_t* fs);
+
+// map_file(struct s_task*, char*, size_t, size_t, int) -> void*
+// Reserves page_count pages in the task's address space for the file in the initrd with the given name, starting at the page aligned offset. The pages are populated by handle_page_fault. Returns NULL on failure.
+void* map_file(struct s_task* task, char* name, size_t offset, size_t page_count, int flags);
+
+// populate_file_range(struct mmu_root, struct lazy_region*, void*, size_t) -> int
+// Maps page_count pages of a file region. Whole pages of the file are mapped straight from the initrd, copy on write if the region is writable, and the rest are copied into zeroed pages. Returns 0 on success.
+int populate_file_range(struct mmu_root root, struct lazy_region* region, void* start, size_t page_count);
+
+#endif /* FILE_MAP_H */
@@ -0,0 +1,256 @@
+#include <stdbool.h>
+
+#include "console.h"
+#include "image.h"
+#include "memory.h"
+#include "mmu.h"
+#include "sync.h"
+
+// Executables are cached by the directory entry they were read from. An
+// image holds the verified elf_t and, for files that can't be mapped in
+// place, one run of pages per read-only segment with the segment loaded.
+// spawn_task_from_elf maps those pages into every new task and takes a
+// reference to them, so evicting an image only drops the cache's own
+// reference. Images in use by a spawn are never evicted; unused ones are
+// dropped by the shrinker or when their slot is needed for another file.
+static struct exec_image images[IMAGE_CACHE_SIZE];
+static struct image_cache_stats image_stats = { 0 };
+static uint64_t image_clock = 0;
+static bool shrinker_registered = false;
+DEFINE_SPINLOCK(mutating_image_cache);
+
+// release_image(struct exec_image*) -> size_t
+// Drops the cache's references to the pages of an image that is no longer in the cache. Returns the number of pages released.
+static size_t release_image(struct exec_image* image) {
+    size_t released = 0;
+    for (size_t i = 0; i < IMAGE_MAX_SEGMENTS; i++) {
+        if (image->segment_frames[i] != NULL) {
+            dealloc_pages(image->segment_frames[i], image->segment_pages[i]);
+            released += image->segment_pages[i];
+        }
+    }
+
+    if (image->copy != NULL) {
+        dealloc_pages(image->copy, image->copy_pages);
+        released += image->copy_pages;
+    }
+    return released;
+}
+
+// shrink_image_cache(size_t) -> size_t
+// Evicts unused images until the given number of pages is released. Returns the number of pages released.
+static size_t shrink_image_cache(size_t count) {
+    if (!spin_try_lock(&mutating_image_cache))
+        return 0;
+
+    size_t released = 0;
+    for (size_t i = 0; i < IMAGE_CACHE_SIZE && released < count; i++) {
+        if (images[i].key == NULL || images[i].users != 0)
+            continue;
+
+        released += release_image(&images[i]);
+        images[i] = (struct exec_image) { 0 };
+        image_stats.evictions++;
+    }
+
+    spin_unlock(&mutating_image_cache);
+    return released;
+}
+
+// read_image_file(fat16_fs_t*, char*, fat_root_dir_entry_t*, struct exec_image*) -> void*
+// Finds the data of a file, used in place if its clusters are consecutive and otherwise copied into pages owned by the image.
+static void* read_image_file(fat16_fs_t* fs, char* name, fat_root_dir_entry_t* entry, struct exec_image* image) {
+    size_t size;
+    void* data = get_file_contiguous(fs, name, &size);
+    if (data != NULL)
+        return data;
+
+    size_t cluster_size = fs->sectors_per_cluster * fs->bytes_per_sector;
+    size_t pages = (entry->file.file_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    void* copy = alloc_pages_nozero(pages);
+    if (copy == NULL)
+        return NULL;
+    image->copy = copy;
+    image->copy_pages = pages;
+
+    void* safe = phys2safe(copy);
+    size_t copied = 0;
+    void* cluster_data;
+    for (uint32_t cluster_id = entry->file.first_cluster_low;
+        copied < entry->file.file_size && (cluster_data = get_fat_cluster_data(fs, cluster_id));
+        cluster_id = get_next_cluster(fs, cluster_id)) {
+        size_t length = entry->file.file_size - copied;
+        if (length > cluster_size)
+            length = cluster_size;
+        memcpy(safe + copied, cluster_data, length);
+        copied += length;
+    }
+    return safe;
+}
+
+// load_image_segments(struct exec_image*) -> bool
+// Loads every read-only segment into pages of its own. Each page is filled from the same place in the file it would be mapped from, so a page shared with a neighbouring segment holds both. Returns false if memory runs out.
+static bool load_image_segments(struct exec_image* image) {
+    elf_t* elf = &image->elf;
+    if (elf->header->program_header_num > IMAGE_MAX_SEGMENTS)
+        return true;
+
+    for (size_t i = 0; i < elf->header->program_header_num; i++) {
+        elf_program_header_t* program_header = get_elf_program_header(elf, i);
+        if (program_header->type != 1 || (program_header->flags & 0x2) != 0 || program_header->memory_size == 0)
+            continue;
+
+        size_t offset = program_header->virtual_addr % PAGE_SIZE;
+        size_t pages = (program_header->memory_size + offset + PAGE_SIZE - 1) / PAGE_SIZE;
+        void* frames = alloc_pages(pages);
+        if (frames == NULL)
+            return false;
+        image->segment_frames[i] = frames;
+        image->segment_pages[i] = pages;
+
+        // Bytes of the file before the segment, clipped to the start of the file
+        void* safe = phys2safe(frames);
+        size_t skip = 0;
+        uint64_t file_start = program_header->offset - offset;
+        if (program_header->offset < offset) {
+            skip = offset - program_header->offset;
+            file_start = 0;
+        }
+
+        size_t length = pages * PAGE_SIZE - skip;
+        if (file_start + length > elf->size)
+            length = file_start < elf->size ? elf->size - file_start : 0;
+        memcpy(safe + skip, (void*) elf->header + file_start, length);
+
+        // Zero the part of the segment past its file data
+        size_t file_end = offset + program_header->file_size;
+        size_t memory_end = offset + program_header->memory_size;
+        if (memory_end > file_end)
+            memset(safe + file_end, 0, memory_end - file_end);
+    }
+
+    elf->segment_frames = image->segment_frames;
+    return true;
+}
+
+// get_exec_image(fat16_fs_t*, char*) -> struct exec_image*
+// Returns the verified executable with the given name in the file system, loading it into the cache if it isn't there yet. Returns NULL on failure. Every image returned must be given back with put_exec_image.
+struct exec_image* get_exec_image(fat16_fs_t* fs, char* name) {
+    fat_root_dir_entry_t* entry = find_file_in_root_directory(fs, name);
+    if (entry == NULL)
+        return NULL;
+
+    spin_lock(&mutating_image_cache);
+    for (size_t i = 0; i < IMAGE_CACHE_SIZE; i++) {
+        if (images[i].key == entry) {
+            images[i].users++;
+            images[i].last_used = ++image_clock;
+            image_stats.hits++;
+            spin_unlock(&mutating_image_cache);
+            return &images[i];
+        }
+    }
+    image_stats.misses++;
+    spin_unlock(&mutating_image_cache);
+
+    // Build the image outside the lock, since allocating can call the shrinker
+    struct exec_image image = { .key = entry };
+    void* data = read_image_file(fs, name, entry, &image);
+    image.elf = verify_elf(data, entry->file.file_size);
+    if (image.elf.header == NULL) {
+        release_image(&image);
+        return NULL;
+    }
+    image.elf.mappable = image.copy == NULL && ((intptr_t) data & (PAGE_SIZE - 1)) == 0;
+    if (!image.elf.mappable && !load_image_segments(&image)) {
+        console_printf("[get_exec_image] unable to load segments of %s\n", name);
+        release_image(&image);
+        return NULL;
+    }
+    image.users = 1;
+
+    // Take a free slot or evict the least recently used image nobody is using
+    struct exec_image* slot = NULL;
+    struct exec_image victim = { 0 };
+    spin_lock(&mutating_image_cache);
+    for (size_t i = 0; i < IMAGE_CACHE_SIZE; i++) {
+        if (images[i].key == entry) {
+            // Another hart loaded the same file in the meantime
+            images[i].users++;
+            images[i].last_used = ++image_clock;
+            spin_unlock(&mutating_image_cache);
+            release_image(&image);
+            return &images[i];
+        }
+
+        if (images[i].key == NULL) {
+            if (slot == NULL || slot->key != NULL)
+                slot = &images[i];
+        } else if (images[i].users == 0 && (slot == NULL || (slot->key != NULL && images[i].last_used < slot->last_used))) {
+            slot = &images[i];
+        }
+    }
+
+    if (slot == NULL) {
+        spin_unlock(&mutating_image_cache);
+        console_printf("[get_exec_image] every cached image is in use, unable to cache %s\n", name);
+        release_image(&image);
+        return NULL;
+    }
+
+    if (slot->key != NULL) {
+        victim = *slot;
+        image_stats.evictions++;
+    }
+
+    image.last_used = ++image_clock;
+    if (image.elf.segment_frames != NULL)
+        image.elf.segment_frames = slot->segment_frames;
+    *slot = image;
+    bool first = !shrinker_registered;
+    shrinker_registered = true;
+    spin_unlock(&mutating_image_cache);
+
+    if (first)
+        register_shrinker(shrink_image_cache);
+
+    if (victim.key != NULL)
+        release_image(&victim);
+    return slot;
+}
+
+// put_exec_image(struct exec_image*) -> void
+// Gives back an image returned by get_exec_image. Unused images stay cached until memory runs low or their slot is needed.
+void put_exec_image(struct exec_image* image) {
+    spin_lock(&mutating_image_cache);
+    image->users--;
+    spin_unlock(&mutating_image_cache);
+}
+
+// get_image_cache_stats() -> struct image_cache_stats
+// Returns the image cache counters.
+struct image_cache_stats get_image_cache_stats() {
+    spin_lock(&mutating_image_cache);
+    struct image_cache_stats stats = image_stats;
+    spin_unlock(&mutating_image_cache);
+    return stats;
+}
+
+// debug_image_cache() -> void
+// Prints out the image cache counters and the cached images.
+void debug_image_cache() {
+    struct image_cache_stats stats = get_image_cache_stats();
+    console_printf("[image_cache] 0x%lx hits, 0x%lx misses, 0x%lx evictions\n", stats.hits, stats.misses, stats.evictions);
+
+    for (size_t i = 0; i < IMAGE_CACHE_SIZE; i++) {
+        if (images[i].key == NULL)
+            continue;
+
+        size_t pages = images[i].copy_pages;
+        for (size_t j = 0; j < IMAGE_MAX_SEGMENTS; j++) {
+            pages += images[i].segment_pages[j];
+        }
+        console_printf("[image_cache] %p: 0x%lx bytes, 0x%lx pages, %s, 0x%lx users\n",
+            images[i].elf.header, images[i].elf.size, pages, images[i].elf.mappable ? "mapped in place" : "copied", images[i].users);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "elf.h"
+#include "fat16.h"
+
+#define IMAGE_CACHE_SIZE   16
+#define IMAGE_MAX_SEGMENTS 16
+
+struct exec_image {
+    // Directory entry the file was read from, which identifies it. Null for free slots
+    const void* key;
+    elf_t elf;
+
+    // Pages holding a copy of a fragmented file, or null if the file is used in place
+    void* copy;
+    size_t copy_pages;
+
+    // Physical pages with the loaded contents of each read-only segment, indexed like the program headers, for files that can't be mapped in place
+    void* segment_frames[IMAGE_MAX_SEGMENTS];
+    size_t segment_pages[IMAGE_MAX_SEGMENTS];
+
+    // Number of spawns using the image right now, which keeps it from being evicted
+    size_t users;
+    uint64_t last_used;
+};
+
+struct image_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+// get_exec_image(fat16_fs_t*, char*) -> struct exec_image*
+// Returns the verified executable with the given name in the file system, loading it into the cache if it isn't there yet. Returns NULL on failure. Every image returned must be given back with put_exec_image.
+struct exec_image* get_exec_image(fat16_fs_t* fs, char* name);
+
+// put_exec_image(struct exec_image*) -> void
+// Gives back an image returned by get_exec_image. Unused images stay cached until memory runs low or their slot is needed.
+void put_exec_image(struct exec_image* image);
+
+// get_image_cache_stats() -> struct image_cache_stats
+// Returns the image cache counters.
+struct image_cache_stats get_image_cache_stats();
+
+// debug_image_cache() -> void
+// Prints out the image cache counters and the cached images.
+void debug_image_cache();
+
+#endif /* IMAGE_H */
@@ -1,12 +1,16 @@
 #include <stddef.h>
 
 #include "console.h"
+#include "file_map.h"
 #include "interrupt.h"
+#include "memory.h"
 #include "mmu.h"
 #include "opensbi.h"
 #include "process.h"
+#include "shared_memory.h"
 #include "string.h"
 #include "time.h"
+#include "user_memory.h"
 #include "schedulers/scheduler.h"
 
 static void* plic_base;
@@ -26,20 +30,74 @@ extern void hart_suspend_resume(uint64_t hartid, trap_t* trap);
 
 const int PROCESS_QUANTUM = 100000;
 
+// Number of pages an idle hart zeroes for the pre-zeroed pool before suspending
+#define IDLE_ZERO_PAGE_BUDGET 16
+
+// Number of leaf page tables of dead address spaces an idle hart frees before suspending
+#define IDLE_TEARDOWN_BUDGET 32
+
+// user_page_flags(int, int*) -> bool
+// Converts PAGE_PERM_* permissions from a syscall to mmu flags, with write taking precedence over execute. Returns false if they don't make a leaf: pages need at least one permission, and writable pages must be readable.
+static bool user_page_flags(int permissions, int* flags) {
+    int perms = 0;
+    if (permissions & 2)
+        perms |= MMU_BIT_WRITE;
+    else if (permissions & 1)
+        perms |= MMU_BIT_EXEC;
+    if (permissions & 4)
+        perms |= MMU_BIT_READ;
+
+    if (perms == 0 || perms == MMU_BIT_WRITE)
+        return false;
+    *flags = perms;
+    return true;
+}
+
 // timer_switch(trap_t*) -> void
 // Switches to a new process, or suspends the hart if no process is available.
 trap_t *timer_switch(trap_t* trap) {
+    // The hart switches on its own frame, since once the outgoing task is queued again a hart that picks it up rewrites the hartid get_hartid reads from its frame
+    trap_t* idle = &traps[get_hartid()];
+    asm volatile("csrw sscratch, %0" : : "r" (idle));
     struct s_task *task = NULL;
+    time_t now = get_time();
     if (trap->pid >= 0) {
         task = get_task(trap->pid);
         if (task->state == TASK_STATE_RUNNING)
             task->state = TASK_STATE_READY;
-        schedule_task(task->pid, task->state, task->priority);
+
+        // The task starts waiting from here if it's still ready
+        task->scheduling.runtime += now - task->scheduling_since;
+        task->scheduling_since = now;
+        if (task->state != TASK_STATE_DEAD) {
+            // Shared memory revoked while the task ran here is unmapped before anything else can run it
+            release_revoked_shared_memory(task);
+
+            // The task can't run anywhere else until it is scheduled again, which the scan relies on
+            if (get_time() - task->working_set.last_scan >= WORKING_SET_INTERVAL)
+                scan_working_set(task);
+            schedule_task(task->pid, task->state, task->priority);
+        }
     }
 
     pid_t next_pid = next_scheduled_task();
 
+    // Once the outgoing task stops running here, the swap reclaimer can take its pages
+    if (task != NULL && trap->pid != next_pid)
+        spin_unlock(&task->memory_lock);
+
     if (next_pid < 0) {
+        // The frame of the task that was running can't be idled in, since its slot can be reused if it died, and another hart can pick it up otherwise
+        idle->pid = -1;
+        trap = idle;
+
+        // Idle harts keep no address space alive, and finish tearing down dead ones
+        set_kernel_mmu();
+        reap_mmu_tables(IDLE_TEARDOWN_BUDGET);
+        refill_zeroed_pages(IDLE_ZERO_PAGE_BUDGET);
+
+        // Idle harts wake up after a quantum to look for work queued on other harts
+        sbi_set_timer(get_time() + PROCESS_QUANTUM);
         sbi_hart_suspend(0, (unsigned long) hart_suspend_resume, (unsigned long) trap);
 
         // In the event that suspending doesn't work, just
@@ -64,27 +122,45 @@ trap_t *timer_switch(trap_t* trap) {
         uint64_t s = sstatus;
         asm volatile("csrw sstatus, %0" : "=r" (s));
 
+        struct s_task *next_task = get_task(next_pid);
+        next_task->scheduling.wait += now - next_task->scheduling_since;
+        next_task->scheduling.runs++;
+        next_task->scheduling_since = now;
+
         if (trap->pid == next_pid) {
             task->state = TASK_STATE_RUNNING;
             time_t next = get_time();
-            next += PROCESS_QUANTUM;
+            next += task_quantum(next_pid);
             sbi_set_timer(next);
             return trap;
         }
 
-        struct s_task *next_task = get_task(next_pid);
-        next_task->trap.hartid = trap->hartid;
-        next_task->trap.interrupt_stack = trap->interrupt_stack;
+        // The frame belongs to the hart that last ran the task until its lock is taken
+        spin_lock(&next_task->memory_lock);
+        next_task->trap.hartid = idle->hartid;
+        next_task->trap.interrupt_stack = idle->interrupt_stack;
         next_task->state = TASK_STATE_RUNNING;
-        set_mmu(next_task->mmu_data);
+        release_revoked_shared_memory(next_task);
+        set_mmu(&next_task->mmu_data);
 
         time_t next = get_time();
-        next += PROCESS_QUANTUM;
+        next += task_quantum(next_pid);
         sbi_set_timer(next);
         return &next_task->trap;
     }
 }
 
+// exit_task(trap_t*) -> trap_t*
+// Kills the task running in the given frame and switches away from it. The hart moves to its own frame first, since the task's slot, frame included, can be claimed by another hart as soon as it's dead.
+static trap_t *exit_task(trap_t* trap) {
+    trap_t* idle = &traps[trap->hartid];
+    pid_t pid = trap->pid;
+    idle->pid = -1;
+    asm volatile("csrw sscratch, %0" : : "r" (idle));
+    kill_process(pid);
+    return timer_switch(idle);
+}
+
 // init_interrupts(uint64_t, fdt_t*) -> void
 // Inits interrupts.
 void init_interrupts(uint64_t hartid, fdt_t* fdt) {
@@ -128,6 +204,24 @@ bool lock_stop(void* ref, int type, uint64_t value) {
     return (((type & 1) == 0) && !lock_equals(ref, type, value)) || (((type & 1) == 1) && lock_equals(ref, type, value));
 }
 
+// kernel_exception_fixup(uint64_t, uint64_t, uint64_t) -> uint64_t
+// Handles an exception the kernel took while handling a trap, returning the address to resume at. Page faults in user memory accesses are resolved like the task's own faults, and other faults there resume at the access's fixup. Any other exception is a kernel panic.
+uint64_t kernel_exception_fixup(uint64_t cause, uint64_t pc, uint64_t stval) {
+    uint64_t fixup = find_exception_fixup(pc);
+    if (fixup != 0) {
+        trap_t* trap;
+        asm volatile("csrr %0, sscratch" : "=r" (trap));
+        struct s_task *task = get_task(trap->pid);
+        if ((cause == 13 || cause == 15) && task && handle_page_fault(task, (void*) stval, cause))
+            return pc;
+        return fixup;
+    }
+
+    // TODO: indicate to other harts that kernel has panicked
+    console_printf("cause: %lx\ntrap value: %lx\ntrap location: %lx\nKERNEL PANIC! KERNEL FAULTED!\n", cause, stval, pc);
+    while(1);
+}
+
 trap_t *interrupt_handler(uint64_t cause, trap_t *trap) {
     if (cause & 0x8000000000000000) {
         cause &= 0x7fffffffffffffff;
@@ -141,7 +235,7 @@ trap_t *interrupt_handler(uint64_t cause, trap_t *trap) {
                 asm volatile("csrw sip, %0" : "=r" (sip));
                 if (!get_task(trap->pid)) {
                     // kill_process(trap->pid);
-                    timer_switch(trap);
+                    return timer_switch(trap);
                 }
                 break;
             }
@@ -195,95 +289,94 @@ trap_t *interrupt_handler(uint64_t cause, trap_t *trap) {
                     // uart_puts(char* message) -> void
                     // Writes a message to the UART port.
                     case 0: {
-                        char* message = (char*) trap->xs[REGISTER_A1];
+                        const char __user* message = (const char __user*) trap->xs[REGISTER_A1];
                         struct s_task* task = get_task(trap->pid);
-                        console_printf("[PID 0x%lx (%s) @ hartid 0x%lx] %s\n", trap->pid, task->name, trap->hartid, message);
+                        char buffer[256];
+                        int64_t length = strncpy_from_user(buffer, message, sizeof(buffer));
+                        if (length < 0) {
+                            console_printf("[PID 0x%lx (%s) @ hartid 0x%lx] <invalid message %p>\n", trap->pid, task->name, trap->hartid, (const void*) message);
+                            break;
+                        }
+
+                        // Messages longer than the buffer are printed a buffer at a time
+                        console_printf("[PID 0x%lx (%s) @ hartid 0x%lx] %s", trap->pid, task->name, trap->hartid, buffer);
+                        while (length == (int64_t) sizeof(buffer)) {
+                            message += sizeof(buffer) - 1;
+                            length = strncpy_from_user(buffer, message, sizeof(buffer));
+                            if (length > 0)
+                                console_puts(buffer);
+                        }
+                        console_puts("\n");
                         break;
                     }
 
                     // page_alloc(size_t page_count, int permissions) -> void*
                     // Allocates a page with the given permissions.
-                    // case 1: {
-                    //     size_t page_count = trap->xs[REGISTER_A1];
-                    //     int permissions = trap->xs[REGISTER_A2];
-
-                    //     int perms = 0;
-                    //     if (permissions & 2)
-                    //         perms |= MMU_BIT_WRITE;
-                    //     else if (permissions & 1)
-                    //         perms |= MMU_BIT_EXEC;
-                    //     if (permissions & 4)
-                    //         perms |= MMU_BIT_READ;
-
-                    //     struct mmu_root mmu = get_mmu();
-                    //     struct s_task *task = get_task(trap->pid);
-                    //     void* result = process->last_virtual_page;
-                    //     for (size_t i = 0; i < page_count; i++) {
-                    //         mmu_alloc(mmu, process->last_virtual_page, perms | MMU_BIT_VALID | MMU_BIT_USER);
-                    //         process->last_virtual_page += PAGE_SIZE;
-                    //     }
-                    //     unlock_process(process);
-                    //     trap->xs[REGISTER_A0] = (uint64_t) result;
-                    //     break;
-                    // }
+                    case 1: {
+                        size_t page_count = trap->xs[REGISTER_A1];
+                        int permissions = trap->xs[REGISTER_A2];
+
+                        int perms;
+                        if (!user_page_flags(permissions, &perms)) {
+                            trap->xs[REGISTER_A0] = 0;
+                            break;
+                        }
+
+                        // The pages are only reserved here and get allocated as they're touched
+                        struct s_task *task = get_task(trap->pid);
+                        void* result = task->last_virtual_page;
+                        if (!reserve_lazy_range(task, result, page_count, perms | MMU_BIT_USER)) {
+                            trap->xs[REGISTER_A0] = 0;
+                            break;
+                        }
+                        task->last_virtual_page += page_count * PAGE_SIZE;
+                        trap->xs[REGISTER_A0] = (uint64_t) result;
+                        break;
+                    }
 
                     // page_perms(void* page, size_t page_count, int permissions) -> int
                     // Changes the page's permissions. Returns 0 if successful and 1 if not.
-                    // case 2: {
-                    //     void* page = (void*) trap->xs[REGISTER_A1];
-                    //     size_t page_count = trap->xs[REGISTER_A2];
-                    //     int permissions = trap->xs[REGISTER_A3];
-
-                    //     int perms = 0;
-                    //     if (permissions & 2)
-                    //         perms |= MMU_BIT_WRITE;
-                    //     else if (permissions & 1)
-                    //         perms |= MMU_BIT_EXEC;
-                    //     if (permissions & 4)
-                    //         perms |= MMU_BIT_READ;
-
-                    //     struct mmu_root mmu = get_mmu();
-                    //     for (size_t i = 0; i < page_count; i++) {
-                    //         struct mmu_entry *entry =
-                    //             mmu_walk_to_entry(mmu, page + i * PAGE_SIZE);
-                    //         if (!entry
-                    //             || !mmu_entry_valid(*entry)
-                    //             || !mmu_entry_user(*entry)
-                    //             ) {
-                    //             trap->xs[REGISTER_A0] = 1;
-                    //             return trap;
-                    //         }
-                    //     }
-                    //     for (size_t i = 0; i < page_count; i++) {
-                    //         mmu_change_flags(mmu, page + PAGE_SIZE * i, perms | MMU_BIT_VALID | MMU_BIT_USER);
-                    //     }
-                    //     trap->xs[REGISTER_A0] = 0;
-                    //     break;
-                    // }
+                    case 2: {
+                        void* page = (void*) trap->xs[REGISTER_A1];
+                        size_t page_count = trap->xs[REGISTER_A2];
+                        int permissions = trap->xs[REGISTER_A3];
+
+                        int perms;
+                        if (!user_page_flags(permissions, &perms)) {
+                            trap->xs[REGISTER_A0] = 1;
+                            break;
+                        }
+
+                        // Pages that haven't been touched yet get the new permissions when they are populated, and keep the file they're read from
+                        // Shared memory is mapped with the rights of its capability, which page_perms can't change
+                        struct s_task *task = get_task(trap->pid);
+                        if (!task_range_owned(task, page, page_count) || task_range_shared(task, page, page_count)
+                            || !protect_lazy_range(task, page, page_count, perms | MMU_BIT_USER)) {
+                            trap->xs[REGISTER_A0] = 1;
+                            break;
+                        }
+                        mmu_change_flags_range(task->mmu_data, page, page_count, perms | MMU_BIT_USER);
+                        trap->xs[REGISTER_A0] = 0;
+                        break;
+                    }
 
-                    // // page_dealloc(void* page, size_t page_count) -> int
-                    // // Deallocates a page. Returns 0 if successful and 1 if not.
-                    // case 3: {
-                    //     void* page = (void*) trap->xs[REGISTER_A1];
-                    //     size_t page_count = trap->xs[REGISTER_A2];
-                    //     struct mmu_root mmu = get_mmu();
-                    //     for (size_t i = 0; i < page_count; i++) {
-                    //         struct mmu_entry *entry =
-                    //             mmu_walk_to_entry(mmu, page + i * PAGE_SIZE);
-                    //         if (!entry
-                    //             || !mmu_entry_valid(*entry)
-                    //             || !mmu_entry_user(*entry)
-                    //             ) {
-                    //             trap->xs[REGISTER_A0] = 1;
-                    //             return trap;
-                    //         }
-                    //     }
-                    //     for (size_t i = 0; i < page_count; i++) {
-                    //         dealloc_pages(mmu_remove(mmu, page + i * PAGE_SIZE), i);
-                    //     }
-                    //     trap->xs[REGISTER_A0] = 0;
-                    //     break;
-                    // }
+                    // page_dealloc(void* page, size_t page_count) -> int
+                    // Deallocates a page. Returns 0 if successful and 1 if not.
+                    case 3: {
+                        void* page = (void*) trap->xs[REGISTER_A1];
+                        size_t page_count = trap->xs[REGISTER_A2];
+
+                        // Shared memory is unmapped through its capability
+                        struct s_task *task = get_task(trap->pid);
+                        if (!task_range_owned(task, page, page_count) || task_range_shared(task, page, page_count)
+                            || !release_lazy_range(task, page, page_count)) {
+                            trap->xs[REGISTER_A0] = 1;
+                            break;
+                        }
+                        mmu_remove_range(task->mmu_data, page, page_count, true);
+                        trap->xs[REGISTER_A0] = 0;
+                        break;
+                    }
 
                     // // sleep(uint64_t seconds, uint64_t micros) -> void
                     // // Sleeps for the given amount of time.
@@ -344,15 +437,13 @@ trap_t *interrupt_handler(uint64_t cause, trap_t *trap) {
                     //     break;
                     // }
 
-                    // // exit(int64_t code) -> !
-                    // // Exits the current process.
-                    // case 7: {
-                    //     int64_t code = trap->xs[REGISTER_A1];
-                    //     (void) code; // TODO: use this
-                    //     kill_process(trap->pid);
-                    //     timer_switch(trap);
-                    //     break;
-                    // }
+                    // exit(int64_t code) -> !
+                    // Exits the current process.
+                    case 7: {
+                        int64_t code = trap->xs[REGISTER_A1];
+                        (void) code; // TODO: use this
+                        return exit_task(trap);
+                    }
 
                     // // set_fault_handler(void (*handler)(int cause, uint64_t pc, uint64_t sp, uint64_t fp)) -> void
                     // // Sets the fault handler for the current process.
@@ -480,12 +571,169 @@ trap_t *interrupt_handler(uint64_t cause, trap_t *trap) {
                     //     break;
                     // }
 
+                    // clone() -> pid_t
+                    // Creates a copy of the current process that shares its memory copy on write. Returns the pid of the copy in the original, 0 in the copy and -1 on failure.
+                    case 11: {
+                        struct s_task *child = clone_task(trap->pid);
+                        trap->xs[REGISTER_A0] = child ? (uint64_t) child->pid : (uint64_t) -1;
+                        break;
+                    }
+
+                    // working_set(pid_t pid, struct working_set_stats* stats) -> int
+                    // Gets the working set stats of a task, or of the current task if pid is -1. Returns 0 if successful and -1 if not.
+                    case 12: {
+                        pid_t pid = trap->xs[REGISTER_A1];
+                        struct working_set_stats __user* stats = (struct working_set_stats __user*) trap->xs[REGISTER_A2];
+                        struct s_task *task = get_task(pid == -1 ? trap->pid : pid);
+                        if (task == NULL || task->state == TASK_STATE_DEAD || task->state == TASK_STATE_CREATING) {
+                            trap->xs[REGISTER_A0] = (uint64_t) -1;
+                            break;
+                        }
+
+                        struct working_set_stats copy = task->working_set;
+                        trap->xs[REGISTER_A0] = (uint64_t) (int64_t) copy_to_user(stats, &copy, sizeof(copy));
+                        break;
+                    }
+
+                    // map_file(char* name, size_t offset, size_t page_count, int permissions) -> void*
+                    // Maps pages of a file in the initrd, which are read in as they're touched. Returns NULL on failure.
+                    case 13: {
+                        const char __user* name = (const char __user*) trap->xs[REGISTER_A1];
+                        size_t offset = trap->xs[REGISTER_A2];
+                        size_t page_count = trap->xs[REGISTER_A3];
+                        int permissions = trap->xs[REGISTER_A4];
+
+                        int perms;
+                        if (!user_page_flags(permissions, &perms)) {
+                            trap->xs[REGISTER_A0] = 0;
+                            break;
+                        }
+
+                        char buffer[256];
+                        int64_t length = strncpy_from_user(buffer, name, sizeof(buffer));
+                        if (length < 0 || length == (int64_t) sizeof(buffer) || (offset & (PAGE_SIZE - 1))) {
+                            trap->xs[REGISTER_A0] = 0;
+                            break;
+                        }
+
+                        struct s_task *task = get_task(trap->pid);
+                        trap->xs[REGISTER_A0] = (uint64_t) map_file(task, buffer, offset, page_count, perms);
+                        break;
+                    }
+
+                    // shm_create(size_t page_count) -> int64_t
+                    // Creates zeroed shared memory owned by the current process. Returns its capability, or -1 on failure.
+                    case 14: {
+                        size_t page_count = trap->xs[REGISTER_A1];
+                        trap->xs[REGISTER_A0] = (uint64_t) create_shared_memory(get_task(trap->pid), page_count);
+                        break;
+                    }
+
+                    // shm_map(int64_t cap) -> void*
+                    // Maps shared memory with the rights of the capability. Returns NULL on failure.
+                    case 15: {
+                        int64_t cap = trap->xs[REGISTER_A1];
+                        trap->xs[REGISTER_A0] = (uint64_t) map_shared_memory(get_task(trap->pid), cap);
+                        break;
+                    }
+
+                    // shm_unmap(int64_t cap) -> int
+                    // Unmaps shared memory. Returns 0 if successful and -1 if not.
+                    case 16: {
+                        int64_t cap = trap->xs[REGISTER_A1];
+                        trap->xs[REGISTER_A0] = (uint64_t) (int64_t) unmap_shared_memory(get_task(trap->pid), cap);
+                        break;
+                    }
+
+                    // shm_grant(int64_t cap, pid_t pid, int rights) -> int64_t
+                    // Gives another process a capability for the shared memory. Returns its capability in that process, or -1 on failure.
+                    case 17: {
+                        int64_t cap = trap->xs[REGISTER_A1];
+                        pid_t pid = trap->xs[REGISTER_A2];
+                        int rights = trap->xs[REGISTER_A3];
+                        trap->xs[REGISTER_A0] = (uint64_t) grant_shared_memory(get_task(trap->pid), cap, pid, rights);
+                        break;
+                    }
+
+                    // shm_revoke(int64_t cap) -> int
+                    // Takes back every capability granted for shared memory the current process owns. Returns 0 if successful and -1 if not.
+                    case 18: {
+                        int64_t cap = trap->xs[REGISTER_A1];
+                        trap->xs[REGISTER_A0] = (uint64_t) (int64_t) revoke_shared_memory(get_task(trap->pid), cap);
+                        break;
+                    }
+
+                    // shm_info(int64_t cap, size_t* page_count) -> int
+                    // Gets the size of shared memory. Returns the rights of the capability, or -1 if it isn't one.
+                    case 19: {
+                        int64_t cap = trap->xs[REGISTER_A1];
+                        size_t __user* page_count_ptr = (size_t __user*) trap->xs[REGISTER_A2];
+                        size_t page_count = 0;
+                        int rights = shared_memory_info(get_task(trap->pid), cap, &page_count);
+                        if (rights >= 0 && page_count_ptr != NULL && copy_to_user(page_count_ptr, &page_count, sizeof(page_count)))
+                            rights = -1;
+                        trap->xs[REGISTER_A0] = (uint64_t) (int64_t) rights;
+                        break;
+                    }
+
+                    // scheduler_stats(int64_t hartid, struct scheduler_stats* stats) -> int
+                    // Gets the scheduling counters of a hart. Returns 0 if successful and -1 if the hart doesn't exist.
+                    case 20: {
+                        uint64_t hartid = trap->xs[REGISTER_A1];
+                        struct scheduler_stats __user* stats = (struct scheduler_stats __user*) trap->xs[REGISTER_A2];
+                        struct scheduler_stats copy;
+                        if (!get_scheduler_stats(hartid, &copy)) {
+                            trap->xs[REGISTER_A0] = (uint64_t) -1;
+                            break;
+                        }
+                        trap->xs[REGISTER_A0] = (uint64_t) (int64_t) copy_to_user(stats, &copy, sizeof(copy));
+                        break;
+                    }
+
+                    // task_scheduler_stats(pid_t pid, struct task_scheduler_stats* stats) -> int
+                    // Gets the scheduling history of a task, or of the current task if pid is -1. Returns 0 if successful and -1 if not.
+                    case 21: {
+                        pid_t pid = trap->xs[REGISTER_A1];
+                        struct task_scheduler_stats __user* stats = (struct task_scheduler_stats __user*) trap->xs[REGISTER_A2];
+                        struct s_task *task = get_task(pid == -1 ? trap->pid : pid);
+                        if (task == NULL || task->state == TASK_STATE_DEAD || task->state == TASK_STATE_CREATING) {
+                            trap->xs[REGISTER_A0] = (uint64_t) -1;
+                            break;
+                        }
+
+                        struct task_scheduler_stats copy = task->scheduling;
+                        trap->xs[REGISTER_A0] = (uint64_t) (int64_t) copy_to_user(stats, &copy, sizeof(copy));
+                        break;
+                    }
+
+                    // yield() -> void
+                    // Gives up the rest of the current slice.
+                    case 22:
+                        return timer_switch(trap);
+
                     default:
                         console_printf("unknown syscall 0x%lx\n", trap->xs[REGISTER_A0]);
                         break;
                 }
                 break;
 
+            // Instruction page fault
+            case 12:
+
+            // Load page fault
+            case 13:
+
+            // Store page fault
+            case 15: {
+                uint64_t stval;
+                asm volatile("csrr %0, stval" : "=r" (stval));
+                struct s_task *task = get_task(trap->pid);
+                if (task && handle_page_fault(task, (void*) stval, cause))
+                    break;
+
+                // Faults outside of reserved memory are handled like every other fault
+            }
+
             // Instruction address misaligned
             case 0:
 
@@ -505,24 +753,15 @@ trap_t *interrupt_handler(uint64_t cause, trap_t *trap) {
             case 6:
 
             // Store access fault
-            case 7:
-
-            // Instruction page fault
-            case 12:
-
-            // Load page fault
-            case 13:
-
-            // Store page fault
-            case 15: {
+            case 7: {
+                uint64_t stval;
+                asm volatile("csrr %0, stval" : "=r" (stval));
                 struct s_task *task = get_task(trap->pid);
-                console_printf("cause: %lx\ntrap location: %lx\ntrap caller: %lx\ntrap process: %lx (%s)\n", cause, trap->pc, trap->xs[REGISTER_RA], trap->pid, task ? task->name : "<none>");
+                console_printf("cause: %lx\ntrap value: %lx\ntrap location: %lx\ntrap caller: %lx\ntrap process: %lx (%s)\n", cause, stval, trap->pc, trap->xs[REGISTER_RA], trap->pid, task ? task->name : "<none>");
+
                 // TODO: send segfault message
-                // if (trap->pid != 0) {
-                //     kill_process(trap->pid);
-                //     timer_switch(trap);
-                //     return trap;
-                // }
+                if (trap->pid != 0)
+                    return exit_task(trap);
 
                 // TODO: indicate to other harts that kernel has panicked
                 console_printf("KERNEL PANIC! INITD FAULTED!\n");
@@ -539,7 +778,9 @@ trap_t *interrupt_handler(uint64_t cause, trap_t *trap) {
         }
     }
 
-    if (should_switch_now(trap->pid, get_task(trap->pid)->priority))
+    // Idle harts have no task to preempt, and pick up new work on their next timer interrupt
+    struct s_task* current = get_task(trap->pid);
+    if (current != NULL && should_switch_now(trap->pid, current->priority))
         return timer_switch(trap);
     return trap;
 }
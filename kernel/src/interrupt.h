@@ -49,12 +49,23 @@ typedef struct {
 
     uint64_t hartid;
     pid_t pid;
+
+    // Lets the trap entry tell apart kernel exceptions without touching the saved registers
+    uint64_t kernel_scratch;
 } trap_t;
 
 #define MAX_TRAP_COUNT 64
 static trap_t traps[MAX_TRAP_COUNT];
 static size_t cpu_count = 0;
 
+// get_hartid() -> uint64_t
+// Returns the id of the current hart. sscratch always points to the trap frame of the hart.
+static inline uint64_t get_hartid() {
+    trap_t* trap;
+    asm volatile("csrr %0, sscratch" : "=r" (trap));
+    return trap->hartid;
+}
+
 // init_interrupts(uint64_t, fdt_t*) -> void
 // Inits interrupts.
 void init_interrupts(uint64_t hartid, fdt_t* fdt);
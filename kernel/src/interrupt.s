@@ -11,12 +11,25 @@ typedef struct {
 
     uint64_t hartid;
     pid_t pid;
+    uint64_t kernel_scratch;
 } trap_t;
 */
 .align 4
 handle_interrupt:
-    # Save registers
     csrrw t6, sscratch, t6
+
+    # Exceptions taken in supervisor mode come from the kernel itself, which
+    # must not overwrite the registers of the trap it is handling
+    sd t5, 0x220(t6)
+    csrr t5, sstatus
+    andi t5, t5, 0x100
+    beqz t5, 1f
+    csrr t5, scause
+    bgez t5, kernel_exception
+1:
+    ld t5, 0x220(t6)
+
+    # Save registers
     sd x0,  0x000(t6)
     sd x1,  0x008(t6)
     sd x2,  0x010(t6)
@@ -111,6 +124,54 @@ jump_out_of_trap:
     ld x31, 0x0f8(t6)
     sret
 
+kernel_exception:
+    # Restore t5 and t6 and save the caller saved registers on the kernel stack
+    ld t5, 0x220(t6)
+    csrrw t6, sscratch, t6
+    addi sp, sp, -0x80
+    sd ra,  0x00(sp)
+    sd t0,  0x08(sp)
+    sd t1,  0x10(sp)
+    sd t2,  0x18(sp)
+    sd t3,  0x20(sp)
+    sd t4,  0x28(sp)
+    sd t5,  0x30(sp)
+    sd t6,  0x38(sp)
+    sd a0,  0x40(sp)
+    sd a1,  0x48(sp)
+    sd a2,  0x50(sp)
+    sd a3,  0x58(sp)
+    sd a4,  0x60(sp)
+    sd a5,  0x68(sp)
+    sd a6,  0x70(sp)
+    sd a7,  0x78(sp)
+
+    # Find out where to resume, which never returns if the exception is fatal
+    csrr a0, scause
+    csrr a1, sepc
+    csrr a2, stval
+    jal kernel_exception_fixup
+    csrw sepc, a0
+
+    ld ra,  0x00(sp)
+    ld t0,  0x08(sp)
+    ld t1,  0x10(sp)
+    ld t2,  0x18(sp)
+    ld t3,  0x20(sp)
+    ld t4,  0x28(sp)
+    ld t5,  0x30(sp)
+    ld t6,  0x38(sp)
+    ld a0,  0x40(sp)
+    ld a1,  0x48(sp)
+    ld a2,  0x50(sp)
+    ld a3,  0x58(sp)
+    ld a4,  0x60(sp)
+    ld a5,  0x68(sp)
+    ld a6,  0x70(sp)
+    ld a7,  0x78(sp)
+    addi sp, sp, 0x80
+    sret
+
 hart_suspend_resume:
     # Set sp
     ld sp, 0x108(a1)
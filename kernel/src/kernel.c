@@ -1,19 +1,25 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "bench.h"
 #include "console.h"
 #include "elf.h"
 #include "fdt.h"
 #include "fat16.h"
+#include "file_map.h"
+#include "image.h"
 #include "interrupt.h"
 #include "memory.h"
 #include "mmu.h"
 #include "opensbi.h"
 #include "process.h"
+#include "swap.h"
 
 #define STACK_SIZE     0x8000
 
-void init_hart_helper(uint64_t hartid, struct mmu_root mmu) {
+// init_hart_helper(uint64_t) -> !
+// Sets up the trap frame of a hart and idles on the kernel template until the first timer interrupt. Secondary harts get here with paging off, so nothing allocated after paging was turned on may be touched before set_kernel_mmu.
+void init_hart_helper(uint64_t hartid) {
     extern int stack_top;
     trap_t* trap = &traps[hartid];
     trap->hartid = hartid;
@@ -25,7 +31,7 @@ void init_hart_helper(uint64_t hartid, struct mmu_root mmu) {
 
     uint64_t sstatus;
     asm volatile("csrr %0, sstatus" : "=r" (sstatus));
-    sstatus |= 1 << 18 | 1 << 8 | 1 << 5;
+    sstatus |= 1 << 8 | 1 << 5;
     uint64_t s = sstatus;
     asm volatile("csrw sstatus, %0" : "=r" (s));
 
@@ -34,13 +40,20 @@ void init_hart_helper(uint64_t hartid, struct mmu_root mmu) {
 
     extern void do_nothing();
 
-    set_mmu(mmu);
+    // Every hart switches to the shared kernel root rather than initd's, whose ASID fields belong to whichever hart runs initd
+    set_kernel_mmu();
+    init_ad_updates();
     trap->pc = (uint64_t) do_nothing;
     sbi_set_timer(0);
     jump_out_of_trap(trap);
 }
 
 void kinit(uint64_t hartid, void* fdt) {
+    trap_t* boot_trap = &traps[hartid];
+    boot_trap->hartid = hartid;
+    boot_trap->pid = -1;
+    asm volatile("csrw sscratch, %0" : : "r" (boot_trap));
+
     console_printf("[kinit] toki, ale o!\n[kinit] hartid: %lx\n[kinit] fdt pointer: %p\n", hartid, fdt);
 
     fdt_t devicetree = verify_fdt(fdt);
@@ -58,8 +71,9 @@ void kinit(uint64_t hartid, void* fdt) {
 
     console_printf("[kinit] %lx cpus present\n", cpu_count);
 
+    // init_pages keeps the device tree and the initrd out of the page allocator
     init_pages(&devicetree);
-    mark_as_used(&devicetree, (be_to_le(32, devicetree.header->totalsize) + PAGE_SIZE - 1) / PAGE_SIZE);
+    init_memory_routines(&devicetree);
 
     void* chosen = fdt_path(&devicetree, "/chosen", NULL);
     struct fdt_property initrd_start_prop = fdt_get_property(&devicetree, chosen, "linux,initrd-start");
@@ -68,9 +82,13 @@ void kinit(uint64_t hartid, void* fdt) {
     struct fdt_property initrd_end_prop = fdt_get_property(&devicetree, chosen, "linux,initrd-end");
     void* initrd_end = (void*) be_to_le(32, initrd_end_prop.data);
 
-    mark_as_used(initrd_start, (initrd_end - initrd_start + PAGE_SIZE - 1) / PAGE_SIZE);
     struct mmu_root top = create_mmu_table();
-    set_mmu(top);
+    set_mmu(&top);
+    init_asids();
+    if (init_ad_updates())
+        console_puts("[kinit] hardware updates accessed and dirty bits\n");
+    else
+        console_puts("[kinit] accessed and dirty bits are set on page faults\n");
 
     fdt_phys2safe(&devicetree);
     initrd_start = phys2safe(initrd_start);
@@ -87,42 +105,67 @@ void kinit(uint64_t hartid, void* fdt) {
     }
 
     console_puts("[kinit] verified initrd image\n");
+    init_file_maps(&fat);
     init_processes(64); // TODO: configure this
 
-    size_t size;
-    void* data = read_file_full(&fat, "initd", &size);
-    elf_t elf = verify_elf(data, size);
-    if (elf.header == NULL) {
+    struct exec_image* image = get_exec_image(&fat, "initd");
+    if (image == NULL) {
         console_puts("[kinit] failed to verify initd elf file\n");
         while(1);
     }
 
-    struct s_task *initd = spawn_task_from_elf("initd", 5, &elf, 2, 0, NULL);
-    free(data);
+    spawn_task_from_elf("initd", 5, &image->elf, 2, 0, NULL);
+    put_exec_image(image);
     console_puts("[kinit] succeeded initd loading\n");
 
-    data = read_file_full(&fat, "uwu", &size);
-    elf = verify_elf(data, size);
-    if (elf.header == NULL) {
+    // Run after initd has taken pid 0, so that tasks spawned by the benchmarks get page tables of their own
+#ifdef KERNEL_BENCH
+    run_benchmarks();
+#endif
+
+    image = get_exec_image(&fat, "uwu");
+    if (image == NULL) {
         console_puts("[kinit] failed to verify uwu elf file\n");
         while(1);
     }
 
-    spawn_task_from_elf("uwu", 3, &elf, 2, 0, NULL);
-    free(data);
+    spawn_task_from_elf("uwu", 3, &image->elf, 2, 0, NULL);
+    put_exec_image(image);
     console_puts("[kinit] succeeded uwu loading\n");
+#ifdef KERNEL_BENCH
+    debug_image_cache();
+#endif
+
+    // The swap reclaimer goes last among the shrinkers, since writing pages out costs more than dropping any cache
+    init_swap(&devicetree);
+
+    // The swap test is only in initrds built with SWAPTEST=1
+    image = get_exec_image(&fat, "swaptest");
+    if (image != NULL) {
+        spawn_task_from_elf("swaptest", 8, &image->elf, 2, 0, NULL);
+        put_exec_image(image);
+        console_puts("[kinit] succeeded swaptest loading\n");
+    }
 
-    struct mmu_root mmu = initd->mmu_data;
+    // Likewise, the scheduler test is only in initrds built with SCHEDTEST=1
+    image = get_exec_image(&fat, "schedtest");
+    if (image != NULL) {
+        spawn_task_from_elf("schedtest", 9, &image->elf, 2, 0, NULL);
+        put_exec_image(image);
+        console_puts("[kinit] succeeded schedtest loading\n");
+    }
 
+    // The kernel template is built here, since secondary harts can't allocate it with paging off
     console_puts("[kinit] initialising harts\n");
-    extern void init_hart(uint64_t hartid, struct mmu_root mmu);
+    set_kernel_mmu();
+    extern void init_hart(uint64_t hartid);
     for (size_t i = 0; i < cpu_count; i++) {
         if (i != hartid) {
-            sbi_hart_start(i, init_hart, (uint64_t) mmu.data);
+            sbi_hart_start(i, init_hart, 0);
         }
     }
 
-    init_hart_helper(hartid, initd->mmu_data);
+    init_hart_helper(hartid);
 
     while(1);
 }
@@ -2,15 +2,327 @@
 #include <stdbool.h>
 
 #include "console.h"
+#include "interrupt.h"
 #include "memory.h"
 #include "mmu.h"
 #include "sync.h"
 
 extern page_t pages_bottom;
-page_t* memory_start;
-page_t* heap_bottom;
 DEFINE_SPINLOCK(mutating_heap);
 
+// The page allocator is a binary buddy allocator over every memory region
+// listed in the device tree. Each region has its own free lists and its own
+// metadata: a reference count (uint16_t) and an order byte for each of its
+// pages, stored in the region itself (right after the kernel in the region the
+// kernel is loaded in). A free block of 2^order pages is marked by setting
+// BUDDY_FREE | order on its first page and is linked into the free list for
+// that order through a struct buddy_block stored in the block itself. Blocks
+// are aligned to their size in physical memory, not relative to the region.
+//
+// Ranges listed in the device tree reservation block or under
+// /reserved-memory, the device tree itself, the initrd and everything up to
+// the end of the kernel in its region are never put on a free list.
+//
+// Every region and hart may carry a numa-node-id. Allocations are served from
+// regions on the requesting hart's node first and fall back to the others.
+#define BUDDY_MAX_ORDER     18
+#define BUDDY_ORDER_COUNT   (BUDDY_MAX_ORDER + 1)
+#define BUDDY_FREE          0x80
+
+#define MAX_PAGE_REGIONS    8
+#define MAX_RESERVED_RANGES 32
+
+// Only the first 256 GiB of physical memory is covered by the kernel's direct map
+#define PHYS_ADDR_LIMIT     ((page_t*) 0x4000000000)
+
+struct buddy_block {
+    page_t* next;
+    page_t* prev;
+};
+
+struct page_region {
+    page_t* start;
+    page_t* end;
+    size_t page_count;
+    size_t base;
+    uint32_t node;
+    _Atomic uint16_t* ref_counts;
+    uint8_t* orders;
+    page_t* meta_end;
+    page_t* free_lists[BUDDY_ORDER_COUNT];
+};
+
+struct reserved_range {
+    page_t* start;
+    page_t* end;
+};
+
+static struct page_region regions[MAX_PAGE_REGIONS];
+static size_t region_count = 0;
+static struct reserved_range reserved_ranges[MAX_RESERVED_RANGES];
+static size_t reserved_count = 0;
+static uint32_t hart_nodes[MAX_TRAP_COUNT];
+
+static inline struct buddy_block* buddy_block(struct page_region* region, size_t index) {
+    return phys2safe(region->start + index);
+}
+
+// buddy_push(struct page_region*, size_t, size_t) -> void
+// Adds a free block to the free list of the given order.
+static void buddy_push(struct page_region* region, size_t index, size_t order) {
+    struct buddy_block* block = buddy_block(region, index);
+    block->prev = NULL;
+    block->next = region->free_lists[order];
+    if (region->free_lists[order] != NULL)
+        buddy_block(region, region->free_lists[order] - region->start)->prev = region->start + index;
+    region->free_lists[order] = region->start + index;
+    region->orders[index] = BUDDY_FREE | order;
+}
+
+// buddy_remove(struct page_region*, size_t, size_t) -> void
+// Removes a free block from the free list of the given order.
+static void buddy_remove(struct page_region* region, size_t index, size_t order) {
+    struct buddy_block* block = buddy_block(region, index);
+    if (block->prev != NULL)
+        buddy_block(region, block->prev - region->start)->next = block->next;
+    else region->free_lists[order] = block->next;
+    if (block->next != NULL)
+        buddy_block(region, block->next - region->start)->prev = block->prev;
+    region->orders[index] = 0;
+}
+
+// buddy_free_block(struct page_region*, size_t, size_t) -> void
+// Returns a block to the allocator, merging it with its buddies where possible.
+static void buddy_free_block(struct page_region* region, size_t index, size_t order) {
+    while (order < BUDDY_MAX_ORDER) {
+        // Buddies that would lie outside of the region wrap around to a huge index
+        size_t buddy = ((region->base + index) ^ ((size_t) 1 << order)) - region->base;
+        if (buddy >= region->page_count || region->orders[buddy] != (BUDDY_FREE | order))
+            break;
+
+        buddy_remove(region, buddy, order);
+        if (buddy < index)
+            index = buddy;
+        order++;
+    }
+
+    buddy_push(region, index, order);
+}
+
+// buddy_free_range(struct page_region*, size_t, size_t) -> void
+// Returns a range of pages to the allocator as the largest aligned blocks possible.
+static void buddy_free_range(struct page_region* region, size_t index, size_t count) {
+    while (count > 0) {
+        size_t order = 0;
+        while (order < BUDDY_MAX_ORDER
+            && ((region->base + index) & ((size_t) 1 << order)) == 0
+            && ((size_t) 2 << order) <= count)
+            order++;
+
+        buddy_free_block(region, index, order);
+        index += (size_t) 1 << order;
+        count -= (size_t) 1 << order;
+    }
+}
+
+// buddy_reserve(struct page_region*, size_t) -> void
+// Takes a single free page out of whichever free block contains it.
+static void buddy_reserve(struct page_region* region, size_t index) {
+    for (size_t order = 0; order < BUDDY_ORDER_COUNT; order++) {
+        size_t head = ((region->base + index) & ~(((size_t) 1 << order) - 1)) - region->base;
+        if (head > index)
+            return;
+        if (region->orders[head] != (BUDDY_FREE | order))
+            continue;
+
+        buddy_remove(region, head, order);
+        while (order > 0) {
+            order--;
+            size_t half = (size_t) 1 << order;
+            if (index < head + half) {
+                buddy_push(region, head + half, order);
+            } else {
+                buddy_push(region, head, order);
+                head += half;
+            }
+        }
+        return;
+    }
+}
+
+// buddy_alloc(struct page_region*, size_t) -> size_t
+// Allocates a block of the given order, splitting larger blocks if necessary. Returns SIZE_MAX on failure.
+static size_t buddy_alloc(struct page_region* region, size_t order) {
+    size_t found = order;
+    while (found < BUDDY_ORDER_COUNT && region->free_lists[found] == NULL)
+        found++;
+    if (found == BUDDY_ORDER_COUNT)
+        return SIZE_MAX;
+
+    size_t index = region->free_lists[found] - region->start;
+    buddy_remove(region, index, found);
+    while (found > order) {
+        found--;
+        buddy_push(region, index + ((size_t) 1 << found), found);
+    }
+
+    return index;
+}
+
+// buddy_alloc_near(size_t, struct page_region**) -> page_t*
+// Allocates a block of the given order, preferring regions on the current hart's node. Returns null on failure.
+static page_t* buddy_alloc_near(size_t order, struct page_region** region_out) {
+    uint32_t node = hart_nodes[get_hartid()];
+
+    for (int local = 1; local >= 0; local--) {
+        for (size_t i = 0; i < region_count; i++) {
+            struct page_region* region = &regions[i];
+            if ((region->node == node) != local)
+                continue;
+
+            size_t index = buddy_alloc(region, order);
+            if (index != SIZE_MAX) {
+                if (region_out != NULL)
+                    *region_out = region;
+                return region->start + index;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// page_region(page_t*) -> struct page_region*
+// Returns the region the page belongs to, or null if the page allocator doesn't manage it.
+static struct page_region* page_region(page_t* page) {
+    for (size_t i = 0; i < region_count; i++) {
+        if (page >= regions[i].start && page < regions[i].end)
+            return &regions[i];
+    }
+    return NULL;
+}
+
+// fdt_cells(fdt_t*, void*, char*, uint32_t) -> uint32_t
+// Reads a #address-cells or #size-cells property, returning the default if the node doesn't have it.
+static uint32_t fdt_cells(fdt_t* tree, void* node, char* key, uint32_t fallback) {
+    struct fdt_property prop = fdt_get_property(tree, node, key);
+    if (prop.data == NULL)
+        return fallback;
+    return be_to_le(32, prop.data);
+}
+
+// fdt_node_id(fdt_t*, void*) -> uint32_t
+// Reads the numa-node-id of a node, defaulting to node 0.
+static uint32_t fdt_node_id(fdt_t* tree, void* node) {
+    struct fdt_property prop = fdt_get_property(tree, node, "numa-node-id");
+    if (prop.data == NULL)
+        return 0;
+    return be_to_le(32, prop.data);
+}
+
+// reserve_range(void*, void*) -> void
+// Keeps the pages overlapping the given physical range away from the page allocator.
+static void reserve_range(void* start, void* end) {
+    if (start >= end)
+        return;
+
+    if (reserved_count == MAX_RESERVED_RANGES) {
+        console_printf("[init_pages] too many reserved ranges, ignoring %p-%p\n", start, end);
+        return;
+    }
+
+    reserved_ranges[reserved_count++] = (struct reserved_range) {
+        .start = (page_t*) ((uintptr_t) start & ~(PAGE_SIZE - 1)),
+        .end = (page_t*) (((uintptr_t) end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+    };
+}
+
+// first_reservation(page_t*, page_t*, struct reserved_range*) -> bool
+// Finds the lowest reserved range overlapping the given range.
+static bool first_reservation(page_t* start, page_t* end, struct reserved_range* found) {
+    bool any = false;
+    for (size_t i = 0; i < reserved_count; i++) {
+        struct reserved_range* range = &reserved_ranges[i];
+        if (range->start < end && range->end > start && (!any || range->start < found->start)) {
+            *found = *range;
+            any = true;
+        }
+    }
+    return any;
+}
+
+// add_region(uint64_t, uint64_t, uint32_t) -> void
+// Adds a range of physical memory from the device tree to the list of regions.
+static void add_region(uint64_t addr, uint64_t size, uint32_t node) {
+    page_t* start = (page_t*) ((addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    page_t* end = (page_t*) ((addr + size) & ~(PAGE_SIZE - 1));
+    if (end > PHYS_ADDR_LIMIT)
+        end = PHYS_ADDR_LIMIT;
+    if (start >= end)
+        return;
+
+    if (region_count == MAX_PAGE_REGIONS) {
+        console_printf("[init_pages] too many memory regions, ignoring %p-%p\n", start, end);
+        return;
+    }
+
+    regions[region_count++] = (struct page_region) {
+        .start = start,
+        .end = end,
+        .page_count = end - start,
+        .base = (uintptr_t) start / PAGE_SIZE,
+        .node = node
+    };
+}
+
+// init_region(struct page_region*) -> bool
+// Places the metadata of a region and frees all of its unreserved pages. Returns false if the metadata doesn't fit.
+static bool init_region(struct page_region* region) {
+    size_t meta_size = region->page_count * (sizeof(uint16_t) + sizeof(uint8_t));
+    size_t meta_pages = (meta_size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    page_t* meta = region->start;
+    struct reserved_range range;
+    while (meta + meta_pages <= region->end && first_reservation(meta, meta + meta_pages, &range)) {
+        meta = range.end;
+    }
+
+    if (meta + meta_pages > region->end) {
+        console_printf("[init_pages] no room for the metadata of region %p-%p\n", region->start, region->end);
+        return false;
+    }
+
+    region->ref_counts = (_Atomic uint16_t*) meta;
+    region->orders = (uint8_t*) (region->ref_counts + region->page_count);
+    region->meta_end = meta + meta_pages;
+    reserve_range(meta, region->meta_end);
+
+    for (uint64_t* clear = (uint64_t*) meta; clear < (uint64_t*) region->meta_end; clear++) {
+        *clear = 0;
+    }
+
+    for (size_t order = 0; order < BUDDY_ORDER_COUNT; order++) {
+        region->free_lists[order] = NULL;
+    }
+
+    page_t* page = region->start;
+    while (page < region->end) {
+        page_t* free_end = region->end;
+        bool found = first_reservation(page, region->end, &range);
+        if (found)
+            free_end = range.start > page ? range.start : page;
+
+        buddy_free_range(region, page - region->start, free_end - page);
+        if (!found)
+            break;
+        page = range.end;
+    }
+
+    console_printf("[init_pages] region %p-%p on node 0x%x: 0x%lx pages, metadata at %p (0x%lx pages)\n",
+        region->start, region->end, region->node, region->page_count, meta, meta_pages);
+    return true;
+}
+
 // init_pages(fdt_t*) -> void
 // Initialises the pages to be ready for page allocation.
 void init_pages(fdt_t* tree) {
@@ -20,462 +332,947 @@ void init_pages(fdt_t* tree) {
     }
 
     void* root = fdt_path(tree, "/", NULL);
-    struct fdt_property addr_cell_prop = fdt_get_property(tree, root, "#address-cells");
-    uint32_t addr_cell = be_to_le(32, addr_cell_prop.data);
-    struct fdt_property size_cell_prop = fdt_get_property(tree, root, "#size-cells");
-    uint32_t size_cell = be_to_le(32, size_cell_prop.data);
+    uint32_t addr_cell = fdt_cells(tree, root, "#address-cells", 2);
+    uint32_t size_cell = fdt_cells(tree, root, "#size-cells", 1);
+
+    region_count = 0;
+    reserved_count = 0;
+
+    void* memory_node = NULL;
+    while ((memory_node = fdt_find(tree, "memory", memory_node))) {
+        struct fdt_property reg = fdt_get_property(tree, memory_node, "reg");
+        uint32_t node = fdt_node_id(tree, memory_node);
+        for (uint32_t offset = 0; offset + (addr_cell + size_cell) * 4 <= reg.len; offset += (addr_cell + size_cell) * 4) {
+            add_region(be_to_le(32 * addr_cell, reg.data + offset),
+                be_to_le(32 * size_cell, reg.data + offset + addr_cell * 4), node);
+        }
+    }
 
-    // TODO: support for multiple memory nodes
-    void* memory_node = fdt_find(tree, "memory", NULL);
-    struct fdt_property reg = fdt_get_property(tree, memory_node, "reg");
+    void* cpu = NULL;
+    while ((cpu = fdt_find(tree, "cpu", cpu))) {
+        struct fdt_property reg = fdt_get_property(tree, cpu, "reg");
+        if (reg.data == NULL)
+            continue;
+        uint64_t hartid = be_to_le(reg.len * 8, reg.data);
+        if (hartid < MAX_TRAP_COUNT)
+            hart_nodes[hartid] = fdt_node_id(tree, cpu);
+    }
 
-    // TODO: multiple memory segments
-    memory_start = (page_t*) be_to_le(32 * addr_cell, reg.data);
-    size_t len = be_to_le(32 * size_cell, reg.data + addr_cell * 4) - (&pages_bottom - memory_start);
+    // The kernel and the firmware below it
+    for (size_t i = 0; i < region_count; i++) {
+        if (&pages_bottom >= regions[i].start && &pages_bottom <= regions[i].end)
+            reserve_range(regions[i].start, &pages_bottom);
+    }
 
-    size_t page_rc_count = len / PAGE_SIZE / PAGE_SIZE * 2;
-    console_printf("[init_pages] page_rc_count: 0x%lx\n", page_rc_count);
+    reserve_range(tree->header, (void*) tree->header + be_to_le(32, tree->header->totalsize));
+
+    void* chosen = fdt_path(tree, "/chosen", NULL);
+    struct fdt_property initrd_start = fdt_get_property(tree, chosen, "linux,initrd-start");
+    struct fdt_property initrd_end = fdt_get_property(tree, chosen, "linux,initrd-end");
+    if (chosen != NULL && initrd_start.data != NULL && initrd_end.data != NULL)
+        reserve_range((void*) be_to_le(initrd_start.len * 8, initrd_start.data),
+            (void*) be_to_le(initrd_end.len * 8, initrd_end.data));
+
+    for (struct fdt_reserve_entry* entry = tree->memory_reservation_block; ; entry++) {
+        uint64_t addr = be_to_le(64, entry->address);
+        uint64_t size = be_to_le(64, entry->size);
+        if (addr == 0 && size == 0)
+            break;
+        reserve_range((void*) addr, (void*) (addr + size));
+    }
 
-    heap_bottom = &pages_bottom + page_rc_count;
+    void* reserved_memory = fdt_path(tree, "/reserved-memory", NULL);
+    if (reserved_memory != NULL) {
+        uint32_t reserved_addr_cell = fdt_cells(tree, reserved_memory, "#address-cells", addr_cell);
+        uint32_t reserved_size_cell = fdt_cells(tree, reserved_memory, "#size-cells", size_cell);
+        uint32_t entry_size = (reserved_addr_cell + reserved_size_cell) * 4;
+
+        void* child = NULL;
+        while ((child = fdt_next_child(tree, reserved_memory, child))) {
+            // Nodes with only a size ask the OS to pick the memory, which nothing here uses
+            struct fdt_property reg = fdt_get_property(tree, child, "reg");
+            for (uint32_t offset = 0; offset + entry_size <= reg.len; offset += entry_size) {
+                uint64_t addr = be_to_le(32 * reserved_addr_cell, reg.data + offset);
+                uint64_t size = be_to_le(32 * reserved_size_cell, reg.data + offset + reserved_addr_cell * 4);
+                reserve_range((void*) addr, (void*) (addr + size));
+            }
+        }
+    }
 
-    for (uint64_t* clear = (uint64_t*) &pages_bottom; clear < (uint64_t*) heap_bottom; clear++) {
-        *clear = 0;
+    size_t usable = 0;
+    for (size_t i = 0; i < region_count; i++) {
+        if (init_region(&regions[i]))
+            regions[usable++] = regions[i];
     }
+    region_count = usable;
+
+    if (region_count == 0)
+        console_puts("[init_pages] no usable memory regions found\n");
 }
 
 // get_memory_start() -> void*
 // Gets the start of RAM.
 void* get_memory_start() {
-    return memory_start;
+    return region_count != 0 ? regions[0].start : NULL;
 }
 
-// page_ref_count(page_t*) -> uint16_t*
+// get_page_metadata(size_t, void**, void**) -> bool
+// Gets the physical range holding the page allocator metadata of the given memory region. Returns false if there is no such region.
+bool get_page_metadata(size_t region, void** start, void** end) {
+    if (region >= region_count)
+        return false;
+
+    *start = regions[region].ref_counts;
+    *end = regions[region].meta_end;
+    return true;
+}
+
+// page_ref_count(page_t*) -> _Atomic uint16_t*
 // Returns the reference count for the page as a pointer.
-uint16_t* page_ref_count(page_t* page) {
-    if (page > heap_bottom)
-        return (uint16_t*) &pages_bottom + ((intptr_t) page - (intptr_t) heap_bottom) / PAGE_SIZE;
-    return NULL;
+static _Atomic uint16_t* page_ref_count(page_t* page) {
+    struct page_region* region = page_region(page);
+    if (region == NULL)
+        return NULL;
+    return region->ref_counts + (page - region->start);
 }
 
-// mark_as_used(void*, size_t) -> void
-// Marks the given pages as used.
-void mark_as_used(void* page, size_t size) {
-    spin_lock(&mutating_heap);
+// Each hart keeps a small magazine of free order 0 and order 1 blocks in
+// front of the buddy allocator. Pages in a magazine have a reference count of
+// 0 but are not on any free list. Magazines are only touched by their own hart
+// with interrupts disabled, so they need no locking; they refill from and
+// drain to the buddy allocator PAGE_CACHE_BATCH blocks at a time.
+#define PAGE_CACHE_ORDERS   2
+#define PAGE_CACHE_SIZE     32
+#define PAGE_CACHE_BATCH    16
+
+struct page_cache {
+    size_t count[PAGE_CACHE_ORDERS];
+    page_t* blocks[PAGE_CACHE_ORDERS][PAGE_CACHE_SIZE];
+    struct page_cache_stats stats;
+};
+
+static struct page_cache page_caches[MAX_TRAP_COUNT];
+
+static void page_cache_free(page_t* page, size_t count);
+static page_t* try_alloc_pages(size_t count);
+
+// page_cache_alloc(size_t) -> page_t*
+// Takes a block from the current hart's magazine, refilling it if empty. Returns null on failure.
+static page_t* page_cache_alloc(size_t order) {
+    struct page_cache* cache = &page_caches[get_hartid()];
+
+    while (true) {
+        if (cache->count[order] == 0) {
+            cache->stats.misses++;
+            cache->stats.refills++;
+
+            spin_lock(&mutating_heap);
+            while (cache->count[order] < PAGE_CACHE_BATCH) {
+                page_t* block = buddy_alloc_near(order, NULL);
+                if (block == NULL)
+                    break;
+                cache->blocks[order][cache->count[order]++] = block;
+            }
+            spin_unlock(&mutating_heap);
 
-    uint16_t* p = page_ref_count(page);
-    if (p == NULL) {
+            if (cache->count[order] == 0)
+                return NULL;
+        } else cache->stats.hits++;
+
+        page_t* block = cache->blocks[order][--cache->count[order]];
+        _Atomic uint16_t* rc = page_ref_count(block);
+
+        // mark_as_used may have claimed a cached page, in which case the rest of the block is given back
+        size_t claimed = 0;
+        for (size_t i = 0; i < ((size_t) 1 << order); i++) {
+            uint16_t expected = 0;
+            if (atomic_compare_exchange_strong(&rc[i], &expected, 1))
+                claimed |= 1 << i;
+        }
+
+        if (claimed == ((size_t) 1 << (1 << order)) - 1)
+            return block;
+
+        for (size_t i = 0; i < ((size_t) 1 << order); i++) {
+            if (claimed & (1 << i)) {
+                rc[i] = 0;
+                page_cache_free(block + i, 1);
+            }
+        }
+    }
+}
+
+// page_cache_free(page_t*, size_t) -> void
+// Returns a run of unreferenced pages to the current hart's magazine or to the buddy allocator.
+static void page_cache_free(page_t* page, size_t count) {
+    struct page_cache* cache = &page_caches[get_hartid()];
+    size_t order = count == 2 && ((uintptr_t) page & PAGE_SIZE) == 0 ? 1 : 0;
+
+    if (count > 2 || (count == 2 && order == 0)) {
+        struct page_region* region = page_region(page);
+        spin_lock(&mutating_heap);
+        buddy_free_range(region, page - region->start, count);
         spin_unlock(&mutating_heap);
         return;
     }
 
-    size_t count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (cache->count[order] == PAGE_CACHE_SIZE) {
+        cache->stats.drains++;
+
+        spin_lock(&mutating_heap);
+        while (cache->count[order] > PAGE_CACHE_SIZE - PAGE_CACHE_BATCH) {
+            page_t* block = cache->blocks[order][--cache->count[order]];
+            struct page_region* region = page_region(block);
+            size_t index = block - region->start;
+            if (order == 1 && (region->ref_counts[index] != 0 || region->ref_counts[index + 1] != 0)) {
+                for (size_t i = index; i < index + 2; i++) {
+                    if (region->ref_counts[i] == 0)
+                        buddy_free_block(region, i, 0);
+                }
+            } else if (region->ref_counts[index] == 0) {
+                buddy_free_block(region, index, order);
+            }
+        }
+        spin_unlock(&mutating_heap);
+    }
+
+    cache->blocks[order][cache->count[order]++] = page;
+}
+
+// get_page_cache_stats(uint64_t) -> struct page_cache_stats
+// Returns the page cache counters of the given hart.
+struct page_cache_stats get_page_cache_stats(uint64_t hartid) {
+    if (hartid >= MAX_TRAP_COUNT)
+        return (struct page_cache_stats) { 0 };
+    return page_caches[hartid].stats;
+}
+
+// debug_page_caches() -> void
+// Prints out the page cache counters of every hart that has used its cache.
+void debug_page_caches() {
+    for (size_t i = 0; i < MAX_TRAP_COUNT; i++) {
+        struct page_cache_stats stats = page_caches[i].stats;
+        uint64_t total = stats.hits + stats.misses;
+        if (total == 0)
+            continue;
+        console_printf("[page_cache] hart 0x%lx: 0x%lx hits, 0x%lx misses (0x%lx%% hit rate), 0x%lx refills, 0x%lx drains\n",
+            i, stats.hits, stats.misses, stats.hits * 100 / total, stats.refills, stats.drains);
+    }
+}
+
+// mark_as_used(void*, size_t) -> void
+// Marks the given pages as used.
+void mark_as_used(void* page, size_t size) {
+    page_t* first = (page_t*) ((uintptr_t) page & ~(PAGE_SIZE - 1));
+    size_t count = (size + ((uintptr_t) page - (uintptr_t) first) + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    spin_lock(&mutating_heap);
 
     for (size_t i = 0; i < count; i++) {
-        *p = 1;
-        p++;
+        struct page_region* region = page_region(first + i);
+        if (region == NULL)
+            continue;
+
+        size_t index = first + i - region->start;
+        uint16_t expected = 0;
+        if (atomic_compare_exchange_strong(&region->ref_counts[index], &expected, 1))
+            buddy_reserve(region, index);
     }
 
     spin_unlock(&mutating_heap);
 }
 
-// alloc_pages(size_t) -> void*
-// Allocates a number of pages, zeroing out the values.
-void* alloc_pages(size_t count) {
-    spin_lock(&mutating_heap);
+// alloc_pages_nozero(size_t) -> void*
+// Allocates a number of pages without clearing them. Only for callers that overwrite the whole allocation.
+void* alloc_pages_nozero(size_t count) {
+    if (count == 0)
+        return NULL;
 
-    uint16_t* p = (uint16_t*) &pages_bottom;
+    page_t* page = try_alloc_pages(count);
+    if (page == NULL && shrink_memory(count) > 0)
+        page = try_alloc_pages(count);
 
-    for (; p < (uint16_t*) heap_bottom - count; p++) {
-        if (!*p) {
-            bool enough = true;
-            for (uint16_t* q = p + 1; q < p + count; q++) {
-                if (*q) {
-                    enough = false;
-                    break;
-                }
-            }
+    if (page == NULL)
+        console_printf("[alloc_pages] unable to allocate %lx pages\n", count);
+    return page;
+}
 
-            if (enough) {
-                for (uint16_t* q = p; q < p + count; q++) {
-                    *q = 1;
-                }
+// try_alloc_pages(size_t) -> page_t*
+// Allocates a number of pages from the hart cache or the buddy allocator without clearing them.
+static page_t* try_alloc_pages(size_t count) {
+    size_t order = 0;
+    while (((size_t) 1 << order) < count)
+        order++;
 
-                page_t* page = ((intptr_t) p - (intptr_t) &pages_bottom) / 2 + heap_bottom;
+    if (order < PAGE_CACHE_ORDERS && ((size_t) 1 << order) == count)
+        return page_cache_alloc(order);
+    if (order >= BUDDY_ORDER_COUNT)
+        return NULL;
 
-                page = phys2safe(page);
+    spin_lock(&mutating_heap);
 
-                for (uint64_t* q = (uint64_t*) page; q < (uint64_t*) (page + count); q++) {
-                    *q = 0;
-                }
+    struct page_region* region;
+    page_t* page = buddy_alloc_near(order, &region);
+    if (page != NULL) {
+        size_t index = page - region->start;
 
-                spin_unlock(&mutating_heap);
-                return safe2phys(page);
-            }
+        // Give back the tail of the block if the count isn't a power of two
+        if (((size_t) 1 << order) > count)
+            buddy_free_range(region, index + count, ((size_t) 1 << order) - count);
+
+        for (size_t i = 0; i < count; i++) {
+            region->ref_counts[index + i] = 1;
         }
     }
 
-    console_printf("[alloc_pages] unable to allocate %lx pages\n", count);
     spin_unlock(&mutating_heap);
-    return NULL;
+    return page;
+}
+
+// Pages that have already been zeroed by an idle hart. The pool is a stack
+// linked through the first word of each page, which is cleared again when the
+// page is handed out.
+#define ZERO_POOL_TARGET    64
+
+static page_t* zero_pool = NULL;
+static size_t zero_pool_count = 0;
+DEFINE_SPINLOCK(mutating_zero_pool);
+
+// refill_zeroed_pages(size_t) -> void
+// Zeroes up to the given number of pages into the pre-zeroed pool. Called by idle harts.
+void refill_zeroed_pages(size_t budget) {
+    for (; budget > 0 && zero_pool_count < ZERO_POOL_TARGET; budget--) {
+        page_t* page = try_alloc_pages(1);
+        if (page == NULL)
+            return;
+
+        uint64_t* safe = phys2safe(page);
+        for (size_t i = 1; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+            safe[i] = 0;
+        }
+
+        spin_lock(&mutating_zero_pool);
+        safe[0] = (uint64_t) zero_pool;
+        zero_pool = page;
+        zero_pool_count++;
+        spin_unlock(&mutating_zero_pool);
+    }
+}
+
+// drain_zeroed_pages() -> size_t
+// Returns every page in the pre-zeroed pool to the page allocator. Returns the number of pages freed.
+static size_t drain_zeroed_pages() {
+    if (!spin_try_lock(&mutating_zero_pool))
+        return 0;
+
+    page_t* page = zero_pool;
+    size_t freed = zero_pool_count;
+    zero_pool = NULL;
+    zero_pool_count = 0;
+    spin_unlock(&mutating_zero_pool);
+
+    while (page != NULL) {
+        uint64_t* safe = phys2safe(page);
+        page_t* next = (page_t*) safe[0];
+        dealloc_pages(page, 1);
+        page = next;
+    }
+
+    return freed;
+}
+
+// Callbacks that give memory back under memory pressure. They run from inside
+// the page allocator, possibly with other allocator locks held, so they must
+// only try-lock anything they need.
+#define MAX_SHRINKERS 8
+
+static shrinker_t shrinkers[MAX_SHRINKERS];
+static size_t shrinker_count = 0;
+
+// register_shrinker(shrinker_t) -> void
+// Registers a callback that is called to free memory when the page allocator runs out.
+void register_shrinker(shrinker_t shrinker) {
+    if (shrinker_count < MAX_SHRINKERS)
+        shrinkers[shrinker_count++] = shrinker;
+}
+
+// shrink_memory(size_t) -> size_t
+// Asks the kernel caches to give back at least the given number of pages. Returns the number of pages freed.
+size_t shrink_memory(size_t count) {
+    size_t freed = drain_zeroed_pages();
+    if (freed < count)
+        freed += shrink_heap();
+    for (size_t i = 0; i < shrinker_count && freed < count; i++) {
+        freed += shrinkers[i](count - freed);
+    }
+    return freed;
+}
+
+// zero_pages(page_t*, size_t) -> void
+// Clears a number of physical pages.
+static void zero_pages(page_t* page, size_t count) {
+    page = phys2safe(page);
+    for (uint64_t* q = (uint64_t*) page; q < (uint64_t*) (page + count); q++) {
+        *q = 0;
+    }
+}
+
+// alloc_pages(size_t) -> void*
+// Allocates a number of pages, zeroing out the values.
+void* alloc_pages(size_t count) {
+    if (count == 1 && zero_pool != NULL) {
+        spin_lock(&mutating_zero_pool);
+        page_t* page = zero_pool;
+        if (page != NULL) {
+            uint64_t* safe = phys2safe(page);
+            zero_pool = (page_t*) safe[0];
+            zero_pool_count--;
+            safe[0] = 0;
+        }
+        spin_unlock(&mutating_zero_pool);
+
+        if (page != NULL)
+            return page;
+    }
+
+    page_t* page = alloc_pages_nozero(count);
+    if (page == NULL)
+        return NULL;
+
+    zero_pages(page, count);
+    return page;
+}
+
+// alloc_pages_if_free(size_t, bool) -> void*
+// Allocates a number of pages only if they are free right now, optionally zeroed. Nothing is shrunk and nothing is printed on failure, for callers with a smaller allocation to fall back to.
+void* alloc_pages_if_free(size_t count, bool zero) {
+    if (count == 0)
+        return NULL;
+
+    page_t* page = try_alloc_pages(count);
+    if (page != NULL && zero)
+        zero_pages(page, count);
+    return page;
 }
 
 // incr_page_ref_count(void*, size_t) -> void
 // Increments the reference count of the selected pages.
 void incr_page_ref_count(void* page, size_t count) {
-    spin_lock(&mutating_heap);
-
-    uint16_t* rc = page_ref_count(page);
-    if (rc == NULL) {
-        spin_unlock(&mutating_heap);
+    page = safe2phys(page);
+    struct page_region* region = page_region(page);
+    if (region == NULL)
         return;
-    }
 
-    for (size_t i = 0; i < count; i++) {
-        if (*rc != UINT16_MAX && *rc != 0) {
-            *rc += 1;
-        }
-        rc++;
+    size_t index = (page_t*) page - region->start;
+    _Atomic uint16_t* rc = region->ref_counts + index;
+    for (size_t i = 0; i < count && index + i < region->page_count; i++, rc++) {
+        uint16_t value = *rc;
+        while (value != UINT16_MAX && value != 0
+            && !atomic_compare_exchange_weak(rc, &value, value + 1));
     }
+}
 
-    spin_unlock(&mutating_heap);
+// get_page_ref_count(void*) -> uint16_t
+// Returns the reference count of the page, which is 0 for free pages and memory the allocator doesn't manage.
+uint16_t get_page_ref_count(void* page) {
+    _Atomic uint16_t* rc = page_ref_count(safe2phys(page));
+    return rc ? *rc : 0;
 }
 
 // dealloc_pages(void*, size_t) -> void
-// Decrements the reference count of the selected pages.
+// Decrements the reference count of the selected pages, freeing pages that are no longer referenced.
 void dealloc_pages(void* page, size_t count) {
-    spin_lock(&mutating_heap);
     page = safe2phys(page);
-    uint16_t* rc = page_ref_count(page);
-    if (rc == NULL) {
-        spin_unlock(&mutating_heap);
+    struct page_region* region = page_region(page);
+    if (region == NULL)
         return;
-    }
 
-    for (size_t i = 0; i < count; i++) {
-        if (*rc != 0) {
-            *rc -= 1;
+    size_t index = (page_t*) page - region->start;
+    _Atomic uint16_t* rc = region->ref_counts + index;
+    size_t run_start = index;
+    size_t run_length = 0;
+    for (size_t i = 0; i < count && index + i < region->page_count; i++) {
+        uint16_t value = rc[i];
+        while (value != 0 && !atomic_compare_exchange_weak(&rc[i], &value, value - 1));
+
+        if (value == 1) {
+            if (run_length == 0)
+                run_start = index + i;
+            run_length++;
+        } else if (run_length != 0) {
+            page_cache_free(region->start + run_start, run_length);
+            run_length = 0;
         }
-        rc++;
     }
 
-    spin_unlock(&mutating_heap);
+    if (run_length != 0)
+        page_cache_free(region->start + run_start, run_length);
 }
 
-struct s_free_bucket {
-    struct s_free_bucket* next;
-    struct s_free_bucket* prev;
+// The kernel heap is a slab allocator. Small objects are carved out of
+// single page slabs, one size class per slab, with a struct slab header at
+// the start of the page. Objects carry no header of their own: the slab of an
+// object is found by rounding its address down to the page.
+//
+// Kernels built with HEAP_TRACK_ORIGINS record the return address of every
+// allocation for the leak report in debug_free_buckets_alloc. Slab objects
+// keep theirs in an array right after the slab header, and large allocations
+// are linked into a list. Without it none of that memory or work exists.
+//
+// Allocations bigger than the largest size class get their own run of pages
+// with the same header in front, marked with SLAB_LARGE_MAGIC.
+//
+// Each hart has a small cache of free objects for every size class, so most
+// malloc and free calls never take a lock. The caches refill from and drain
+// to the slabs of their class SLAB_CACHE_BATCH objects at a time.
+//
+// Slabs with no objects in use are kept on an empty list. Only
+// SLAB_EMPTY_KEEP of them are kept per class, the rest go straight back to
+// the page allocator, and shrink_heap releases all of them.
+#define SLAB_MAGIC          0x51ab
+#define SLAB_LARGE_MAGIC    0x1a56e
+#define SLAB_HEADER_SIZE    64
+#define SLAB_ALIGN          16
+#define SLAB_CACHE_SIZE     16
+#define SLAB_CACHE_BATCH    8
+#define SLAB_EMPTY_KEEP     1
+
+#ifdef HEAP_TRACK_ORIGINS
+#define SLAB_ORIGIN_SIZE    sizeof(uint64_t)
+#else
+#define SLAB_ORIGIN_SIZE    0
+#endif
+
+struct slab {
+    uint32_t magic;
+    uint16_t size_class;
+    uint16_t in_use;
+    uint16_t objects;
+    uint16_t offset;
     size_t size;
+    size_t page_count;
+    void* free;
+    struct slab* next;
+    struct slab* prev;
+#ifdef HEAP_TRACK_ORIGINS
     uint64_t origin;
-    uint8_t data[];
+#endif
 };
 
-typedef struct {
-    atomic_bool mutating;
-
-    struct s_free_bucket* used;
-    struct s_free_bucket* free_16;
-    struct s_free_bucket* free_64;
-    struct s_free_bucket* free_256;
-    struct s_free_bucket* free_1024;
-    struct s_free_bucket* free_4096;
-    struct s_free_bucket* free_16384;
-    struct s_free_bucket* free_65536;
-} free_buckets_alloc_t;
-
-static free_buckets_alloc_t GLOBAL_ALLOC = { 0 };
-static const size_t GLOBAL_ALLOC_FALLBACK_PAGE_COUNT = 65;
-
-struct s_free_bucket* free_buckets_format_unused(void* data, size_t bucket_size, size_t total_size) {
-    total_size *= PAGE_SIZE;
-    size_t size = sizeof(struct s_free_bucket) + bucket_size;
-    for (size_t i = 0; i + size < total_size; i += size) {
-        struct s_free_bucket* bucket = data + i;
-        if (i > 0)
-            bucket->prev = data + i - size;
-        else bucket->prev = NULL;
-        if (i + size < total_size)
-            bucket->next = data + i + size;
-        else bucket->next = NULL;
-        bucket->size = bucket_size;
-        bucket->origin = 0;
-    }
-
-    return data;
-}
-
-void* free_buckets_alloc(size_t size, uint64_t origin) {
-    if (size == 0)
+_Static_assert(sizeof(struct slab) <= SLAB_HEADER_SIZE, "slab header too large");
+
+static const size_t slab_sizes[] = {
+    8,      // hashmap and queue handles
+    16,
+    32,
+    48,     // hashmap key and value arrays for small keys
+    64,
+    96,
+    128,
+    192,
+    256,
+    384,
+    512,
+    672,
+    864,
+    1008,
+    1344,   // queues with 128 pointer sized items
+    2016,
+};
+
+#define SLAB_CLASS_COUNT (sizeof(slab_sizes) / sizeof(size_t))
+
+struct slab_class {
+    spin_t lock;
+    struct slab* partial;
+    struct slab* full;
+    struct slab* empty;
+    size_t empty_count;
+};
+
+struct slab_cache {
+    size_t count;
+    void* objects[SLAB_CACHE_SIZE];
+};
+
+static struct slab_class slab_classes[SLAB_CLASS_COUNT];
+static struct slab_cache slab_caches[MAX_TRAP_COUNT][SLAB_CLASS_COUNT];
+#ifdef HEAP_TRACK_ORIGINS
+static struct slab* large_allocations = NULL;
+DEFINE_SPINLOCK(mutating_large_allocations);
+#endif
+
+// slab_size_class(size_t) -> size_t
+// Returns the size class for the given allocation size, or SLAB_CLASS_COUNT if it's too big.
+static size_t slab_size_class(size_t size) {
+    size_t class = 0;
+    while (class < SLAB_CLASS_COUNT && slab_sizes[class] < size)
+        class++;
+    return class;
+}
+
+// slab_of(void*) -> struct slab*
+// Returns the slab header of an allocated object.
+static inline struct slab* slab_of(void* p) {
+    return (struct slab*) ((uintptr_t) p & ~((uintptr_t) PAGE_SIZE - 1));
+}
+
+#ifdef HEAP_TRACK_ORIGINS
+// slab_origins(struct slab*) -> uint64_t*
+// Returns the allocation origin array of a slab.
+static inline uint64_t* slab_origins(struct slab* slab) {
+    return (uint64_t*) ((void*) slab + SLAB_HEADER_SIZE);
+}
+
+// slab_object_index(struct slab*, void*) -> size_t
+// Returns the index of an object within its slab.
+static inline size_t slab_object_index(struct slab* slab, void* p) {
+    return (p - ((void*) slab + slab->offset)) / slab->size;
+}
+#endif
+
+// slab_list_remove(struct slab**, struct slab*) -> void
+// Unlinks a slab from a slab list.
+static void slab_list_remove(struct slab** list, struct slab* slab) {
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// slab_list_push(struct slab**, struct slab*) -> void
+// Links a slab into the front of a slab list.
+static void slab_list_push(struct slab** list, struct slab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+// slab_create(size_t) -> struct slab*
+// Allocates and formats a new slab for the given size class.
+static struct slab* slab_create(size_t class) {
+    struct slab* slab = phys2safe(alloc_pages(1));
+    if (slab == NULL)
         return NULL;
 
-    bool f = false;
-    while (!atomic_compare_exchange_weak(&GLOBAL_ALLOC.mutating, &f, true)) {
-        f = false;
+    size_t size = slab_sizes[class];
+    size_t objects = (PAGE_SIZE - SLAB_HEADER_SIZE) / (size + SLAB_ORIGIN_SIZE);
+    size_t offset = (SLAB_HEADER_SIZE + objects * SLAB_ORIGIN_SIZE + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    while (offset + objects * size > PAGE_SIZE) {
+        objects--;
+        offset = (SLAB_HEADER_SIZE + objects * SLAB_ORIGIN_SIZE + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
     }
 
-    struct s_free_bucket* bucket = NULL;
-    if (size <= 16) {
-        if (GLOBAL_ALLOC.free_16 == NULL) {
-            void* unformatted = alloc_pages(GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
-            unformatted = phys2safe(unformatted);
-            if (unformatted == NULL) {
-                GLOBAL_ALLOC.mutating = false;
-                return NULL;
-            }
-            GLOBAL_ALLOC.free_16 = free_buckets_format_unused(unformatted, 16, GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
-        }
+    *slab = (struct slab) {
+        .magic = SLAB_MAGIC,
+        .size_class = class,
+        .objects = objects,
+        .offset = offset,
+        .size = size,
+        .page_count = 1,
+    };
+
+    void** last = &slab->free;
+    for (size_t i = 0; i < objects; i++) {
+        void* object = (void*) slab + offset + i * size;
+        *last = object;
+        last = object;
+    }
+    *last = NULL;
 
-        bucket = GLOBAL_ALLOC.free_16;
-        GLOBAL_ALLOC.free_16 = bucket->next;
-    } else if (size <= 64) {
-        if (GLOBAL_ALLOC.free_64 == NULL) {
-            void* unformatted = alloc_pages(GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
-            unformatted = phys2safe(unformatted);
-            if (unformatted == NULL) {
-                GLOBAL_ALLOC.mutating = false;
-                return NULL;
-            }
-            GLOBAL_ALLOC.free_64 = free_buckets_format_unused(unformatted, 64, GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
-        }
+    return slab;
+}
 
-        bucket = GLOBAL_ALLOC.free_64;
-        GLOBAL_ALLOC.free_64 = bucket->next;
-    } else if (size <= 256) {
-        if (GLOBAL_ALLOC.free_256 == NULL) {
-            void* unformatted = alloc_pages(GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
-            unformatted = phys2safe(unformatted);
-            if (unformatted == NULL) {
-                GLOBAL_ALLOC.mutating = false;
-                return NULL;
-            }
-            GLOBAL_ALLOC.free_256 = free_buckets_format_unused(unformatted, 256, GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
+// slab_refill(struct slab_cache*, size_t) -> void
+// Moves free objects from the slabs of a size class into a hart cache.
+static void slab_refill(struct slab_cache* cache, size_t class) {
+    struct slab_class* slab_class = &slab_classes[class];
+    spin_lock(&slab_class->lock);
+
+    while (cache->count < SLAB_CACHE_BATCH) {
+        struct slab* slab = slab_class->partial;
+        if (slab == NULL && slab_class->empty != NULL) {
+            slab = slab_class->empty;
+            slab_list_remove(&slab_class->empty, slab);
+            slab_class->empty_count--;
+            slab_list_push(&slab_class->partial, slab);
+        } else if (slab == NULL) {
+            slab = slab_create(class);
+            if (slab == NULL)
+                break;
+            slab_list_push(&slab_class->partial, slab);
         }
 
-        bucket = GLOBAL_ALLOC.free_256;
-        GLOBAL_ALLOC.free_256 = bucket->next;
-    } else if (size <= 1024) {
-        if (GLOBAL_ALLOC.free_1024 == NULL) {
-            void* unformatted = alloc_pages(GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
-            unformatted = phys2safe(unformatted);
-            if (unformatted == NULL) {
-                GLOBAL_ALLOC.mutating = false;
-                return NULL;
-            }
-            GLOBAL_ALLOC.free_1024 = free_buckets_format_unused(unformatted, 1024, GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
+        while (slab->free != NULL && cache->count < SLAB_CACHE_BATCH) {
+            void** object = slab->free;
+            slab->free = *object;
+            slab->in_use++;
+            cache->objects[cache->count++] = object;
         }
 
-        bucket = GLOBAL_ALLOC.free_1024;
-        GLOBAL_ALLOC.free_1024 = bucket->next;
-    } else if (size <= 4096) {
-        if (GLOBAL_ALLOC.free_4096 == NULL) {
-            void* unformatted = alloc_pages(GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
-            unformatted = phys2safe(unformatted);
-            if (unformatted == NULL) {
-                GLOBAL_ALLOC.mutating = false;
-                return NULL;
-            }
-            GLOBAL_ALLOC.free_4096 = free_buckets_format_unused(unformatted, 4096, GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
+        if (slab->free == NULL) {
+            slab_list_remove(&slab_class->partial, slab);
+            slab_list_push(&slab_class->full, slab);
         }
+    }
 
-        bucket = GLOBAL_ALLOC.free_4096;
-        GLOBAL_ALLOC.free_4096 = bucket->next;
-    } else if (size <= 16384) {
-        if (GLOBAL_ALLOC.free_16384 == NULL) {
-            void* unformatted = alloc_pages(GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
-            unformatted = phys2safe(unformatted);
-            if (unformatted == NULL) {
-                GLOBAL_ALLOC.mutating = false;
-                return NULL;
-            }
-            GLOBAL_ALLOC.free_16384 = free_buckets_format_unused(unformatted, 16384, GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
+    spin_unlock(&slab_class->lock);
+}
+
+// slab_drain(struct slab_cache*, size_t, size_t) -> void
+// Returns objects from a hart cache to their slabs until the cache holds the given number of objects.
+static void slab_drain(struct slab_cache* cache, size_t class, size_t keep) {
+    struct slab_class* slab_class = &slab_classes[class];
+    spin_lock(&slab_class->lock);
+
+    while (cache->count > keep) {
+        void** object = cache->objects[--cache->count];
+        struct slab* slab = slab_of(object);
+
+        if (slab->free == NULL) {
+            slab_list_remove(&slab_class->full, slab);
+            slab_list_push(&slab_class->partial, slab);
         }
 
-        bucket = GLOBAL_ALLOC.free_16384;
-        GLOBAL_ALLOC.free_16384 = bucket->next;
-    } else if (size <= 65536) {
-        if (GLOBAL_ALLOC.free_65536 == NULL) {
-            void* unformatted = alloc_pages(GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
-            unformatted = phys2safe(unformatted);
-            if (unformatted == NULL) {
-                GLOBAL_ALLOC.mutating = false;
-                return NULL;
-            }
-            GLOBAL_ALLOC.free_65536 = free_buckets_format_unused(unformatted, 65536, GLOBAL_ALLOC_FALLBACK_PAGE_COUNT);
+        *object = slab->free;
+        slab->free = object;
+        slab->in_use--;
+
+        if (slab->in_use == 0) {
+            slab_list_remove(&slab_class->partial, slab);
+            if (slab_class->empty_count < SLAB_EMPTY_KEEP) {
+                slab_list_push(&slab_class->empty, slab);
+                slab_class->empty_count++;
+            } else dealloc_pages(slab, 1);
         }
+    }
 
-        bucket = GLOBAL_ALLOC.free_65536;
-        GLOBAL_ALLOC.free_65536 = bucket->next;
-    } else {
-        size_t page_count = (size + sizeof(struct s_free_bucket) + PAGE_SIZE - 1) / PAGE_SIZE;
-        bucket = alloc_pages(page_count);
-        bucket = phys2safe(bucket);
-        if (bucket == NULL) {
-            GLOBAL_ALLOC.mutating = false;
-            return NULL;
+    spin_unlock(&slab_class->lock);
+}
+
+// shrink_heap() -> size_t
+// Drains the current hart's object caches and returns every empty slab to the page allocator. Returns the number of pages freed.
+// Size classes that are locked by the caller are skipped, so this is safe to call from inside the allocator.
+size_t shrink_heap() {
+    size_t freed = 0;
+    struct slab_cache* caches = slab_caches[get_hartid()];
+
+    for (size_t class = 0; class < SLAB_CLASS_COUNT; class++) {
+        struct slab_class* slab_class = &slab_classes[class];
+        if (!spin_try_lock(&slab_class->lock))
+            continue;
+        spin_unlock(&slab_class->lock);
+
+        slab_drain(&caches[class], class, 0);
+
+        if (!spin_try_lock(&slab_class->lock))
+            continue;
+        while (slab_class->empty != NULL) {
+            struct slab* slab = slab_class->empty;
+            slab_list_remove(&slab_class->empty, slab);
+            dealloc_pages(slab, 1);
+            freed++;
         }
-        bucket->size = size;
+        slab_class->empty_count = 0;
+        spin_unlock(&slab_class->lock);
     }
 
-    if (bucket == NULL) {
-        GLOBAL_ALLOC.mutating = false;
+    return freed;
+}
+
+// large_alloc(size_t, uint64_t) -> void*
+// Allocates a run of pages for an object too big for any size class.
+static void* large_alloc(size_t size, uint64_t origin) {
+    size_t page_count = (size + SLAB_HEADER_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+    struct slab* header = phys2safe(alloc_pages(page_count));
+    if (header == NULL)
+        return NULL;
+
+    *header = (struct slab) {
+        .magic = SLAB_LARGE_MAGIC,
+        .size = size,
+        .page_count = page_count,
+    };
+
+#ifdef HEAP_TRACK_ORIGINS
+    header->origin = origin;
+    spin_lock(&mutating_large_allocations);
+    slab_list_push(&large_allocations, header);
+    spin_unlock(&mutating_large_allocations);
+#else
+    (void) origin;
+#endif
+    return (void*) header + SLAB_HEADER_SIZE;
+}
+
+// large_free(struct slab*) -> void
+// Frees an object allocated by large_alloc.
+static void large_free(struct slab* header) {
+#ifdef HEAP_TRACK_ORIGINS
+    spin_lock(&mutating_large_allocations);
+    slab_list_remove(&large_allocations, header);
+    spin_unlock(&mutating_large_allocations);
+#endif
+    dealloc_pages(header, header->page_count);
+}
+
+// slab_alloc(size_t, uint64_t) -> void*
+// Allocates an object of the given size, recording where the allocation came from.
+static void* slab_alloc(size_t size, uint64_t origin) {
+    if (size == 0)
         return NULL;
-    }
 
-    bucket->origin = origin;
-    bucket->next = GLOBAL_ALLOC.used;
-    if (GLOBAL_ALLOC.used != NULL) {
-        GLOBAL_ALLOC.used->prev = bucket;
+    size_t class = slab_size_class(size);
+    if (class == SLAB_CLASS_COUNT)
+        return large_alloc(size, origin);
+
+    struct slab_cache* cache = &slab_caches[get_hartid()][class];
+    if (cache->count == 0) {
+        slab_refill(cache, class);
+        if (cache->count == 0)
+            return NULL;
     }
-    GLOBAL_ALLOC.used = bucket;
-    bucket->prev = NULL;
-    GLOBAL_ALLOC.mutating = false;
-    return bucket + 1;
+
+    void* object = cache->objects[--cache->count];
+#ifdef HEAP_TRACK_ORIGINS
+    struct slab* slab = slab_of(object);
+    slab_origins(slab)[slab_object_index(slab, object)] = origin;
+#else
+    (void) origin;
+#endif
+    return object;
 }
 
 void* malloc(size_t size) {
-    uint64_t origin;
-    //asm volatile("ld %0, 8(fp)" : "=r" (origin));
+    uint64_t origin = 0;
+#ifdef HEAP_TRACK_ORIGINS
     asm volatile("mv %0, ra" : "=r" (origin));
-    return free_buckets_alloc(size, origin);
+#endif
+    return slab_alloc(size, origin);
 }
 
 void free(void* p) {
     if (p == NULL)
         return;
 
-    bool f = false;
-    while (!atomic_compare_exchange_weak(&GLOBAL_ALLOC.mutating, &f, true)) {
-        f = false;
-    }
-
-    struct s_free_bucket* bucket = p;
-    bucket--;
-
-    if (bucket->prev != NULL)
-        bucket->prev->next = bucket->next;
-    if (bucket->next != NULL)
-        bucket->next->prev = bucket->prev;
-    if (bucket == GLOBAL_ALLOC.used)
-        GLOBAL_ALLOC.used = GLOBAL_ALLOC.used->next;
-    bucket->prev = NULL;
-    bucket->next = NULL;
-
-    if (bucket->size <= 16) {
-        if (GLOBAL_ALLOC.free_16)
-            GLOBAL_ALLOC.free_16->prev = bucket;
-        bucket->next = GLOBAL_ALLOC.free_16;
-        GLOBAL_ALLOC.free_16 = bucket;
-    } else if (bucket->size <= 64) {
-        if (GLOBAL_ALLOC.free_64)
-            GLOBAL_ALLOC.free_64->prev = bucket;
-        bucket->next = GLOBAL_ALLOC.free_64;
-        GLOBAL_ALLOC.free_64 = bucket;
-    } else if (bucket->size <= 256) {
-        if (GLOBAL_ALLOC.free_256)
-            GLOBAL_ALLOC.free_256->prev = bucket;
-        bucket->next = GLOBAL_ALLOC.free_256;
-        GLOBAL_ALLOC.free_256 = bucket;
-    } else if (bucket->size <= 1024) {
-        if (GLOBAL_ALLOC.free_1024)
-            GLOBAL_ALLOC.free_1024->prev = bucket;
-        bucket->next = GLOBAL_ALLOC.free_1024;
-        GLOBAL_ALLOC.free_1024 = bucket;
-    } else if (bucket->size <= 4096) {
-        if (GLOBAL_ALLOC.free_4096)
-            GLOBAL_ALLOC.free_4096->prev = bucket;
-        bucket->next = GLOBAL_ALLOC.free_4096;
-        GLOBAL_ALLOC.free_4096 = bucket;
-    } else if (bucket->size <= 16384) {
-        if (GLOBAL_ALLOC.free_16384)
-            GLOBAL_ALLOC.free_16384->prev = bucket;
-        bucket->next = GLOBAL_ALLOC.free_16384;
-        GLOBAL_ALLOC.free_16384 = bucket;
-    } else if (bucket->size <= 65536) {
-        if (GLOBAL_ALLOC.free_65536)
-            GLOBAL_ALLOC.free_65536->prev = bucket;
-        bucket->next = GLOBAL_ALLOC.free_65536;
-        GLOBAL_ALLOC.free_65536 = bucket;
-    } else {
-        dealloc_pages(bucket, (bucket->size + sizeof(struct s_free_bucket) + PAGE_SIZE - 1) / PAGE_SIZE);
-    }
-
-    GLOBAL_ALLOC.mutating = false;
+    struct slab* slab = slab_of(p);
+    if (slab->magic == SLAB_LARGE_MAGIC) {
+        large_free(slab);
+        return;
+    }
+
+#ifdef HEAP_TRACK_ORIGINS
+    slab_origins(slab)[slab_object_index(slab, p)] = 0;
+#endif
+
+    size_t class = slab->size_class;
+    struct slab_cache* cache = &slab_caches[get_hartid()][class];
+    if (cache->count == SLAB_CACHE_SIZE)
+        slab_drain(cache, class, SLAB_CACHE_SIZE - SLAB_CACHE_BATCH);
+    cache->objects[cache->count++] = p;
 }
 
 void* realloc(void* p, size_t new_size) {
     if (p == NULL)
         return malloc(new_size);
 
-    struct s_free_bucket* bucket = p;
-    bucket--;
-
-    if (bucket->size >= new_size)
+    struct slab* slab = slab_of(p);
+    if (slab->size >= new_size)
         return p;
 
-    uint64_t origin;
+    uint64_t origin = 0;
+#ifdef HEAP_TRACK_ORIGINS
     asm volatile("mv %0, ra" : "=r" (origin));
-    void* new = free_buckets_alloc(new_size, origin);
+#endif
+    void* new = slab_alloc(new_size, origin);
     if (new == NULL) {
         return NULL;
     }
-    memcpy(new, p, bucket->size);
+    memcpy(new, p, slab->size);
 
     free(p);
     return new;
 }
 
-// debug_free_buckets_alloc(free_buckets_alloc_t*) -> void
-// Prints out the used buckets.
+// debug_free_buckets_alloc() -> void
+// Prints out the allocations that haven't been freed. Origins are only known with HEAP_TRACK_ORIGINS.
 void debug_free_buckets_alloc() {
-    bool f = false;
-    while (!atomic_compare_exchange_weak(&GLOBAL_ALLOC.mutating, &f, true)) {
-        f = false;
-    }
-
     console_puts("Starting debug\n");
-    struct s_free_bucket const* bucket = GLOBAL_ALLOC.used;
-    while (bucket != NULL) {
-        console_printf("Unfreed allocation originating from 0x%lx (%lu bytes)\n", bucket->origin, bucket->size);
-        bucket = bucket->next;
-    }
-    console_puts("Ending debug\n");
 
-    GLOBAL_ALLOC.mutating = false;
-}
+    for (size_t class = 0; class < SLAB_CLASS_COUNT; class++) {
+        struct slab_class* slab_class = &slab_classes[class];
+        spin_lock(&slab_class->lock);
+
+        size_t in_use = 0;
+        struct slab* lists[] = { slab_class->partial, slab_class->full };
+        for (size_t i = 0; i < sizeof(lists) / sizeof(struct slab*); i++) {
+            for (struct slab* slab = lists[i]; slab != NULL; slab = slab->next) {
+                in_use += slab->in_use;
+#ifdef HEAP_TRACK_ORIGINS
+                uint64_t* origins = slab_origins(slab);
+                for (size_t j = 0; j < slab->objects; j++) {
+                    if (origins[j] != 0)
+                        console_printf("Unfreed allocation originating from 0x%lx (%lu bytes)\n", origins[j], slab->size);
+                }
+#endif
+            }
+        }
 
-// memcpy(void*, const void*, unsigned long int) -> void*
-// Copys the data from one pointer to another.
-void* memcpy(void* dest, const void* src, unsigned long int n) {
-    unsigned char* d1 = dest;
-    const unsigned char* s1 = src;
-    unsigned char* end = dest + n;
+        spin_unlock(&slab_class->lock);
 
-    for (; d1 < end; d1++, s1++) {
-        *d1 = *s1;
+        if (in_use != 0)
+            console_printf("0x%lx objects of 0x%lx bytes in use or cached\n", in_use, slab_sizes[class]);
     }
 
-    return dest;
+#ifdef HEAP_TRACK_ORIGINS
+    spin_lock(&mutating_large_allocations);
+    for (struct slab* header = large_allocations; header != NULL; header = header->next) {
+        console_printf("Unfreed allocation originating from 0x%lx (%lu bytes)\n", header->origin, header->size);
+    }
+    spin_unlock(&mutating_large_allocations);
+#endif
+
+    console_puts("Ending debug\n");
 }
 
-// memset(void*, int, unsigned long int) -> void*
-// Sets a value over a space. Returns the original pointer.
-void* memset(void* p, int i, unsigned long int n) {
-    unsigned char c = i;
-    for (unsigned char* p1 = p; (void*) p1 < p + n; p1++) {
-        *p1 = c;
+// hart_has_vector(fdt_t*, void*) -> bool
+// Returns true if the device tree lists the V extension for the given cpu node.
+static bool hart_has_vector(fdt_t* tree, void* cpu) {
+    struct fdt_property extensions = fdt_get_property(tree, cpu, "riscv,isa-extensions");
+    for (uint32_t i = 0; i < extensions.len; i++) {
+        char* name = extensions.data + i;
+        if (name[0] == 'v' && name[1] == '\0')
+            return true;
+        while (i < extensions.len && extensions.data[i] != '\0')
+            i++;
     }
-    return p;
-}
 
-// memeq(void*, void*, size_t) -> bool
-// Returns true if the two pointers have identical data.
-bool memeq(void* p, void* q, size_t size) {
-    uint8_t* p1 = p;
-    uint8_t* q1 = q;
+    // Single letter extensions come right after rv64, before any multi-letter ones
+    struct fdt_property isa = fdt_get_property(tree, cpu, "riscv,isa");
+    for (uint32_t i = 4; i < isa.len && isa.data[i] != '\0' && isa.data[i] != '_'; i++) {
+        if (isa.data[i] == 'v')
+            return true;
+    }
+
+    return false;
+}
 
-    for (size_t i = 0; i < size; i++, p1++, q1++) {
-        if (*p1 != *q1)
-            return false;
+// init_memory_routines(fdt_t*) -> void
+// Switches memcpy, memset and memeq over to their vector versions if every hart has the V extension.
+void init_memory_routines(fdt_t* tree) {
+    bool vector = true;
+    size_t harts = 0;
+    void* cpu = NULL;
+    while ((cpu = fdt_find(tree, "cpu", cpu))) {
+        vector = vector && hart_has_vector(tree, cpu);
+        harts++;
     }
 
-    return true;
+    memops_use_vector(vector && harts != 0);
+    console_printf("[init_memory_routines] using %s memory routines\n", memops_vector_enabled() ? "vector" : "scalar");
 }
@@ -6,6 +6,7 @@
 #include <stdint.h>
 
 #include "fdt.h"
+#include "memops.h"
 
 #define PAGE_SIZE 4096
 
@@ -25,40 +26,82 @@ void init_pages(fdt_t* tree);
 // Gets the start of RAM.
 void* get_memory_start();
 
+// get_page_metadata(size_t, void**, void**) -> bool
+// Gets the physical range holding the page allocator metadata of the given memory region. Returns false if there is no such region.
+bool get_page_metadata(size_t region, void** start, void** end);
+
 // mark_as_used(void*, size_t) -> void
 // Marks the given pages as used.
 void mark_as_used(void* page, size_t size);
 
 // alloc_pages(size_t) -> void*
-// Allocates a number of pages.
+// Allocates a number of pages, zeroing out the values.
 void* alloc_pages(size_t count);
 
+// alloc_pages_nozero(size_t) -> void*
+// Allocates a number of pages without clearing them. Only for callers that overwrite the whole allocation.
+void* alloc_pages_nozero(size_t count);
+
+// alloc_pages_if_free(size_t, bool) -> void*
+// Allocates a number of pages only if they are free right now, optionally zeroed. Nothing is shrunk and nothing is printed on failure, for callers with a smaller allocation to fall back to.
+void* alloc_pages_if_free(size_t count, bool zero);
+
+// refill_zeroed_pages(size_t) -> void
+// Zeroes up to the given number of pages into the pre-zeroed pool. Called by idle harts.
+void refill_zeroed_pages(size_t budget);
+
 // incr_page_ref_count(void*, size_t) -> void
 // Increments the reference count of the selected pages.
 void incr_page_ref_count(void* page, size_t count);
 
+// get_page_ref_count(void*) -> uint16_t
+// Returns the reference count of the page, which is 0 for free pages and memory the allocator doesn't manage.
+uint16_t get_page_ref_count(void* page);
+
 // dealloc_pages(void*, size_t) -> void
-// Decrements the reference count of the selected pages.
+// Decrements the reference count of the selected pages, freeing pages that are no longer referenced.
 void dealloc_pages(void* page, size_t count);
 
+struct page_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+};
+
+// get_page_cache_stats(uint64_t) -> struct page_cache_stats
+// Returns the page cache counters of the given hart.
+struct page_cache_stats get_page_cache_stats(uint64_t hartid);
+
+// debug_page_caches() -> void
+// Prints out the page cache counters of every hart that has used its cache.
+void debug_page_caches();
+
+// Called under memory pressure with the number of pages wanted. Returns the number of pages freed.
+typedef size_t (*shrinker_t)(size_t count);
+
+// register_shrinker(shrinker_t) -> void
+// Registers a callback that is called to free memory when the page allocator runs out.
+void register_shrinker(shrinker_t shrinker);
+
+// shrink_memory(size_t) -> size_t
+// Asks the kernel caches to give back at least the given number of pages. Returns the number of pages freed.
+size_t shrink_memory(size_t count);
+
+// shrink_heap() -> size_t
+// Drains the current hart's object caches and returns every empty slab to the page allocator. Returns the number of pages freed.
+size_t shrink_heap();
+
 void* malloc(size_t size);
 void* realloc(void* p, size_t new_size);
 void free(void* p);
 
-// debug_free_buckets_alloc(free_buckets_alloc_t*) -> void
-// Prints out the used buckets.
+// debug_free_buckets_alloc() -> void
+// Prints out the allocations that haven't been freed. Origins are only known with HEAP_TRACK_ORIGINS.
 void debug_free_buckets_alloc();
 
-// memcpy(void*, const void*, unsigned long int) -> void*
-// Copys the data from one pointer to another.
-void* memcpy(void* dest, const void* src, unsigned long int n);
-
-// memset(void*, int, unsigned long int) -> void*
-// Sets a value over a space. Returns the original pointer.
-void* memset(void* p, int i, unsigned long int n);
-
-// memeq(void*, void*, size_t) -> bool
-// Returns true if the two pointers have identical data.
-bool memeq(void* p, void* q, size_t size);
+// init_memory_routines(fdt_t*) -> void
+// Switches memcpy, memset and memeq over to their vector versions if every hart has the V extension.
+void init_memory_routines(fdt_t* tree);
 
 #endif /* MEMORY_H */
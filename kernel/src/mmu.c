@@ -1,6 +1,10 @@
 #include "console.h"
+#include "interrupt.h"
 #include "memory.h"
 #include "mmu.h"
+#include "opensbi.h"
+#include "swap.h"
+#include "sync.h"
 #include <stdbool.h>
 
 #define KERNEL_SPACE_OFFSET 0xffffffc000000000
@@ -10,9 +14,127 @@
 #define MMU_TOP_HALF (MMU_ENTRY_COUNT / 2)
 #define VPN_COUNT 3
 
+// Range operations allocate at most this many physically contiguous pages at once, and flush the whole address space instead of single pages past MMU_FLUSH_PAGES_MAX
+#define MMU_ALLOC_BATCH 64
+#define MMU_FLUSH_PAGES_MAX 64
+
+// clean_mmu_table frees at most this many leaf tables before leaving the rest to reap_mmu_tables
+#define MMU_TEARDOWN_BUDGET 8
+
+#define SATP_MODE_SV39 0x8000000000000000
+#define SATP_PPN_MASK 0x00000fffffffffff
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xffff
+
 #define EMPTY_MMU(type) ((struct mmu_##type) { .data = 0, })
 #define MMU_WRAP(type, value) ((struct mmu_##type) { .data = (value), })
 
+// The kernel half of every address space is built once in kernel_template:
+// the direct map in the upper half plus the identity mapped kernel, stacks
+// and page metadata in whichever lower root entries they need. New roots copy
+// the template's root entries, so the tables below them are shared by
+// reference. Shared root entries can only be changed through the template
+// itself; mapping into them through any other root fails.
+static struct mmu_root kernel_template = EMPTY_MMU(root);
+static uint64_t shared_slots[MMU_ENTRY_COUNT / 64];
+
+// mmu_slot_shared(size_t) -> bool
+// Returns true if the given root entry belongs to the shared kernel half.
+static inline bool mmu_slot_shared(size_t i) {
+    return (shared_slots[i / 64] & ((uint64_t) 1 << (i % 64))) != 0;
+}
+
+// mmu_root_writable(struct mmu_root, size_t) -> bool
+// Returns true if the given root entry of the given table may be changed.
+static inline bool mmu_root_writable(struct mmu_root root, size_t i) {
+    return !mmu_slot_shared(i) || mmu_root_equal(root, kernel_template);
+}
+
+// Bits of a leaf that its swap entry keeps while the page is in swap
+#define MMU_SWAP_KEPT_BITS (MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_EXEC | MMU_BIT_USER)
+
+// mmu_new_leaf_bits(int) -> int
+// Returns the accessed and dirty bits a new leaf with the given flags starts with. User leaves start with neither, so the bits record real use; kernel leaves have both preset, since the kernel never takes faults to set them.
+static inline int mmu_new_leaf_bits(int flags) {
+    return (flags & MMU_BIT_USER) ? 0 : MMU_BIT_ACCESSED | MMU_BIT_DIRTY;
+}
+
+// Page table pages freed by clean_mmu_table are kept on a free list, linked
+// through their first entry, and handed out again before asking the page
+// allocator. Pages on the list are zero apart from the link. The list is
+// capped at MMU_TABLE_CACHE_MAX pages and is drained under memory pressure.
+#define MMU_TABLE_CACHE_MAX 64
+
+static void *table_cache = NULL;
+static size_t table_cache_count = 0;
+DEFINE_SPINLOCK(mutating_table_cache);
+
+// mmu_alloc_table() -> void*
+// Allocates a zeroed page for a page table, preferring the table cache. Returns the physical address.
+static void *mmu_alloc_table() {
+    if (table_cache != NULL) {
+        spin_lock(&mutating_table_cache);
+        void *page = table_cache;
+        if (page != NULL) {
+            intptr_t *safe = phys2safe(page);
+            table_cache = (void *) safe[0];
+            table_cache_count--;
+            safe[0] = 0;
+        }
+        spin_unlock(&mutating_table_cache);
+
+        if (page != NULL)
+            return page;
+    }
+
+    return alloc_pages(1);
+}
+
+// mmu_free_table(void*) -> void
+// Gives a page table page back to the table cache, clearing it. Entries that were invalidated without clearing them may still hold stale frame numbers, so every entry is cleared rather than just the valid ones.
+static void mmu_free_table(void *page) {
+    page = safe2phys(page);
+    intptr_t *safe = phys2safe(page);
+    for (size_t i = 1; i < MMU_ENTRY_COUNT; i++)
+        safe[i] = 0;
+
+    spin_lock(&mutating_table_cache);
+    if (table_cache_count < MMU_TABLE_CACHE_MAX) {
+        safe[0] = (intptr_t) table_cache;
+        table_cache = page;
+        table_cache_count++;
+        page = NULL;
+    }
+    spin_unlock(&mutating_table_cache);
+
+    if (page != NULL)
+        dealloc_pages(page, 1);
+}
+
+// shrink_table_cache(size_t) -> size_t
+// Returns every page in the table cache to the page allocator. Returns the number of pages freed.
+static size_t shrink_table_cache(size_t count) {
+    (void) count;
+    if (!spin_try_lock(&mutating_table_cache))
+        return 0;
+
+    void *page = table_cache;
+    size_t freed = table_cache_count;
+    table_cache = NULL;
+    table_cache_count = 0;
+    spin_unlock(&mutating_table_cache);
+
+    while (page != NULL) {
+        intptr_t *safe = phys2safe(page);
+        void *next = (void *) safe[0];
+        safe[0] = 0;
+        dealloc_pages(page, 1);
+        page = next;
+    }
+
+    return freed;
+}
+
 void *phys2safe(void *phys_addr) {
     uintptr_t addr_int = (uintptr_t) phys_addr;
     if (mmu_enabled() && addr_int <= KERNEL_SPACE_OFFSET) {
@@ -79,8 +201,11 @@ struct mmu_root get_mmu() {
     intptr_t mmu;
     asm volatile("csrr %0, satp" : "=r" (mmu));
 
-    if ((mmu & 0x8000000000000000) != 0)
-        return MMU_WRAP(root, (mmu & 0x00000fffffffffff) << 12);
+    if ((mmu & SATP_MODE_SV39) != 0) {
+        struct mmu_root root = MMU_WRAP(root, (mmu & SATP_PPN_MASK) << 12);
+        root.asid = (mmu >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+        return root;
+    }
     return EMPTY_MMU(root);
 }
 
@@ -117,52 +242,147 @@ struct mmu_entry *mmu_entry_get(struct mmu_entry entry, size_t i) {
     return NULL;
 }
 
+// Address spaces are tagged with ASIDs so switching between them doesn't
+// flush the TLB. ASIDs are handed out lazily by set_mmu from a counter. When
+// the counter runs out the generation is bumped and numbering starts over;
+// roots from an older generation get a new ASID the next time they're set,
+// and each hart flushes its whole TLB the first time it uses an ASID of a new
+// generation. ASID 0 is never handed out, and is what every root uses if the
+// hart has no ASID bits.
+static uint64_t asid_count = 1;
+static uint32_t asid_generation = 1;
+static uint64_t next_asid = 1;
+static uint32_t hart_generations[MAX_TRAP_COUNT];
+DEFINE_SPINLOCK(mutating_asids);
+
+// init_asids() -> void
+// Finds out how many ASID bits satp has. Must be called with paging enabled.
+void init_asids() {
+    uint64_t satp;
+    asm volatile("csrr %0, satp" : "=r" (satp));
+
+    // Unimplemented ASID bits are read-only zero. The table stays the same, so switching ASIDs here is harmless
+    uint64_t probe = satp | ((uint64_t) SATP_ASID_MASK << SATP_ASID_SHIFT);
+    asm volatile("csrw satp, %0" : : "r" (probe));
+    asm volatile("csrr %0, satp" : "=r" (probe));
+    asm volatile("csrw satp, %0" : : "r" (satp));
+    flush_mmu();
+
+    uint64_t bits = (probe >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    asid_count = bits + 1;
+    console_printf("[init_asids] 0x%lx asids available\n", asid_count);
+}
+
 // set_mmu(mmu_level_1_t*) -> void
 // Sets the satp csr to the provided mmu table pointer.
-void set_mmu(struct mmu_root root) {
-    if (mmu_root_valid(root)) {
-        struct mmu_root current = get_mmu();
+void set_mmu(struct mmu_root *root) {
+    if (!mmu_root_valid(*root))
+        return;
+
+    uint64_t hartid = get_hartid();
+    uint64_t current;
+    asm volatile("csrr %0, satp" : "=r" (current));
 
-        if (root.data == current.data)
+    if (asid_count <= 1) {
+        uint64_t mmu = SATP_MODE_SV39 | (root->data >> 12);
+        if (mmu == current)
             return;
 
-        // TODO: i dont think this is necessary
-        // if (mmu_root_valid(current)) {
-        //     top = kernel_space_phys2virtual(top);
-        //     current = kernel_space_phys2virtual(current);
+        asm volatile("csrw satp, %0" : : "r" (mmu));
+        flush_mmu();
+        return;
+    }
+
+    if (root->generation != asid_generation) {
+        spin_lock(&mutating_asids);
+        // Another hart may have set the same root in the meantime
+        if (root->generation != asid_generation) {
+            if (next_asid == asid_count) {
+                asid_generation++;
+                next_asid = 1;
+            }
+            root->asid = next_asid++;
+            root->generation = asid_generation;
+            root->hart = hartid;
+        }
+        spin_unlock(&mutating_asids);
+    }
+
+    bool new_generation = hart_generations[hartid] != root->generation;
+    bool migrated = root->hart != hartid;
+    hart_generations[hartid] = root->generation;
+    root->hart = hartid;
+
+    uint64_t mmu = SATP_MODE_SV39 | ((uint64_t) root->asid << SATP_ASID_SHIFT) | (root->data >> 12);
+    if (mmu != current)
+        asm volatile("csrw satp, %0" : : "r" (mmu));
 
-        //     for (size_t i = PAGE_SIZE / 2 / sizeof(void*); i < PAGE_SIZE / sizeof(void*); i++) {
-        //         top[i] = current[i];
-        //     }
+    // Entries of this ASID cached here before the task last ran on another hart may be stale
+    if (new_generation)
+        flush_mmu();
+    else if (migrated)
+        mmu_flush_asid(*root);
+}
 
-        //     top = kernel_space_virt2physical(top);
-        // }
+// mmu_walk_to_leaf(struct mmu_root, void*, size_t*) -> struct mmu_entry*
+// Walks to the entry mapping the given virtual address, which may be a megapage or gigapage leaf. Stores the size the entry maps in size if it isn't null.
+struct mmu_entry *mmu_walk_to_leaf(struct mmu_root root, void *virt_addr, size_t *size) {
+    intptr_t vpns[VPN_COUNT];
+    get_vpns(virt_addr, vpns, NULL);
 
-        uint64_t mmu = 0x8000000000000000 | (root.data >> 12);
-        asm volatile("csrw satp, %0" : "=r" (mmu));
-        asm volatile("sfence.vma");
+    struct mmu_entry *entry = mmu_root_get(root, vpns[0]);
+    size_t entry_size = MMU_GIGAPAGE_SIZE;
+
+    for (int i = 1; i < VPN_COUNT && entry && !mmu_entry_frame(*entry); i++) {
+        entry = mmu_entry_get(*entry, vpns[i]);
+        entry_size /= MMU_ENTRY_COUNT;
     }
+
+    if (size)
+        *size = entry_size;
+    return entry;
 }
 
-// flush_mmu() -> void
-// Flushes the table buffer or whatever its called.
-inline void flush_mmu() {
-    asm volatile("sfence.vma");
+struct mmu_entry *mmu_walk_to_entry(struct mmu_root root, void *virt_addr) {
+    return mmu_walk_to_leaf(root, virt_addr, NULL);
 }
 
+// mmu_split_leaf(struct mmu_entry*, size_t) -> bool
+// Replaces a megapage or gigapage leaf with a table of leaves one level down mapping the same memory with the same flags.
+static bool mmu_split_leaf(struct mmu_entry *entry, size_t size) {
+    struct mmu_entry *table = mmu_alloc_table();
+    if (!table)
+        return false;
 
-struct mmu_entry *mmu_walk_to_entry(struct mmu_root root, void *virt_addr) {
+    void *physical = safe2phys(mmu_entry_phys(*entry));
+    int flags = mmu_entry_flags(*entry, MMU_ALL_BITS);
+    struct mmu_entry *safe_table = phys2safe(table);
+    for (size_t i = 0; i < MMU_ENTRY_COUNT; i++) {
+        mmu_entry_set_flags(&safe_table[i], flags);
+        mmu_entry_set_phys(&safe_table[i], physical + i * (size / MMU_ENTRY_COUNT));
+    }
+
+    mmu_entry_set_flags(entry, MMU_BIT_VALID);
+    mmu_entry_set_phys(entry, table);
+    return true;
+}
+
+// mmu_walk_to_page(struct mmu_root, void*) -> struct mmu_entry*
+// Walks to the 4 KiB leaf mapping the given virtual address, splitting any megapage or gigapage leaf on the way.
+static struct mmu_entry *mmu_walk_to_page(struct mmu_root root, void *virt_addr) {
     intptr_t vpns[VPN_COUNT];
     get_vpns(virt_addr, vpns, NULL);
+    if (!mmu_root_writable(root, vpns[0]))
+        return NULL;
 
     struct mmu_entry *entry = mmu_root_get(root, vpns[0]);
-    if (!entry || mmu_entry_frame(*entry))
-        return entry;
+    size_t size = MMU_GIGAPAGE_SIZE;
 
-    for (int i = 1; i < VPN_COUNT; i++) {
+    for (int i = 1; i < VPN_COUNT && entry; i++) {
+        if (mmu_entry_frame(*entry) && !mmu_split_leaf(entry, size))
+            return NULL;
         entry = mmu_entry_get(*entry, vpns[i]);
-        if (!entry || mmu_entry_frame(*entry))
-            return entry;
+        size /= MMU_ENTRY_COUNT;
     }
 
     return entry;
@@ -202,15 +422,37 @@ bool mmu_translate(struct mmu_root root, void *virt_addr, void **phys_addr) {
 // mmu_map(mmu_level_1_t*, void*, void*, int) -> void
 // Maps the given virtual address to the given physical address.
 int mmu_map(struct mmu_root root, void *virt_addr, void *physical, int flags) {
+    return mmu_map_huge(root, virt_addr, physical, PAGE_SIZE, flags);
+}
+
+// mmu_map_huge(struct mmu_root, void*, void*, size_t, int) -> int
+// Maps a single leaf of the given size (a page, megapage or gigapage). Both addresses must be aligned to the size.
+int mmu_map_huge(struct mmu_root root, void *virt_addr, void *physical, size_t size, int flags) {
+    int levels;
+    if (size == PAGE_SIZE)
+        levels = VPN_COUNT;
+    else if (size == MMU_MEGAPAGE_SIZE)
+        levels = VPN_COUNT - 1;
+    else if (size == MMU_GIGAPAGE_SIZE)
+        levels = VPN_COUNT - 2;
+    else return -1;
+
+    if (((intptr_t) virt_addr | (intptr_t) physical) & (size - 1))
+        return -1;
+
     intptr_t vpns[VPN_COUNT];
     get_vpns(virt_addr, vpns, NULL);
+    if (!mmu_root_writable(root, vpns[0]))
+        return -1;
 
     struct mmu_entry *entry = mmu_root_get_any(root, vpns[0]);
-    for (int i = 1; i < VPN_COUNT; i++) {
+    for (int i = 1; i < levels; i++) {
         if (!entry || (mmu_entry_valid(*entry) && mmu_entry_frame(*entry)))
             return -1;
         if (!mmu_entry_valid(*entry)) {
-            void *page = alloc_pages(1);
+            void *page = mmu_alloc_table();
+            if (!page)
+                return -1;
             mmu_entry_set_flags(entry,
                 MMU_BIT_VALID);
             mmu_entry_set_phys(entry, page);
@@ -219,10 +461,10 @@ int mmu_map(struct mmu_root root, void *virt_addr, void *physical, int flags) {
         entry = mmu_entry_get_any(*entry, vpns[i]);
     }
 
-    if (!entry || mmu_entry_valid(*entry))
+    if (!entry || mmu_entry_used(*entry))
         return -1;
     mmu_entry_set_flags(entry, flags
-        | MMU_BIT_VALID | MMU_BIT_ACCESSED | MMU_BIT_DIRTY);
+        | MMU_BIT_VALID | mmu_new_leaf_bits(flags));
     mmu_entry_set_phys(entry, physical);
     return 0;
 }
@@ -239,26 +481,683 @@ void *mmu_alloc(struct mmu_root root, void *virt_addr, int flags) {
     return physical;
 }
 
+// mmu_alloc_huge(struct mmu_root, void*, size_t, int) -> void*
+// Allocates a zeroed megapage or gigapage and maps it as a single leaf, returning the physical address.
+void *mmu_alloc_huge(struct mmu_root root, void *virt_addr, size_t size, int flags) {
+    // Buddy blocks are aligned to their size, so a power of two run of pages is aligned for the leaf
+    void *physical = alloc_pages(size / PAGE_SIZE);
+    if (!physical)
+        return NULL;
+
+    if (mmu_map_huge(root, virt_addr, physical, size, flags)) {
+        dealloc_pages(physical, size / PAGE_SIZE);
+        return NULL;
+    }
+
+    return physical;
+}
+
+// mmu_flush_entry(struct mmu_root, void*, struct mmu_entry) -> void
+// Flushes the TLB entries for a leaf that was just changed. Global entries are cached under every ASID.
+static void mmu_flush_entry(struct mmu_root root, void *virt_addr, struct mmu_entry old) {
+    if (mmu_entry_global(old))
+        asm volatile("sfence.vma %0, zero" : : "r" (virt_addr) : "memory");
+    else
+        mmu_flush_page(root, virt_addr);
+}
+
+// mmu_leaf_flags(struct mmu_entry, int) -> int
+// Returns the flags a leaf gets when its flags are changed. Frames shared with another address space or not owned by the allocator are made copy on write instead of writable. The accessed, dirty and idle bits of the leaf are kept.
+static int mmu_leaf_flags(struct mmu_entry entry, int flags) {
+    flags &= ~(MMU_BIT_COW | MMU_BIT_ACCESSED | MMU_BIT_DIRTY | MMU_BIT_IDLE);
+    if ((flags & (MMU_BIT_WRITE | MMU_BIT_USER)) == (MMU_BIT_WRITE | MMU_BIT_USER)
+        && get_page_ref_count(mmu_entry_phys(entry)) != 1)
+        flags = (flags & ~MMU_BIT_WRITE) | MMU_BIT_COW;
+
+    // Valid entries without read, write or execute point to page tables, so anything else here would let the MMU walk a data frame as one
+    int rwx = flags & (MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_EXEC);
+    if (rwx == 0 || (rwx & (MMU_BIT_READ | MMU_BIT_WRITE)) == MMU_BIT_WRITE) {
+        console_printf("[mmu_leaf_flags] flags 0x%x don't make a leaf\nKERNEL PANIC!\n", flags);
+        while(1);
+    }
+    return flags | mmu_entry_flags(entry, MMU_BIT_ACCESSED | MMU_BIT_DIRTY | MMU_BIT_IDLE) | mmu_new_leaf_bits(flags);
+}
+
 // mmu_change_flags(mmu_level_1_t*, void*, int) -> void
 // Changes the mmu page flags on the entry if the entry exists.
 void mmu_change_flags(struct mmu_root root, void *virt_addr, int flags) {
-    struct mmu_entry *entry = mmu_walk_to_entry(root, virt_addr);
-    if (entry)
-        mmu_entry_set_flags(entry, flags
-            | MMU_BIT_VALID | MMU_BIT_ACCESSED | MMU_BIT_DIRTY);
+    struct mmu_entry *entry = mmu_walk_to_page(root, virt_addr);
+    if (entry) {
+        struct mmu_entry old = *entry;
+        mmu_entry_set_flags(entry, mmu_leaf_flags(old, flags) | MMU_BIT_VALID);
+        mmu_flush_entry(root, virt_addr, old);
+    }
 }
 
 // mmu_remove(mmu_level_1_t*, void*) -> void*
 // Removes an entry from the mmu table.
 void *mmu_remove(struct mmu_root root, void *virt_addr) {
-    struct mmu_entry *entry = mmu_walk_to_entry(root, virt_addr);
+    struct mmu_entry *entry = mmu_walk_to_page(root, virt_addr);
     if (!entry)
         return NULL;
-    void *physical = mmu_entry_phys(*entry);
+    struct mmu_entry old = *entry;
+    void *physical = mmu_entry_phys(old);
     mmu_entry_set_flags(entry, 0);
+    mmu_flush_entry(root, virt_addr, old);
     return physical;
 }
 
+// mmu_remove_huge(struct mmu_root, void*, size_t) -> void*
+// Removes a whole megapage or gigapage leaf from the mmu table. Returns null if the address isn't mapped by a leaf of that size.
+void *mmu_remove_huge(struct mmu_root root, void *virt_addr, size_t size) {
+    intptr_t vpns[VPN_COUNT];
+    get_vpns(virt_addr, vpns, NULL);
+    if (!mmu_root_writable(root, vpns[0]))
+        return NULL;
+
+    size_t entry_size;
+    struct mmu_entry *entry = mmu_walk_to_leaf(root, virt_addr, &entry_size);
+    if (!entry || !mmu_entry_frame(*entry) || entry_size != size)
+        return NULL;
+    struct mmu_entry old = *entry;
+    void *physical = mmu_entry_phys(old);
+    mmu_entry_set_flags(entry, 0);
+    mmu_flush_entry(root, virt_addr, old);
+    return physical;
+}
+
+// mmu_walk_range(struct mmu_root, void*, size_t, bool, size_t*) -> struct mmu_entry*
+// Walks towards the entry for the given address, stopping early at leaves and at empty entries. If create is set, missing tables are allocated on the way down until the walk reaches entries mapping leaf_size bytes. Stores the size the returned entry maps in size.
+static struct mmu_entry *mmu_walk_range(struct mmu_root root, void *virt_addr, size_t leaf_size, bool create, size_t *size) {
+    intptr_t vpns[VPN_COUNT];
+    get_vpns(virt_addr, vpns, NULL);
+    if (!mmu_root_writable(root, vpns[0]))
+        return NULL;
+
+    struct mmu_entry *entry = mmu_root_get_any(root, vpns[0]);
+    size_t entry_size = MMU_GIGAPAGE_SIZE;
+    for (int i = 1; i < VPN_COUNT && entry; i++) {
+        if (mmu_entry_valid(*entry) && mmu_entry_frame(*entry))
+            break;
+
+        if (!mmu_entry_valid(*entry)) {
+            if (!create || entry_size <= leaf_size)
+                break;
+
+            void *page = mmu_alloc_table();
+            if (!page)
+                return NULL;
+            mmu_entry_set_flags(entry, MMU_BIT_VALID);
+            mmu_entry_set_phys(entry, page);
+        }
+
+        entry = mmu_entry_get_any(*entry, vpns[i]);
+        entry_size /= MMU_ENTRY_COUNT;
+    }
+
+    *size = entry_size;
+    return entry;
+}
+
+// mmu_table_remaining(void*, void*) -> size_t
+// Returns how many page entries from the given address to end lie in the same leaf table.
+static size_t mmu_table_remaining(void *virt_addr, void *end) {
+    size_t left = MMU_ENTRY_COUNT - ((intptr_t) virt_addr / PAGE_SIZE) % MMU_ENTRY_COUNT;
+    size_t wanted = (end - virt_addr) / PAGE_SIZE;
+    return left < wanted ? left : wanted;
+}
+
+// mmu_flush_range(struct mmu_root, void*, void*, bool) -> void
+// Flushes the TLB entries for a range of changed leaves, or the whole address space if the range is large.
+static void mmu_flush_range(struct mmu_root root, void *start, void *end, bool global) {
+    if ((size_t) (end - start) / PAGE_SIZE > MMU_FLUSH_PAGES_MAX) {
+        if (global)
+            flush_mmu();
+        else
+            mmu_flush_asid(root);
+        return;
+    }
+
+    for (void *p = start; p < end; p += PAGE_SIZE) {
+        if (global)
+            asm volatile("sfence.vma %0, zero" : : "r" (p) : "memory");
+        else
+            mmu_flush_page(root, p);
+    }
+}
+
+// mmu_map_range(struct mmu_root, void*, void*, size_t, int) -> int
+// Maps page_count pages starting at the given virtual address to consecutive physical memory, using megapage and gigapage leaves wherever both addresses are aligned for them. Fails without mapping anything if part of the range is mapped already.
+int mmu_map_range(struct mmu_root root, void *virt_addr, void *physical, size_t page_count, int flags) {
+    if (((intptr_t) virt_addr | (intptr_t) physical) & (PAGE_SIZE - 1))
+        return -1;
+
+    void *end = virt_addr + page_count * PAGE_SIZE;
+    if (end < virt_addr)
+        return -1;
+
+    void *p = virt_addr;
+    while (p < end) {
+        void *phys = physical + (p - virt_addr);
+        size_t leaf_size = MMU_GIGAPAGE_SIZE;
+        while (leaf_size > PAGE_SIZE
+            && ((((intptr_t) p | (intptr_t) phys) & (leaf_size - 1)) != 0 || (size_t) (end - p) < leaf_size))
+            leaf_size /= MMU_ENTRY_COUNT;
+
+        size_t size;
+        struct mmu_entry *entry = mmu_walk_range(root, p, leaf_size, true, &size);
+        if (!entry || mmu_entry_used(*entry))
+            break;
+
+        size_t count = size == PAGE_SIZE ? mmu_table_remaining(p, end) : 1;
+        size_t i;
+        for (i = 0; i < count && !mmu_entry_used(entry[i]); i++) {
+            mmu_entry_set_flags(&entry[i], flags
+                | MMU_BIT_VALID | mmu_new_leaf_bits(flags));
+            mmu_entry_set_phys(&entry[i], phys + i * size);
+        }
+
+        p += i * size;
+        if (i < count)
+            break;
+    }
+
+    if (p < end) {
+        mmu_remove_range(root, virt_addr, (p - virt_addr) / PAGE_SIZE, false);
+        return -1;
+    }
+    return 0;
+}
+
+// mmu_alloc_range_pages(struct mmu_root, void*, size_t, int, bool) -> int
+// Backs a range with newly allocated memory, optionally zeroed. Aligned 2 MiB chunks get a megapage each; the rest is allocated in physically contiguous batches of up to MMU_ALLOC_BATCH pages, one batch per run of empty entries in a leaf table.
+static int mmu_alloc_range_pages(struct mmu_root root, void *virt_addr, size_t page_count, int flags, bool zero) {
+    if ((intptr_t) virt_addr & (PAGE_SIZE - 1))
+        return -1;
+
+    void *end = virt_addr + page_count * PAGE_SIZE;
+    if (end < virt_addr)
+        return -1;
+
+    void *p = virt_addr;
+    while (p < end) {
+        size_t size;
+        struct mmu_entry *entry = NULL;
+        if ((intptr_t) p % MMU_MEGAPAGE_SIZE == 0 && (size_t) (end - p) >= MMU_MEGAPAGE_SIZE) {
+            entry = mmu_walk_range(root, p, MMU_MEGAPAGE_SIZE, true, &size);
+            if (entry && !mmu_entry_valid(*entry) && size == MMU_MEGAPAGE_SIZE) {
+                // Buddy blocks are aligned to their size, so a power of two run of pages is aligned for the leaf
+                // The megapage is only an optimisation, so nothing is shrunk or swapped out to make room for it
+                size_t pages = MMU_MEGAPAGE_SIZE / PAGE_SIZE;
+                void *physical = alloc_pages_if_free(pages, zero);
+                if (physical) {
+                    mmu_entry_set_flags(entry, flags
+                        | MMU_BIT_VALID | mmu_new_leaf_bits(flags));
+                    mmu_entry_set_phys(entry, physical);
+                    p += MMU_MEGAPAGE_SIZE;
+                    continue;
+                }
+            }
+        }
+
+        entry = mmu_walk_range(root, p, PAGE_SIZE, true, &size);
+        if (!entry || size != PAGE_SIZE)
+            break;
+
+        size_t count = mmu_table_remaining(p, end);
+        if (count > MMU_ALLOC_BATCH)
+            count = MMU_ALLOC_BATCH;
+        size_t empty = 0;
+        while (empty < count && !mmu_entry_used(entry[empty]))
+            empty++;
+        if (empty == 0)
+            break;
+
+        // Fall back to smaller batches when memory is fragmented. Only the last single page is worth shrinking memory for
+        void *physical = NULL;
+        for (count = empty; count > 1; count /= 2) {
+            physical = alloc_pages_if_free(count, zero);
+            if (physical)
+                break;
+        }
+        if (!physical) {
+            count = 1;
+            physical = zero ? alloc_pages(1) : alloc_pages_nozero(1);
+        }
+        if (!physical)
+            break;
+
+        for (size_t i = 0; i < count; i++) {
+            mmu_entry_set_flags(&entry[i], flags
+                | MMU_BIT_VALID | mmu_new_leaf_bits(flags));
+            mmu_entry_set_phys(&entry[i], physical + i * PAGE_SIZE);
+        }
+        p += count * PAGE_SIZE;
+    }
+
+    if (p < end) {
+        mmu_remove_range(root, virt_addr, (p - virt_addr) / PAGE_SIZE, true);
+        return -1;
+    }
+    return 0;
+}
+
+// mmu_alloc_range(struct mmu_root, void*, size_t, int) -> int
+// Allocates zeroed pages for page_count pages starting at the given virtual address and maps them. Fails without mapping anything if part of the range is mapped already or memory runs out.
+int mmu_alloc_range(struct mmu_root root, void *virt_addr, size_t page_count, int flags) {
+    return mmu_alloc_range_pages(root, virt_addr, page_count, flags, true);
+}
+
+// mmu_alloc_range_nozero(struct mmu_root, void*, size_t, int) -> int
+// Same as mmu_alloc_range, but doesn't clear the pages. Only for callers that overwrite the whole range.
+int mmu_alloc_range_nozero(struct mmu_root root, void *virt_addr, size_t page_count, int flags) {
+    return mmu_alloc_range_pages(root, virt_addr, page_count, flags, false);
+}
+
+// mmu_range_mapped(struct mmu_root, void*, size_t, int) -> bool
+// Returns true if every page in the range is mapped by a leaf with all of the given flags set. Pages in swap count as mapped with the flags their swap entry keeps.
+bool mmu_range_mapped(struct mmu_root root, void *virt_addr, size_t page_count, int flags) {
+    void *end = virt_addr + page_count * PAGE_SIZE;
+    if ((intptr_t) virt_addr & (PAGE_SIZE - 1) || end < virt_addr)
+        return false;
+
+    void *p = virt_addr;
+    while (p < end) {
+        size_t size;
+        struct mmu_entry *entry = mmu_walk_range(root, p, PAGE_SIZE, false, &size);
+        if (!entry)
+            return false;
+
+        size_t count = size == PAGE_SIZE ? mmu_table_remaining(p, end) : 1;
+        for (size_t i = 0; i < count; i++) {
+            if (!mmu_entry_used(entry[i]) || !mmu_entry_frame(entry[i])
+                || mmu_entry_flags(entry[i], flags) != flags)
+                return false;
+        }
+
+        if (size == PAGE_SIZE)
+            p += count * PAGE_SIZE;
+        else
+            p = (void *) (((intptr_t) p & ~(size - 1)) + size);
+    }
+
+    return true;
+}
+
+// mmu_change_flags_range(struct mmu_root, void*, size_t, int) -> void
+// Changes the flags of every mapped page in the range. Megapage and gigapage leaves the range only partly covers are split first.
+void mmu_change_flags_range(struct mmu_root root, void *virt_addr, size_t page_count, int flags) {
+    void *end = virt_addr + page_count * PAGE_SIZE;
+    bool global = false;
+    void *p = virt_addr;
+    while (p < end) {
+        size_t size;
+        struct mmu_entry *entry = mmu_walk_range(root, p, PAGE_SIZE, false, &size);
+
+        // Root slots shared with the kernel aren't the table's to change, but the rest of the range still is
+        if (!entry) {
+            p = (void *) (((intptr_t) p & ~(MMU_GIGAPAGE_SIZE - 1)) + MMU_GIGAPAGE_SIZE);
+            continue;
+        }
+
+        if (!mmu_entry_used(*entry)) {
+            p = (void *) (((intptr_t) p & ~(size - 1)) + size);
+            continue;
+        }
+
+        if (size != PAGE_SIZE) {
+            if (((intptr_t) p & (size - 1)) != 0 || (size_t) (end - p) < size) {
+                if (!mmu_split_leaf(entry, size))
+                    break;
+                continue;
+            }
+
+            global |= mmu_entry_global(*entry);
+            mmu_entry_set_flags(entry, mmu_leaf_flags(*entry, flags) | MMU_BIT_VALID);
+            p += size;
+            continue;
+        }
+
+        size_t count = mmu_table_remaining(p, end);
+        for (size_t i = 0; i < count; i++) {
+            if (mmu_entry_valid(entry[i])) {
+                global |= mmu_entry_global(entry[i]);
+                mmu_entry_set_flags(&entry[i], mmu_leaf_flags(entry[i], flags) | MMU_BIT_VALID);
+            } else if (mmu_entry_swapped(entry[i])) {
+                // Pages come back from swap private, so they can simply be writable
+                mmu_entry_set_flags(&entry[i], (flags & MMU_SWAP_KEPT_BITS) | MMU_BIT_SWAPPED);
+            }
+        }
+        p += count * PAGE_SIZE;
+    }
+
+    mmu_flush_range(root, virt_addr, p < end ? p : end, global);
+}
+
+// mmu_remove_range(struct mmu_root, void*, size_t, bool) -> void
+// Removes every mapping in the range, releasing the frames with dealloc_pages if dealloc is set. Pages in swap always give up their slots. Megapage and gigapage leaves the range only partly covers are split first.
+void mmu_remove_range(struct mmu_root root, void *virt_addr, size_t page_count, bool dealloc) {
+    void *end = virt_addr + page_count * PAGE_SIZE;
+    bool global = false;
+    void *p = virt_addr;
+    while (p < end) {
+        size_t size;
+        struct mmu_entry *entry = mmu_walk_range(root, p, PAGE_SIZE, false, &size);
+
+        // Root slots shared with the kernel aren't the table's to change, but the rest of the range still is
+        if (!entry) {
+            p = (void *) (((intptr_t) p & ~(MMU_GIGAPAGE_SIZE - 1)) + MMU_GIGAPAGE_SIZE);
+            continue;
+        }
+
+        if (!mmu_entry_used(*entry)) {
+            p = (void *) (((intptr_t) p & ~(size - 1)) + size);
+            continue;
+        }
+
+        if (size != PAGE_SIZE) {
+            if (((intptr_t) p & (size - 1)) != 0 || (size_t) (end - p) < size) {
+                if (!mmu_split_leaf(entry, size))
+                    break;
+                continue;
+            }
+
+            global |= mmu_entry_global(*entry);
+            if (dealloc)
+                dealloc_pages(mmu_entry_phys(*entry), size / PAGE_SIZE);
+            mmu_entry_set_flags(entry, 0);
+            p += size;
+            continue;
+        }
+
+        // Runs of physically consecutive frames are released with one call
+        size_t count = mmu_table_remaining(p, end);
+        void *run = NULL;
+        size_t run_length = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (mmu_entry_swapped(entry[i])) {
+                swap_slot_free(mmu_entry_swap_slot(entry[i]));
+                entry[i].data = 0;
+                continue;
+            }
+            if (!mmu_entry_valid(entry[i]))
+                continue;
+
+            global |= mmu_entry_global(entry[i]);
+            void *physical = mmu_entry_phys(entry[i]);
+            mmu_entry_set_flags(&entry[i], 0);
+            if (!dealloc)
+                continue;
+
+            if (run_length != 0 && physical == run + run_length * PAGE_SIZE) {
+                run_length++;
+                continue;
+            }
+            if (run_length != 0)
+                dealloc_pages(run, run_length);
+            run = physical;
+            run_length = 1;
+        }
+        if (run_length != 0)
+            dealloc_pages(run, run_length);
+        p += count * PAGE_SIZE;
+    }
+
+    mmu_flush_range(root, virt_addr, p < end ? p : end, global);
+}
+
+// mmu_clone_entry(struct mmu_entry*, struct mmu_entry*, size_t) -> bool
+// Copies an entry mapping size bytes into an empty entry. Leaves share their frames, taking a reference to each page, swap entries share their slots, and tables are copied recursively.
+static bool mmu_clone_entry(struct mmu_entry *dest, struct mmu_entry *src, size_t size) {
+    if (mmu_entry_frame(*src)) {
+        void *frame = mmu_entry_phys(*src);
+        if (mmu_entry_write(*src) && mmu_entry_user(*src) && get_page_ref_count(frame) != 0) {
+            mmu_entry_set_flags(src, (mmu_entry_flags(*src, MMU_ALL_BITS) & ~MMU_BIT_WRITE) | MMU_BIT_COW);
+        }
+        incr_page_ref_count(frame, size / PAGE_SIZE);
+        *dest = *src;
+        return true;
+    }
+
+    void *page = mmu_alloc_table();
+    if (!page)
+        return false;
+    mmu_entry_set_flags(dest, MMU_BIT_VALID);
+    mmu_entry_set_phys(dest, page);
+
+    struct mmu_entry *dest_table = phys2safe(page);
+    struct mmu_entry *src_table = mmu_entry_phys(*src);
+    for (size_t i = 0; i < MMU_ENTRY_COUNT; i++) {
+        if (mmu_entry_swapped(src_table[i])) {
+            swap_slot_dup(mmu_entry_swap_slot(src_table[i]));
+            dest_table[i] = src_table[i];
+        } else if (mmu_entry_valid(src_table[i]) && !mmu_clone_entry(&dest_table[i], &src_table[i], size / MMU_ENTRY_COUNT)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// mmu_clone_user(struct mmu_root, struct mmu_root) -> int
+// Copies the user half of src into the new table dest, sharing every frame with it. Writable frames from the page allocator become copy on write in both tables. On failure dest holds part of the copy and has to be cleaned. src must not be in use on another hart.
+int mmu_clone_user(struct mmu_root dest, struct mmu_root src) {
+    struct mmu_entry *dest_top = phys2safe((void *) dest.data);
+    struct mmu_entry *src_top = phys2safe((void *) src.data);
+
+    int result = 0;
+    for (size_t i = 0; i < MMU_ENTRY_COUNT && result == 0; i++) {
+        if (mmu_slot_shared(i) || !mmu_entry_valid(src_top[i]) || mmu_entry_valid(dest_top[i]))
+            continue;
+        if (!mmu_clone_entry(&dest_top[i], &src_top[i], MMU_GIGAPAGE_SIZE))
+            result = -1;
+    }
+
+    // Leaves of src that were writable are read only now
+    mmu_flush_asid(src);
+    return result;
+}
+
+// mmu_resolve_cow(struct mmu_root, void*) -> bool
+// Makes the copy on write page at the given address writable, copying its frame first unless this address space is its only owner. Returns false if the page isn't copy on write or memory runs out.
+bool mmu_resolve_cow(struct mmu_root root, void *virt_addr) {
+    virt_addr = (void *) ((intptr_t) virt_addr & ~(PAGE_SIZE - 1));
+    struct mmu_entry *entry = mmu_walk_to_page(root, virt_addr);
+    if (!entry || !mmu_entry_valid(*entry) || !mmu_entry_cow(*entry))
+        return false;
+
+    // The last address space holding the frame can take it over without a copy. Frames the allocator doesn't manage, like the initrd, are always copied
+    void *frame = mmu_entry_phys(*entry);
+    if (get_page_ref_count(frame) != 1) {
+        void *copy = alloc_pages_nozero(1);
+        if (!copy)
+            return false;
+        memcpy(phys2safe(copy), frame, PAGE_SIZE);
+        mmu_entry_set_phys(entry, copy);
+        dealloc_pages(frame, 1);
+    }
+
+    mmu_entry_set_flags(entry, (mmu_entry_flags(*entry, MMU_ALL_BITS) & ~(MMU_BIT_COW | MMU_BIT_IDLE))
+        | MMU_BIT_WRITE | MMU_BIT_ACCESSED | MMU_BIT_DIRTY);
+    mmu_flush_page(root, virt_addr);
+    return true;
+}
+
+// mmu_share_writable(struct mmu_root, void*, size_t) -> void
+// Makes the copy on write pages in the range writable again without copying them, for frames that are meant to stay shared between address spaces.
+void mmu_share_writable(struct mmu_root root, void *virt_addr, size_t page_count) {
+    void *end = virt_addr + page_count * PAGE_SIZE;
+    for (void *p = virt_addr; p < end; p += PAGE_SIZE) {
+        struct mmu_entry *entry = mmu_walk_to_page(root, p);
+        if (entry && mmu_entry_valid(*entry) && mmu_entry_cow(*entry))
+            mmu_entry_set_flags(entry, (mmu_entry_flags(*entry, MMU_ALL_BITS) & ~MMU_BIT_COW) | MMU_BIT_WRITE);
+    }
+    mmu_flush_range(root, virt_addr, end, false);
+}
+
+// mmu_mark_accessed(struct mmu_root, void*, bool) -> bool
+// Sets the accessed bit of the user leaf mapping the given address, and its dirty bit for writes, like hardware that updates them would. Returns false if there is no such leaf or it was already marked.
+bool mmu_mark_accessed(struct mmu_root root, void *virt_addr, bool write) {
+    struct mmu_entry *entry = mmu_walk_to_leaf(root, virt_addr, NULL);
+    if (!entry || !mmu_entry_valid(*entry) || !mmu_entry_frame(*entry) || !mmu_entry_user(*entry))
+        return false;
+
+    int bits = MMU_BIT_ACCESSED | (write ? MMU_BIT_DIRTY : 0);
+    if (mmu_entry_flags(*entry, bits) == bits)
+        return false;
+
+    mmu_entry_set_flags(entry, mmu_entry_flags(*entry, MMU_ALL_BITS & ~MMU_BIT_IDLE) | bits);
+    mmu_flush_page(root, virt_addr);
+    return true;
+}
+
+// mmu_scan_entry(struct mmu_entry*, size_t, struct mmu_scan_counts*) -> void
+// Counts the user pages under an entry mapping size bytes and starts a new interval for them.
+static void mmu_scan_entry(struct mmu_entry *entry, size_t size, struct mmu_scan_counts *counts) {
+    if (mmu_entry_frame(*entry)) {
+        if (!mmu_entry_user(*entry))
+            return;
+
+        size_t pages = size / PAGE_SIZE;
+        int flags = mmu_entry_flags(*entry, MMU_ALL_BITS);
+        counts->resident += pages;
+        if (flags & MMU_BIT_DIRTY)
+            counts->dirty += pages;
+
+        if (flags & MMU_BIT_ACCESSED) {
+            counts->accessed += pages;
+            flags &= ~(MMU_BIT_ACCESSED | MMU_BIT_IDLE);
+        } else if (flags & MMU_BIT_IDLE) {
+            counts->cold += pages;
+        } else {
+            counts->idle += pages;
+            flags |= MMU_BIT_IDLE;
+        }
+        mmu_entry_set_flags(entry, flags);
+        return;
+    }
+
+    struct mmu_entry *table = mmu_entry_phys(*entry);
+    for (size_t i = 0; i < MMU_ENTRY_COUNT; i++) {
+        if (mmu_entry_valid(table[i]))
+            mmu_scan_entry(&table[i], size / MMU_ENTRY_COUNT, counts);
+        else if (mmu_entry_swapped(table[i]))
+            counts->swapped++;
+    }
+}
+
+// mmu_scan_user(struct mmu_root, struct mmu_scan_counts*) -> void
+// Counts the user pages of an address space by how recently they were accessed, then clears their accessed bits to start the next interval. The address space must not be in use on another hart.
+void mmu_scan_user(struct mmu_root root, struct mmu_scan_counts *counts) {
+    *counts = (struct mmu_scan_counts) { 0 };
+    struct mmu_entry *top = phys2safe((void *) root.data);
+    for (size_t i = 0; i < MMU_ENTRY_COUNT; i++) {
+        if (!mmu_slot_shared(i) && mmu_entry_valid(top[i]))
+            mmu_scan_entry(&top[i], MMU_GIGAPAGE_SIZE, counts);
+    }
+
+    // Cached entries still have the accessed bit set, so the hardware wouldn't set it again
+    mmu_flush_asid(root);
+}
+
+// mmu_walk_to_swapped(struct mmu_root, void*) -> struct mmu_entry*
+// Returns the swap entry for the page at the given address, or null if the page isn't in swap.
+struct mmu_entry *mmu_walk_to_swapped(struct mmu_root root, void *virt_addr) {
+    size_t size;
+    struct mmu_entry *entry = mmu_walk_range(root, virt_addr, PAGE_SIZE, false, &size);
+    if (!entry || size != PAGE_SIZE || !mmu_entry_swapped(*entry))
+        return NULL;
+    return entry;
+}
+
+// mmu_reclaim_scan(struct mmu_root, void**, struct mmu_entry**, size_t) -> size_t
+// Runs the reclaim clock over the user pages of an address space from the address in cursor. Pages accessed since the last pass lose their accessed bit and are passed over; the first run of at most max neighbouring pages that weren't is returned through run, and cursor is left after it. Only 4 KiB leaves whose frames this address space owns alone are considered. Returns the number of pages in the run, or 0 with cursor reset once the end of the address space is reached. The caller flushes the TLB.
+size_t mmu_reclaim_scan(struct mmu_root root, void **cursor, struct mmu_entry **run, size_t max) {
+    void *p = (void *) ((intptr_t) *cursor & ~(PAGE_SIZE - 1));
+    while (p < MMU_USER_TOP) {
+        size_t size;
+        struct mmu_entry *entry = mmu_walk_range(root, p, PAGE_SIZE, false, &size);
+
+        // Shared kernel root entries, missing tables and megapage or gigapage leaves have nothing to reclaim
+        if (!entry || size != PAGE_SIZE) {
+            if (!entry)
+                size = MMU_GIGAPAGE_SIZE;
+            p = (void *) (((intptr_t) p & ~(size - 1)) + size);
+            continue;
+        }
+
+        // Runs never cross leaf tables, so the caller can index them as an array
+        size_t count = mmu_table_remaining(p, MMU_USER_TOP);
+        size_t length = 0;
+        for (size_t i = 0; i < count; i++) {
+            struct mmu_entry *leaf = &entry[i];
+            bool owned = mmu_entry_valid(*leaf) && mmu_entry_frame(*leaf) && mmu_entry_user(*leaf)
+                && !mmu_entry_global(*leaf) && get_page_ref_count(mmu_entry_phys(*leaf)) == 1;
+
+            if (owned && !mmu_entry_accessed(*leaf)) {
+                if (length == 0)
+                    *run = leaf;
+                if (++length < max)
+                    continue;
+            } else if (owned) {
+                mmu_entry_set_flags(leaf, mmu_entry_flags(*leaf, MMU_ALL_BITS) & ~MMU_BIT_ACCESSED);
+            }
+
+            if (length != 0) {
+                *cursor = p + (i + 1) * PAGE_SIZE;
+                return length;
+            }
+        }
+
+        p += count * PAGE_SIZE;
+        if (length != 0) {
+            *cursor = p;
+            return length;
+        }
+    }
+
+    *cursor = NULL;
+    return 0;
+}
+
+// mmu_entry_swap_out(struct mmu_entry*, size_t) -> void*
+// Turns a 4 KiB user leaf into a swap entry for the given slot, keeping its permissions. Copy on write leaves are kept writable, since the page comes back private. Returns the frame the leaf mapped. The caller flushes the TLB.
+void *mmu_entry_swap_out(struct mmu_entry *entry, size_t slot) {
+    void *frame = mmu_entry_phys(*entry);
+    int flags = mmu_entry_flags(*entry, MMU_SWAP_KEPT_BITS);
+    if (mmu_entry_cow(*entry))
+        flags |= MMU_BIT_WRITE;
+
+    entry->data = ((intptr_t) slot << 10) | flags | MMU_BIT_SWAPPED;
+    return frame;
+}
+
+// mmu_entry_swap_in(struct mmu_entry*, void*, int) -> size_t
+// Turns a swap entry back into a leaf mapping the given physical frame with its kept permissions and the given accessed and dirty bits. Returns the slot it held. The caller flushes the TLB.
+size_t mmu_entry_swap_in(struct mmu_entry *entry, void *physical, int bits) {
+    size_t slot = mmu_entry_swap_slot(*entry);
+    int flags = mmu_entry_flags(*entry, MMU_SWAP_KEPT_BITS)
+        | (bits & (MMU_BIT_ACCESSED | MMU_BIT_DIRTY)) | MMU_BIT_VALID;
+
+    // Written in one store, since the hardware may walk the table as soon as the entry is valid
+    entry->data = (((intptr_t) physical & ~0xfff) >> 2) | flags;
+    return slot;
+}
+
+// mmu_flush_elsewhere(struct mmu_root*) -> void
+// Flushes an address space that isn't running anywhere from the TLB of this hart, and makes any other hart flush it before running it again.
+void mmu_flush_elsewhere(struct mmu_root *root) {
+    mmu_flush_asid(*root);
+
+    // A root from an older generation gets a new ASID when it's next set, and no hart has entries cached under a new ASID
+    root->generation = 0;
+}
+
+// init_ad_updates() -> bool
+// Asks the SBI to have the hardware of the current hart set accessed and dirty bits. Returns false if they are set by handle_page_fault instead.
+bool init_ad_updates() {
+    return sbi_fwft_set(SBI_FWFT_PTE_AD_HW_UPDATING, 1, 0).error == SBIRET_ERROR_CODE_SUCCESS;
+}
+
 // mmu_map_range_identity(mmu_level_1_t*, void*, void*, int) -> void
 // Maps the given range to itself in the given mmu table.
 void mmu_map_range_identity(
@@ -267,9 +1166,10 @@ void mmu_map_range_identity(
     void *end,
     int flags
 ) {
-    for (void* p = start; p < end; p += PAGE_SIZE) {
-        mmu_map(root, p, p, flags);
-    }
+    start = (void *) ((intptr_t) start & ~(PAGE_SIZE - 1));
+    end = (void *) (((intptr_t) end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    if (mmu_map_range(root, start, start, (end - start) / PAGE_SIZE, flags))
+        console_printf("[mmu_map_range_identity] unable to map %p-%p\n", start, end);
 }
 
 // identity_map_kernel(fdt_t*, void*, void*) -> void
@@ -282,8 +1182,6 @@ void identity_map_kernel(struct mmu_root root) {
     extern int sdata_end;
     extern int stack_start;
     extern int stack_top;
-    extern int pages_bottom;
-    extern page_t* heap_bottom;
 
     // Map kernel
     mmu_map_range_identity(root, &text_start, &data_start,
@@ -296,13 +1194,19 @@ void identity_map_kernel(struct mmu_root root) {
         MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_GLOBAL);
     mmu_map_range_identity(root, &stack_start, &stack_top,
         MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_GLOBAL);
-    mmu_map_range_identity(root, &pages_bottom, heap_bottom,
-        MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_GLOBAL);
+
+    // Map page allocator metadata
+    void* meta_start;
+    void* meta_end;
+    for (size_t i = 0; get_page_metadata(i, &meta_start, &meta_end); i++) {
+        mmu_map_range_identity(root, meta_start, meta_end,
+            MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_GLOBAL);
+    }
 }
 
-// create_mmu_table() -> mmu_level_1_t*
-// Creates an empty mmu table.
-struct mmu_root create_mmu_table() {
+// init_kernel_template() -> void
+// Builds the kernel half of the page tables that every address space shares.
+static void init_kernel_template() {
     intptr_t* top = phys2safe(alloc_pages(1));
 
     for (size_t i = MMU_TOP_HALF; i < MMU_ENTRY_COUNT; i++) {
@@ -314,14 +1218,217 @@ struct mmu_root create_mmu_table() {
         top[i] = page;
     }
 
-    struct mmu_root root = MMU_WRAP(root, (intptr_t) safe2phys(top));
-    identity_map_kernel(root);
-    return root;
+    kernel_template = MMU_WRAP(root, (intptr_t) safe2phys(top));
+    identity_map_kernel(kernel_template);
+
+    size_t count = 0;
+    for (size_t i = 0; i < MMU_ENTRY_COUNT; i++) {
+        if (top[i] & MMU_BIT_VALID) {
+            shared_slots[i / 64] |= (uint64_t) 1 << (i % 64);
+            count++;
+        }
+    }
+
+    console_printf("[init_kernel_template] sharing 0x%lx root entries with every address space\n", count);
+    register_shrinker(shrink_table_cache);
+}
+
+// mmu_user_extent(const void*, size_t) -> size_t
+// Returns how many of the n bytes from start belong to the user part of every address space, stopping at MMU_USER_TOP or the first root slot shared with the kernel template, like the identity mapped kernel.
+size_t mmu_user_extent(const void *start, size_t n) {
+    uintptr_t p = (uintptr_t) start;
+    uintptr_t top = (uintptr_t) MMU_USER_TOP;
+    if (!mmu_root_valid(kernel_template) || p >= top)
+        return 0;
+    if (n > top - p)
+        n = top - p;
+
+    uintptr_t end = p + n;
+    for (uintptr_t slot = p / MMU_GIGAPAGE_SIZE; slot * MMU_GIGAPAGE_SIZE < end; slot++) {
+        if (mmu_slot_shared(slot))
+            return slot * MMU_GIGAPAGE_SIZE > p ? slot * MMU_GIGAPAGE_SIZE - p : 0;
+    }
+    return n;
+}
+
+// mmu_user_range(const void*, size_t) -> bool
+// Returns true if the whole range belongs to the user part of every address space, so only the task's own mappings can back it.
+bool mmu_user_range(const void *start, size_t n) {
+    if (n == 0)
+        return mmu_user_extent(start, 1) == 1;
+    return mmu_user_extent(start, n) == n;
+}
+
+// create_mmu_table() -> mmu_level_1_t*
+// Creates an empty mmu table.
+struct mmu_root create_mmu_table() {
+    if (!mmu_root_valid(kernel_template))
+        init_kernel_template();
+
+    void* page = mmu_alloc_table();
+    if (!page)
+        return EMPTY_MMU(root);
+
+    intptr_t* top = phys2safe(page);
+    intptr_t* template = phys2safe((void*) kernel_template.data);
+    for (size_t i = 0; i < MMU_ENTRY_COUNT; i++) {
+        if (mmu_slot_shared(i))
+            top[i] = template[i];
+    }
+
+    return MMU_WRAP(root, (intptr_t) page);
+}
+
+// set_kernel_mmu() -> void
+// Switches the current hart to the kernel half alone, for harts that aren't running a task.
+void set_kernel_mmu() {
+    if (!mmu_root_valid(kernel_template))
+        init_kernel_template();
+    set_mmu(&kernel_template);
+}
+
+// Dead address spaces are torn down a bounded amount at a time. Each queued
+// table remembers the root entry and middle entry it got to, and every call
+// to reap_mmu_tables frees at most the given number of leaf tables (and the
+// frames they map) before putting the table back on the queue. Only the user
+// half is touched: shared kernel root entries are skipped.
+struct mmu_teardown {
+    struct mmu_teardown *next;
+    struct mmu_root root;
+    size_t slot;
+    size_t middle;
+};
+
+static struct mmu_teardown *teardown_queue = NULL;
+DEFINE_SPINLOCK(mutating_teardown_queue);
+
+// mmu_release_leaf_table(struct mmu_entry*) -> void
+// Releases every frame and swap slot held by a leaf table and clears its entries.
+static void mmu_release_leaf_table(struct mmu_entry *table) {
+    // Runs of physically consecutive frames are released with one call
+    void *run = NULL;
+    size_t run_length = 0;
+    for (size_t i = 0; i < MMU_ENTRY_COUNT; i++) {
+        if (mmu_entry_swapped(table[i])) {
+            swap_slot_free(mmu_entry_swap_slot(table[i]));
+            table[i].data = 0;
+            continue;
+        }
+        if (!mmu_entry_valid(table[i]))
+            continue;
+
+        void *physical = mmu_entry_phys(table[i]);
+        table[i].data = 0;
+        if (run_length != 0 && physical == run + run_length * PAGE_SIZE) {
+            run_length++;
+            continue;
+        }
+        if (run_length != 0)
+            dealloc_pages(run, run_length);
+        run = physical;
+        run_length = 1;
+    }
+
+    if (run_length != 0)
+        dealloc_pages(run, run_length);
+}
+
+// mmu_teardown(struct mmu_teardown*, size_t*) -> bool
+// Tears down part of a dead address space, spending the budget one leaf table at a time. Returns true once the whole table, root included, is freed.
+static bool mmu_teardown(struct mmu_teardown *job, size_t *budget) {
+    struct mmu_entry *top = phys2safe((void *) job->root.data);
+    for (; job->slot < MMU_ENTRY_COUNT; job->slot++, job->middle = 0) {
+        struct mmu_entry *entry = &top[job->slot];
+        if (mmu_slot_shared(job->slot) || !mmu_entry_valid(*entry))
+            continue;
+
+        if (mmu_entry_frame(*entry)) {
+            dealloc_pages(mmu_entry_phys(*entry), MMU_GIGAPAGE_SIZE / PAGE_SIZE);
+            entry->data = 0;
+            continue;
+        }
+
+        struct mmu_entry *middle = mmu_entry_phys(*entry);
+        for (; job->middle < MMU_ENTRY_COUNT; job->middle++) {
+            struct mmu_entry *leaf = &middle[job->middle];
+            if (!mmu_entry_valid(*leaf))
+                continue;
+            if (*budget == 0)
+                return false;
+            (*budget)--;
+
+            if (mmu_entry_frame(*leaf)) {
+                dealloc_pages(mmu_entry_phys(*leaf), MMU_MEGAPAGE_SIZE / PAGE_SIZE);
+            } else {
+                struct mmu_entry *table = mmu_entry_phys(*leaf);
+                mmu_release_leaf_table(table);
+                mmu_free_table(table);
+            }
+            leaf->data = 0;
+        }
+
+        mmu_free_table(middle);
+        entry->data = 0;
+    }
+
+    // The shared entries are only references to the kernel template's tables
+    for (size_t i = 0; i < MMU_ENTRY_COUNT; i++) {
+        top[i].data = 0;
+    }
+    mmu_free_table(top);
+    return true;
+}
+
+// reap_mmu_tables(size_t) -> bool
+// Continues tearing down dead address spaces, freeing at most the given number of leaf tables. Returns true if there is more work queued.
+bool reap_mmu_tables(size_t budget) {
+    while (budget > 0) {
+        spin_lock(&mutating_teardown_queue);
+        struct mmu_teardown *job = teardown_queue;
+        if (job != NULL)
+            teardown_queue = job->next;
+        spin_unlock(&mutating_teardown_queue);
+
+        if (job == NULL)
+            return false;
+
+        if (mmu_teardown(job, &budget)) {
+            free(job);
+            continue;
+        }
+
+        spin_lock(&mutating_teardown_queue);
+        job->next = teardown_queue;
+        teardown_queue = job;
+        spin_unlock(&mutating_teardown_queue);
+    }
+
+    return teardown_queue != NULL;
 }
 
 // clean_mmu_table(mmu_level_1_t*) -> void
-// Cleans up an mmu table.
+// Frees the user half of an mmu table, the frames mapped in it and the table itself. Large tables are finished off by later calls to reap_mmu_tables. No hart other than the current one may be using the table.
 void clean_mmu_table(struct mmu_root root) {
-    // TODO
-    (void) root;
+    if (!mmu_root_valid(root) || mmu_root_equal(root, kernel_template))
+        return;
+
+    // The root page is about to be reused, so satp can't keep pointing at it
+    if (mmu_root_equal(root, get_mmu()))
+        set_kernel_mmu();
+
+    struct mmu_teardown *job = malloc(sizeof(struct mmu_teardown));
+    if (job == NULL) {
+        struct mmu_teardown stack_job = { .root = root };
+        size_t budget = SIZE_MAX;
+        mmu_teardown(&stack_job, &budget);
+        return;
+    }
+
+    *job = (struct mmu_teardown) { .root = root };
+    spin_lock(&mutating_teardown_queue);
+    job->next = teardown_queue;
+    teardown_queue = job;
+    spin_unlock(&mutating_teardown_queue);
+
+    reap_mmu_tables(MMU_TEARDOWN_BUDGET);
 }
@@ -1,6 +1,7 @@
 #ifndef MMU_H
 #define MMU_H
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define MMU_BIT_VALID    0x01
@@ -15,9 +16,41 @@
 #define MMU_BIT_RSV1     0x200
 #define MMU_ALL_BITS     0x3ff
 
-struct mmu_root      { intptr_t data; };
+// Marks a user leaf whose frame is shared copy on write: the leaf is read only, but writes are allowed and copy the frame first
+#define MMU_BIT_COW      MMU_BIT_RSV0
+
+// Marks a user leaf the last working set scan found unaccessed, so the next scan can tell it has been idle for a whole interval
+#define MMU_BIT_IDLE     MMU_BIT_RSV1
+
+// Marks an entry that isn't valid as belonging to a page in swap. The frame number holds the swap slot and the other flags are kept for when the page is read back
+#define MMU_BIT_SWAPPED  MMU_BIT_RSV1
+
+#define MMU_MEGAPAGE_SIZE 0x200000
+#define MMU_GIGAPAGE_SIZE 0x40000000
+
+// Addresses below this are in the lower half of an Sv39 address space, where user mappings live
+#define MMU_USER_TOP ((void *) 0x4000000000)
+
+struct mmu_root {
+    intptr_t data;
+
+    // Filled in by set_mmu: the ASID, the ASID generation it belongs to, and the hart it last ran on
+    uint16_t asid;
+    uint16_t hart;
+    uint32_t generation;
+};
 struct __attribute__((packed)) mmu_entry { intptr_t data; };
 
+// User pages of an address space counted by mmu_scan_user, by how recently they were accessed
+struct mmu_scan_counts {
+    size_t resident;
+    size_t accessed;
+    size_t idle;
+    size_t cold;
+    size_t dirty;
+    size_t swapped;
+};
+
 static inline bool mmu_enabled() {
     intptr_t mmu;
     asm volatile("csrr %0, satp" : "=r" (mmu));
@@ -77,6 +110,24 @@ static inline bool mmu_entry_dirty(struct mmu_entry entry) {
     return (entry.data & MMU_BIT_DIRTY) != 0;
 }
 
+static inline bool mmu_entry_cow(struct mmu_entry entry) {
+    return (entry.data & MMU_BIT_COW) != 0;
+}
+
+static inline bool mmu_entry_swapped(struct mmu_entry entry) {
+    return (entry.data & (MMU_BIT_VALID | MMU_BIT_SWAPPED)) == MMU_BIT_SWAPPED;
+}
+
+// mmu_entry_used(struct mmu_entry) -> bool
+// Returns true if the entry is valid or holds a page in swap, which both keep the address from being mapped again.
+static inline bool mmu_entry_used(struct mmu_entry entry) {
+    return mmu_entry_valid(entry) || mmu_entry_swapped(entry);
+}
+
+static inline size_t mmu_entry_swap_slot(struct mmu_entry entry) {
+    return (uint64_t) entry.data >> 10;
+}
+
 static inline int mmu_entry_flags(struct mmu_entry entry, int flags) {
     return entry.data & MMU_ALL_BITS & flags;
 }
@@ -89,13 +140,39 @@ static inline void *mmu_entry_phys(struct mmu_entry entry) {
 // Gets the current value of satp and converts it into a pointer to the mmu table.
 struct mmu_root get_mmu();
 
+// init_asids() -> void
+// Finds out how many ASID bits satp has. Must be called with paging enabled.
+void init_asids();
+
 // set_mmu(mmu_level_1_t*) -> void
-// Sets the satp csr to the provided mmu table pointer.
-void set_mmu(struct mmu_root root);
+// Sets the satp csr to the provided mmu table pointer, giving the table an ASID if it needs a new one.
+void set_mmu(struct mmu_root *root);
 
 // flush_mmu() -> void
-// Flushes the table buffer or whatever its called.
-inline void flush_mmu();
+// Flushes the whole TLB of the current hart, global kernel entries included.
+static inline void flush_mmu() {
+    asm volatile("sfence.vma" : : : "memory");
+}
+
+// mmu_flush_asid(struct mmu_root) -> void
+// Flushes the non-global TLB entries of an address space on the current hart.
+static inline void mmu_flush_asid(struct mmu_root root) {
+    asm volatile("sfence.vma zero, %0" : : "r" ((uint64_t) root.asid) : "memory");
+}
+
+// mmu_flush_page(struct mmu_root, void*) -> void
+// Flushes the TLB entries of a single page of an address space on the current hart.
+static inline void mmu_flush_page(struct mmu_root root, void *virt_addr) {
+    asm volatile("sfence.vma %0, %1" : : "r" (virt_addr), "r" ((uint64_t) root.asid) : "memory");
+}
+
+// mmu_user_extent(const void*, size_t) -> size_t
+// Returns how many of the n bytes from start belong to the user part of every address space, stopping at MMU_USER_TOP or the first root slot shared with the kernel template, like the identity mapped kernel.
+size_t mmu_user_extent(const void *start, size_t n);
+
+// mmu_user_range(const void*, size_t) -> bool
+// Returns true if the whole range belongs to the user part of every address space, so only the task's own mappings can back it.
+bool mmu_user_range(const void *start, size_t n);
 
 // create_mmu_table() -> mmu_level_1_t*
 // Creates an empty mmu table.
@@ -103,16 +180,28 @@ struct mmu_root create_mmu_table();
 
 struct mmu_entry *mmu_walk_to_entry(struct mmu_root root, void *virt_addr);
 
+// mmu_walk_to_leaf(struct mmu_root, void*, size_t*) -> struct mmu_entry*
+// Walks to the entry mapping the given virtual address, which may be a megapage or gigapage leaf. Stores the size the entry maps in size if it isn't null.
+struct mmu_entry *mmu_walk_to_leaf(struct mmu_root root, void *virt_addr, size_t *size);
+
 bool mmu_translate(struct mmu_root root, void *virt_addr, void **phys_addr);
 
 // mmu_map(mmu_level_1_t*, void*, void*, int) -> void
 // Maps the given virtual address to the given physical address.
 int mmu_map(struct mmu_root root, void *virt_addr, void *physical, int flags);
 
+// mmu_map_huge(struct mmu_root, void*, void*, size_t, int) -> int
+// Maps a single leaf of the given size (a page, megapage or gigapage). Both addresses must be aligned to the size.
+int mmu_map_huge(struct mmu_root root, void *virt_addr, void *physical, size_t size, int flags);
+
 // mmu_alloc(mmu_level_1_t*, void*, int) -> void*
 // Allocates a new page and inserts it into the mmu table, returning the physical address.
 void *mmu_alloc(struct mmu_root root, void *virt_addr, int flags);
 
+// mmu_alloc_huge(struct mmu_root, void*, size_t, int) -> void*
+// Allocates a zeroed megapage or gigapage and maps it as a single leaf, returning the physical address.
+void *mmu_alloc_huge(struct mmu_root root, void *virt_addr, size_t size, int flags);
+
 // mmu_change_flags(mmu_level_1_t*, void*, int) -> void
 // Changes the mmu page flags on the entry if the entry exists.
 void mmu_change_flags(struct mmu_root root, void *virt_addr, int flags);
@@ -121,6 +210,78 @@ void mmu_change_flags(struct mmu_root root, void *virt_addr, int flags);
 // Removes an entry from the mmu table.
 void *mmu_remove(struct mmu_root root, void *virt_addr);
 
+// mmu_remove_huge(struct mmu_root, void*, size_t) -> void*
+// Removes a whole megapage or gigapage leaf from the mmu table. Returns null if the address isn't mapped by a leaf of that size.
+void *mmu_remove_huge(struct mmu_root root, void *virt_addr, size_t size);
+
+// mmu_map_range(struct mmu_root, void*, void*, size_t, int) -> int
+// Maps page_count pages starting at the given virtual address to consecutive physical memory, using megapage and gigapage leaves wherever both addresses are aligned for them. Fails without mapping anything if part of the range is mapped already.
+int mmu_map_range(struct mmu_root root, void *virt_addr, void *physical, size_t page_count, int flags);
+
+// mmu_alloc_range(struct mmu_root, void*, size_t, int) -> int
+// Allocates zeroed pages for page_count pages starting at the given virtual address and maps them. Fails without mapping anything if part of the range is mapped already or memory runs out.
+int mmu_alloc_range(struct mmu_root root, void *virt_addr, size_t page_count, int flags);
+
+// mmu_alloc_range_nozero(struct mmu_root, void*, size_t, int) -> int
+// Same as mmu_alloc_range, but doesn't clear the pages. Only for callers that overwrite the whole range.
+int mmu_alloc_range_nozero(struct mmu_root root, void *virt_addr, size_t page_count, int flags);
+
+// mmu_range_mapped(struct mmu_root, void*, size_t, int) -> bool
+// Returns true if every page in the range is mapped by a leaf with all of the given flags set. Pages in swap count as mapped with the flags their swap entry keeps.
+bool mmu_range_mapped(struct mmu_root root, void *virt_addr, size_t page_count, int flags);
+
+// mmu_change_flags_range(struct mmu_root, void*, size_t, int) -> void
+// Changes the flags of every mapped page in the range. Megapage and gigapage leaves the range only partly covers are split first.
+void mmu_change_flags_range(struct mmu_root root, void *virt_addr, size_t page_count, int flags);
+
+// mmu_remove_range(struct mmu_root, void*, size_t, bool) -> void
+// Removes every mapping in the range, releasing the frames with dealloc_pages if dealloc is set. Pages in swap always give up their slots. Megapage and gigapage leaves the range only partly covers are split first.
+void mmu_remove_range(struct mmu_root root, void *virt_addr, size_t page_count, bool dealloc);
+
+// mmu_clone_user(struct mmu_root, struct mmu_root) -> int
+// Copies the user half of src into the new table dest, sharing every frame with it. Writable frames from the page allocator become copy on write in both tables. On failure dest holds part of the copy and has to be cleaned. src must not be in use on another hart.
+int mmu_clone_user(struct mmu_root dest, struct mmu_root src);
+
+// mmu_resolve_cow(struct mmu_root, void*) -> bool
+// Makes the copy on write page at the given address writable, copying its frame first unless this address space is its only owner. Returns false if the page isn't copy on write or memory runs out.
+bool mmu_resolve_cow(struct mmu_root root, void *virt_addr);
+
+// mmu_share_writable(struct mmu_root, void*, size_t) -> void
+// Makes the copy on write pages in the range writable again without copying them, for frames that are meant to stay shared between address spaces.
+void mmu_share_writable(struct mmu_root root, void *virt_addr, size_t page_count);
+
+// mmu_mark_accessed(struct mmu_root, void*, bool) -> bool
+// Sets the accessed bit of the user leaf mapping the given address, and its dirty bit for writes, like hardware that updates them would. Returns false if there is no such leaf or it was already marked.
+bool mmu_mark_accessed(struct mmu_root root, void *virt_addr, bool write);
+
+// mmu_scan_user(struct mmu_root, struct mmu_scan_counts*) -> void
+// Counts the user pages of an address space by how recently they were accessed, then clears their accessed bits to start the next interval. The address space must not be in use on another hart.
+void mmu_scan_user(struct mmu_root root, struct mmu_scan_counts *counts);
+
+// mmu_walk_to_swapped(struct mmu_root, void*) -> struct mmu_entry*
+// Returns the swap entry for the page at the given address, or null if the page isn't in swap.
+struct mmu_entry *mmu_walk_to_swapped(struct mmu_root root, void *virt_addr);
+
+// mmu_reclaim_scan(struct mmu_root, void**, struct mmu_entry**, size_t) -> size_t
+// Runs the reclaim clock over the user pages of an address space from the address in cursor. Pages accessed since the last pass lose their accessed bit and are passed over; the first run of at most max neighbouring pages that weren't is returned through run, and cursor is left after it. Only 4 KiB leaves whose frames this address space owns alone are considered. Returns the number of pages in the run, or 0 with cursor reset once the end of the address space is reached. The caller flushes the TLB.
+size_t mmu_reclaim_scan(struct mmu_root root, void **cursor, struct mmu_entry **run, size_t max);
+
+// mmu_entry_swap_out(struct mmu_entry*, size_t) -> void*
+// Turns a 4 KiB user leaf into a swap entry for the given slot, keeping its permissions. Copy on write leaves are kept writable, since the page comes back private. Returns the frame the leaf mapped. The caller flushes the TLB.
+void *mmu_entry_swap_out(struct mmu_entry *entry, size_t slot);
+
+// mmu_entry_swap_in(struct mmu_entry*, void*, int) -> size_t
+// Turns a swap entry back into a leaf mapping the given physical frame with its kept permissions and the given accessed and dirty bits. Returns the slot it held. The caller flushes the TLB.
+size_t mmu_entry_swap_in(struct mmu_entry *entry, void *physical, int bits);
+
+// mmu_flush_elsewhere(struct mmu_root*) -> void
+// Flushes an address space that isn't running anywhere from the TLB of this hart, and makes any other hart flush it before running it again.
+void mmu_flush_elsewhere(struct mmu_root *root);
+
+// init_ad_updates() -> bool
+// Asks the SBI to have the hardware of the current hart set accessed and dirty bits. Returns false if they are set by handle_page_fault instead.
+bool init_ad_updates();
+
 // mmu_map_range_identity(mmu_level_1_t*, void*, void*, int) -> void
 // Maps the given range to itself in the given mmu table.
 void mmu_map_range_identity(
@@ -130,8 +291,16 @@ void mmu_map_range_identity(
     int flags
 );
 
+// set_kernel_mmu() -> void
+// Switches the current hart to the kernel half alone, for harts that aren't running a task.
+void set_kernel_mmu();
+
 // clean_mmu_table(mmu_level_1_t*) -> void
-// Cleans up an mmu table.
+// Frees the user half of an mmu table, the frames mapped in it and the table itself. Large tables are finished off by later calls to reap_mmu_tables. No hart other than the current one may be using the table.
 void clean_mmu_table(struct mmu_root root);
 
+// reap_mmu_tables(size_t) -> bool
+// Continues tearing down dead address spaces, freeing at most the given number of leaf tables. Returns true if there is more work queued.
+bool reap_mmu_tables(size_t budget);
+
 #endif /* MMU_H */
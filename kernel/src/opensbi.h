@@ -49,5 +49,11 @@ struct sbiret sbi_hart_suspend(uint32_t suspend_type, unsigned long resume_addr,
 // Sends an inter process interrupt.
 struct sbiret sbi_send_ipi(unsigned long hart_mask, unsigned long hart_mask_base);
 
+#define SBI_FWFT_PTE_AD_HW_UPDATING 4
+
+// sbi_fwft_set(uint32_t, unsigned long, unsigned long) -> struct sbiret
+// Sets a firmware feature of the current hart.
+struct sbiret sbi_fwft_set(uint32_t feature, unsigned long value, unsigned long flags);
+
 #endif /* OPENSBI_H */
 
@@ -12,6 +12,8 @@
 
 .global sbi_send_ipi
 
+.global sbi_fwft_set
+
 # EIDs are stored in a7
 # FIDs are stored in a6
 
@@ -79,3 +81,11 @@ sbi_send_ipi:
     ecall
     ret
 
+
+# sbi_fwft_set(uint32_t, unsigned long, unsigned long) -> struct sbiret
+# Sets a firmware feature of the current hart.
+sbi_fwft_set:
+    li a6, 0
+    li a7, 0x46574654
+    ecall
+    ret
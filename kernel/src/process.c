@@ -1,19 +1,29 @@
 #include <stdbool.h>
 
 #include "console.h"
+#include "file_map.h"
 #include "interrupt.h"
 #include "memory.h"
 #include "mmu.h"
 #include "process.h"
 #include "schedulers/scheduler.h"
+#include "shared_memory.h"
 #include "string.h"
+#include "swap.h"
+#include "sync.h"
 
 static struct s_task *tasks = NULL;
 static pid_t max_pid = 0;
+DEFINE_SPINLOCK(claiming_tasks);
+
+// Page faults in reserved regions populate the naturally aligned window of this many pages around the faulting page
+#define FAULT_AROUND_PAGES 16
 
 void init_processes(pid_t max) {
     tasks = malloc(max * sizeof(struct s_task));
+    memset(tasks, 0, max * sizeof(struct s_task));
     max_pid = max;
+    init_scheduler(max, NULL);
 }
 
 struct s_task *get_task(pid_t pid) {
@@ -22,6 +32,50 @@ struct s_task *get_task(pid_t pid) {
     return &tasks[pid];
 }
 
+// claim_task_slot() -> pid_t
+// Takes a dead slot for a new task, which is left creating with its memory lock held so nothing else touches it until it's ready. Returns -1 if every slot is taken.
+static pid_t claim_task_slot() {
+    spin_lock(&claiming_tasks);
+    pid_t pid;
+    for (pid = 0; pid < max_pid && tasks[pid].state != TASK_STATE_DEAD; pid++);
+    if (pid == max_pid) {
+        spin_unlock(&claiming_tasks);
+        return -1;
+    }
+
+    tasks[pid].memory_lock = true;
+    tasks[pid].state = TASK_STATE_CREATING;
+    spin_unlock(&claiming_tasks);
+    return pid;
+}
+
+// release_task_slot(struct s_task*, task_state_t) -> void
+// Hands a claimed slot over in the given state, ready for a built task or dead for a failed one.
+static void release_task_slot(struct s_task* task, task_state_t state) {
+    spin_unlock(&task->memory_lock);
+    __atomic_store_n(&task->state, state, __ATOMIC_RELEASE);
+}
+
+// copy_to_task(struct mmu_root, void*, void*, size_t) -> void
+// Copies data into memory already mapped for the user in the given table, one leaf at a time. Frames the task doesn't own alone are left alone.
+static void copy_to_task(struct mmu_root top, void* virt_addr, void* source, size_t remaining) {
+    while (remaining > 0) {
+        size_t leaf_size;
+        struct mmu_entry* entry = mmu_walk_to_leaf(top, virt_addr, &leaf_size);
+        size_t leaf_offset = (intptr_t) virt_addr & (leaf_size - 1);
+        size_t size = leaf_size - leaf_offset;
+        if (size > remaining)
+            size = remaining;
+
+        if (entry && mmu_entry_valid(*entry) && mmu_entry_user(*entry) && get_page_ref_count(mmu_entry_phys(*entry)) == 1)
+            memcpy(mmu_entry_phys(*entry) + leaf_offset, source, size);
+
+        source += size;
+        virt_addr += size;
+        remaining -= size;
+    }
+}
+
 // spawn_process_from_elf(char*, size_t, elf_t*, size_t, size_t, char**) -> process_t*
 // Spawns a process using the given elf file. Returns NULL on failure.
 struct s_task *spawn_task_from_elf(char* name, size_t name_size, elf_t* elf, size_t stack_size, size_t argc, char** args) {
@@ -30,11 +84,19 @@ struct s_task *spawn_task_from_elf(char* name, size_t name_size, elf_t* elf, siz
         return NULL;
     }
 
-    pid_t pid;
-    for (pid = 0; pid < max_pid && tasks[pid].state != TASK_STATE_DEAD; pid++);
-    if (pid == max_pid)
+    pid_t pid = claim_task_slot();
+    if (pid < 0)
         return NULL;
 
+    struct s_task *task = &tasks[pid];
+    task->lazy_region_count = 0;
+    task->working_set = (struct working_set_stats) { .last_scan = get_time() };
+    memset(task->capabilities, 0, sizeof(task->capabilities));
+    task->shared_memory_revoked = false;
+    task->scheduling = (struct task_scheduler_stats) { 0 };
+    task->scheduling_since = get_time();
+    task->priority = 0;
+
     struct mmu_root top;
     if (pid == 0) {
         top = get_mmu();
@@ -59,51 +121,111 @@ struct s_task *spawn_task_from_elf(char* name, size_t name_size, elf_t* elf, siz
             flags |= MMU_BIT_READ;
 
         size_t offset = program_header->virtual_addr % PAGE_SIZE;
+        void* segment = (void*) program_header->virtual_addr - offset;
         uint64_t page_count = (program_header->memory_size + offset + PAGE_SIZE - 1) / PAGE_SIZE;
-        for (uint64_t i = 0; i < page_count; i++) {
-            void* virt_addr = (void*) program_header->virtual_addr + i * PAGE_SIZE;
-            void* page = mmu_alloc(top, virt_addr - offset, flags | MMU_BIT_USER);
-            if (!page) {
-                struct mmu_entry *entry = mmu_walk_to_entry(top, virt_addr);
-                if (!entry
-                    || !mmu_entry_valid(*entry)
-                    || !mmu_entry_frame(*entry)
-                    || !mmu_entry_user(*entry))
-                    continue;
-                page = mmu_entry_phys(*entry);
+        uint64_t file_end = program_header->file_size + offset;
+
+        // Segments can share their first or last page with another segment, in which case the page mapped by the earlier one is reused
+        uint64_t first_page = 0;
+        uint64_t last_page = page_count;
+        if (page_count > 0 && mmu_range_mapped(top, segment, 1, 0))
+            first_page = 1;
+        if (last_page > first_page && mmu_range_mapped(top, segment + (last_page - 1) * PAGE_SIZE, 1, 0))
+            last_page--;
+
+        // Segments the image cache has loaded are mapped from its pages, which every instance shares
+        void* frames = elf->segment_frames ? elf->segment_frames[i] : NULL;
+        if (frames != NULL) {
+            if (mmu_map_range(top, segment + first_page * PAGE_SIZE, frames + first_page * PAGE_SIZE, last_page - first_page, flags | MMU_BIT_USER)) {
+                console_puts("[spawn_task_from_elf] unable to map segment\n");
+                goto fail;
             }
+            incr_page_ref_count(frames + first_page * PAGE_SIZE, last_page - first_page);
+
+            if (segment + page_count * PAGE_SIZE > max_page)
+                max_page = segment + page_count * PAGE_SIZE;
+
+            // Pages mapped by an earlier segment still need this segment's data
+            void* source = (void*) elf->header + program_header->offset;
+            void* virt_addr = (void*) program_header->virtual_addr;
+            void* file_end_addr = virt_addr + program_header->file_size;
+            void* mapped_start = segment + first_page * PAGE_SIZE;
+            void* mapped_end = segment + last_page * PAGE_SIZE;
+            if (virt_addr < mapped_start)
+                copy_to_task(top, virt_addr, source, (file_end_addr < mapped_start ? file_end_addr : mapped_start) - virt_addr);
+            if (file_end_addr > mapped_end && mapped_end >= virt_addr)
+                copy_to_task(top, mapped_end, source + (mapped_end - virt_addr), file_end_addr - mapped_end);
+            continue;
+        }
 
-            page = phys2safe(page);
-
-            if (virt_addr > max_page)
-                max_page = virt_addr;
-
-            size_t size;
-            if (program_header->file_size != 0) {
-                if (program_header->file_size + offset < i * PAGE_SIZE) {
-                    if ((i - 1) * PAGE_SIZE < program_header->file_size + offset)
-                        size = program_header->file_size - (i - 1) * PAGE_SIZE;
-                    else size = 0;
-                } else size = PAGE_SIZE;
-                void* source = (void*) elf->header + program_header->offset + i * PAGE_SIZE;
-                if (i == 0) {
-                    page += offset;
-                    if (size > 0)
-                        size -= offset;
-                } else source -= offset;
-                memcpy(page, source, size);
+        // Pages entirely covered by file data are overwritten below, so they don't need zeroing
+        uint64_t whole_start = offset == 0 ? 0 : 1;
+        uint64_t whole_end = file_end / PAGE_SIZE;
+        if (whole_start < first_page)
+            whole_start = first_page;
+        if (whole_start > last_page)
+            whole_start = last_page;
+        if (whole_end > last_page)
+            whole_end = last_page;
+        if (whole_end < whole_start)
+            whole_end = whole_start;
+
+        flags |= MMU_BIT_USER;
+
+        // Pages past the file data are only zero, so they are reserved and populated when first touched
+        uint64_t lazy_start = (file_end + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (lazy_start < first_page)
+            lazy_start = first_page;
+        if (lazy_start < last_page) {
+            if (!reserve_lazy_range(task, segment + lazy_start * PAGE_SIZE, last_page - lazy_start, flags)) {
+                console_puts("[spawn_task_from_elf] unable to reserve segment\n");
+                goto fail;
             }
+            last_page = lazy_start;
         }
-    }
 
-    max_page = (void*) (((intptr_t) max_page + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE);
+        // Whole pages of a file that stays in memory are mapped straight from it, copy on write if the segment is writable
+        void* source = (void*) elf->header + program_header->offset;
+        bool direct = elf->mappable
+            && whole_end > whole_start
+            && ((intptr_t) source & (PAGE_SIZE - 1)) == offset
+            && program_header->offset + program_header->file_size <= elf->size;
+        int direct_flags = flags & MMU_BIT_WRITE ? (flags & ~MMU_BIT_WRITE) | MMU_BIT_COW : flags;
+
+        if (mmu_alloc_range(top, segment + first_page * PAGE_SIZE, whole_start - first_page, flags)
+            || (direct
+                ? mmu_map_range(top, segment + whole_start * PAGE_SIZE, safe2phys(source - offset + whole_start * PAGE_SIZE), whole_end - whole_start, direct_flags)
+                : mmu_alloc_range_nozero(top, segment + whole_start * PAGE_SIZE, whole_end - whole_start, flags))
+            || mmu_alloc_range(top, segment + whole_end * PAGE_SIZE, last_page - whole_end, flags)) {
+            console_puts("[spawn_task_from_elf] unable to map segment\n");
+            goto fail;
+        }
 
-    for (size_t i = 0; i < stack_size; i++, max_page += PAGE_SIZE) {
-        mmu_alloc(top, max_page, MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_USER);
+        if (segment + page_count * PAGE_SIZE > max_page)
+            max_page = segment + page_count * PAGE_SIZE;
+
+        void* virt_addr = (void*) program_header->virtual_addr;
+        if (direct) {
+            void* direct_start = segment + whole_start * PAGE_SIZE;
+            void* direct_end = segment + whole_end * PAGE_SIZE;
+            void* file_end_addr = virt_addr + program_header->file_size;
+            copy_to_task(top, virt_addr, source, direct_start - virt_addr);
+            copy_to_task(top, direct_end, source + (direct_end - virt_addr), file_end_addr - direct_end);
+        } else {
+            copy_to_task(top, virt_addr, source, program_header->file_size);
+        }
+    }
+
+    // The stack sits above an unreserved guard page, with only its initial pages mapped and room reserved below them to grow into
+    void* stack_bottom = max_page + PAGE_SIZE;
+    max_page = stack_bottom + (TASK_STACK_MAX_PAGES + stack_size) * PAGE_SIZE;
+    if (!reserve_lazy_range(task, stack_bottom, TASK_STACK_MAX_PAGES + stack_size, MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_USER)
+        || mmu_alloc_range(top, max_page - stack_size * PAGE_SIZE, stack_size, MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_USER)) {
+        console_puts("[spawn_task_from_elf] unable to map stack\n");
+        goto fail;
     }
     void *last_virtual_page = max_page - PAGE_SIZE;
 
-    struct s_task *task = &tasks[pid];
     task->pid = pid;
     task->ppid = 0;
     task->tid = pid;
@@ -113,51 +235,35 @@ struct s_task *spawn_task_from_elf(char* name, size_t name_size, elf_t* elf, siz
     task->trap.xs[REGISTER_FP] = task->trap.xs[REGISTER_SP];
     last_virtual_page += PAGE_SIZE;
 
-    int offset = 0;
-    char** args_new = malloc(sizeof(char*) * argc);
-    char* physical = mmu_alloc(top, last_virtual_page,
-        MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_USER);
-    physical = phys2safe(physical);
-    void* virt_addr = last_virtual_page;
-    last_virtual_page += PAGE_SIZE;
+    // The argument strings and the argv array after them are built in one run of pages mapped right above the stack
+    size_t strings_size = 0;
     for (size_t arg_index = 0; arg_index < argc; arg_index++) {
-        args_new[arg_index] = virt_addr + offset;
-        for (size_t i = 0; args[arg_index][i]; i++, offset++) {
-            if (offset >= PAGE_SIZE) {
-                offset = 0;
-                physical = mmu_alloc(top, last_virtual_page,
-                    MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_USER);
-                physical = phys2safe(physical);
-                virt_addr = last_virtual_page;
-                last_virtual_page += PAGE_SIZE;
-            }
-            physical[offset] = args[arg_index][i];
-        }
-        if (offset >= PAGE_SIZE) {
-            offset = 0;
-            physical = mmu_alloc(top, last_virtual_page,
-                MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_USER);
-            physical = phys2safe(physical);
-            virt_addr = last_virtual_page;
-            last_virtual_page += PAGE_SIZE;
-        }
-        physical[offset++] = '\0';
+        strings_size += strlen(args[arg_index]) + 1;
+    }
+    strings_size += (-strings_size) & (sizeof(void*) - 1);
+    size_t args_pages = (strings_size + argc * sizeof(void*) + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (args_pages == 0)
+        args_pages = 1;
+
+    char* physical = alloc_pages(args_pages);
+    if (!physical || mmu_map_range(top, last_virtual_page, physical, args_pages, MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_USER)) {
+        console_puts("[spawn_task_from_elf] unable to map arguments\n");
+        if (physical)
+            dealloc_pages(physical, args_pages);
+        goto fail;
     }
 
-    offset += (-offset) & (sizeof(void*) - 1);
-    void* first = virt_addr + offset;
-
-    for (size_t arg_index = 0; arg_index < argc; arg_index++, offset += sizeof(void*)) {
-        if (offset >= PAGE_SIZE) {
-            offset = 0;
-            physical = mmu_alloc(top, last_virtual_page,
-                MMU_BIT_READ | MMU_BIT_WRITE | MMU_BIT_USER);
-            physical = phys2safe(physical);
-            virt_addr = last_virtual_page;
-            last_virtual_page += PAGE_SIZE;
-        }
-        *((void**) (physical + offset)) = args_new[arg_index];
+    char* safe = phys2safe(physical);
+    void** argv = (void**) (safe + strings_size);
+    size_t offset = 0;
+    for (size_t arg_index = 0; arg_index < argc; arg_index++) {
+        size_t length = strlen(args[arg_index]) + 1;
+        memcpy(safe + offset, args[arg_index], length);
+        argv[arg_index] = last_virtual_page + offset;
+        offset += length;
     }
+    void* first = last_virtual_page + strings_size;
+    last_virtual_page += args_pages * PAGE_SIZE;
 
     task->trap.xs[REGISTER_A0] = argc;
     task->trap.xs[REGISTER_A1] = (uint64_t) first;
@@ -169,12 +275,354 @@ struct s_task *spawn_task_from_elf(char* name, size_t name_size, elf_t* elf, siz
     task->name[name_size] = '\0';
     task->pid = pid;
     task->mmu_data = top;
+    task->last_virtual_page = last_virtual_page;
     task->trap.pc = elf->header->entry;
-    task->state = TASK_STATE_READY;
+    release_task_slot(task, TASK_STATE_READY);
+    schedule_task(task->pid, task->state, task->priority);
+    return task;
+
+fail:
+    // The first task runs in the boot page table
+    if (pid != 0)
+        clean_mmu_table(top);
+    task->lazy_region_count = 0;
+    release_task_slot(task, TASK_STATE_DEAD);
+    return NULL;
+}
+
+// clone_task(pid_t) -> struct s_task*
+// Creates a copy of a task that shares its memory copy on write and resumes from the same point with a0 set to 0. Returns NULL on failure.
+struct s_task *clone_task(pid_t ppid) {
+    struct s_task *parent = get_task(ppid);
+    if (parent == NULL || parent->state == TASK_STATE_DEAD)
+        return NULL;
+
+    pid_t pid = claim_task_slot();
+    if (pid < 0)
+        return NULL;
+
+    struct s_task *task = &tasks[pid];
+    struct mmu_root top = create_mmu_table();
+    if (!mmu_root_valid(top)) {
+        release_task_slot(task, TASK_STATE_DEAD);
+        return NULL;
+    }
+    if (mmu_clone_user(top, parent->mmu_data)) {
+        console_puts("[clone_task] unable to copy address space\n");
+        clean_mmu_table(top);
+        release_task_slot(task, TASK_STATE_DEAD);
+        return NULL;
+    }
+
+    memcpy(task->name, parent->name, TASK_NAME_SIZE);
+    task->pid = pid;
+    task->ppid = parent->pid;
+    task->gid = parent->gid;
+    task->tid = pid;
+    task->mmu_data = top;
+    task->last_virtual_page = parent->last_virtual_page;
+    task->lazy_region_count = parent->lazy_region_count;
+    memcpy(task->lazy_regions, parent->lazy_regions, parent->lazy_region_count * sizeof(struct lazy_region));
+    task->working_set = (struct working_set_stats) { .last_scan = get_time() };
+    task->scheduling = (struct task_scheduler_stats) { 0 };
+    task->scheduling_since = get_time();
+    task->priority = parent->priority;
+    task->trap = parent->trap;
+    task->trap.pid = pid;
+    task->trap.xs[REGISTER_A0] = 0;
+    clone_shared_memory(parent, task);
+    release_task_slot(task, TASK_STATE_READY);
     schedule_task(task->pid, task->state, task->priority);
     return task;
 }
 
+// find_lazy_region(struct s_task*, void*) -> struct lazy_region*
+// Returns the region reserving the given address, or null if it isn't reserved.
+static struct lazy_region* find_lazy_region(struct s_task* task, void* addr) {
+    for (size_t i = 0; i < task->lazy_region_count; i++) {
+        struct lazy_region* region = &task->lazy_regions[i];
+        if (region->start <= addr && addr < region->end)
+            return region;
+    }
+    return NULL;
+}
+
+// lazy_region_offset(struct lazy_region*, void*) -> size_t
+// Returns the offset in the region's file of the page at the given address, or 0 if the region has no file.
+static size_t lazy_region_offset(struct lazy_region* region, void* addr) {
+    if (region->file == NULL)
+        return 0;
+    return region->file_offset + (addr - region->start);
+}
+
+// reserve_lazy_range(struct s_task*, void*, size_t, int) -> bool
+// Reserves page_count pages at the given address to be allocated zeroed with the given flags when first touched. Returns false if the task has no free regions.
+bool reserve_lazy_range(struct s_task* task, void* start, size_t page_count, int flags) {
+    return reserve_file_range(task, start, page_count, flags, NULL, 0);
+}
+
+// reserve_file_range(struct s_task*, void*, size_t, int, fat_root_dir_entry_t*, size_t) -> bool
+// Reserves page_count pages at the given address to be read from the file, starting at the page aligned offset, with the given flags when first touched. Returns false if the task has no free regions, or if the range reaches past user memory or into the root slots shared with the kernel.
+bool reserve_file_range(struct s_task* task, void* start, size_t page_count, int flags, fat_root_dir_entry_t* file, size_t file_offset) {
+    void* end = start + page_count * PAGE_SIZE;
+    if ((intptr_t) start & (PAGE_SIZE - 1) || end < start || !mmu_user_range(start, end - start))
+        return false;
+    if (file == NULL)
+        file_offset = 0;
+    else if (file_offset & (PAGE_SIZE - 1))
+        return false;
+    if (page_count == 0)
+        return true;
+
+    // Heaps grow by reserving right after their last reservation, so neighbouring regions with the same flags are merged. File regions only merge where the file carries on
+    for (size_t i = 0; i < task->lazy_region_count; i++) {
+        struct lazy_region* region = &task->lazy_regions[i];
+        if (region->flags != flags || region->file != file)
+            continue;
+        if (region->end == start && lazy_region_offset(region, start) == file_offset) {
+            region->end = end;
+            return true;
+        }
+        if (region->start == end && (file == NULL || file_offset + page_count * PAGE_SIZE == region->file_offset)) {
+            region->start = start;
+            region->file_offset = file_offset;
+            return true;
+        }
+    }
+
+    if (task->lazy_region_count == TASK_MAX_LAZY_REGIONS)
+        return false;
+    task->lazy_regions[task->lazy_region_count++] = (struct lazy_region) {
+        .start = start,
+        .end = end,
+        .flags = flags,
+        .file = file,
+        .file_offset = file_offset,
+    };
+    return true;
+}
+
+// protect_lazy_range(struct s_task*, void*, size_t, int) -> bool
+// Changes the flags pages in the range get when they are populated, splitting regions the range only partly covers. Returns false without changing anything if the task has no free regions for the split.
+bool protect_lazy_range(struct s_task* task, void* start, size_t page_count, int flags) {
+    void* end = start + page_count * PAGE_SIZE;
+    size_t splits = 0;
+    for (size_t i = 0; i < task->lazy_region_count; i++) {
+        struct lazy_region* region = &task->lazy_regions[i];
+        if (region->start < start && start < region->end)
+            splits++;
+        if (region->start < end && end < region->end)
+            splits++;
+    }
+    if (task->lazy_region_count + splits > TASK_MAX_LAZY_REGIONS)
+        return false;
+
+    // Regions split off here lie outside the range, so the loop doesn't need to visit them
+    size_t count = task->lazy_region_count;
+    for (size_t i = 0; i < count; i++) {
+        struct lazy_region* region = &task->lazy_regions[i];
+        if (region->end <= start || end <= region->start)
+            continue;
+
+        if (region->start < start) {
+            task->lazy_regions[task->lazy_region_count++] = (struct lazy_region) {
+                .start = region->start,
+                .end = start,
+                .flags = region->flags,
+                .file = region->file,
+                .file_offset = region->file_offset,
+            };
+            region->file_offset = lazy_region_offset(region, start);
+            region->start = start;
+        }
+        if (end < region->end) {
+            task->lazy_regions[task->lazy_region_count++] = (struct lazy_region) {
+                .start = end,
+                .end = region->end,
+                .flags = region->flags,
+                .file = region->file,
+                .file_offset = lazy_region_offset(region, end),
+            };
+            region->end = end;
+        }
+        region->flags = flags;
+    }
+    return true;
+}
+
+// release_lazy_range(struct s_task*, void*, size_t) -> bool
+// Drops the reservation of every page in the range, splitting regions the range only partly covers. Returns false without changing anything if the task has no free regions for the split.
+bool release_lazy_range(struct s_task* task, void* start, size_t page_count) {
+    void* end = start + page_count * PAGE_SIZE;
+    for (size_t i = 0; i < task->lazy_region_count; i++) {
+        struct lazy_region* region = &task->lazy_regions[i];
+        if (region->start < start && end < region->end && task->lazy_region_count == TASK_MAX_LAZY_REGIONS)
+            return false;
+    }
+
+    size_t i = 0;
+    while (i < task->lazy_region_count) {
+        struct lazy_region* region = &task->lazy_regions[i];
+        if (region->end <= start || end <= region->start) {
+            i++;
+        } else if (region->start < start && end < region->end) {
+            task->lazy_regions[task->lazy_region_count++] = (struct lazy_region) {
+                .start = end,
+                .end = region->end,
+                .flags = region->flags,
+                .file = region->file,
+                .file_offset = lazy_region_offset(region, end),
+            };
+            region->end = start;
+            i++;
+        } else if (region->start < start) {
+            region->end = start;
+            i++;
+        } else if (end < region->end) {
+            region->file_offset = lazy_region_offset(region, end);
+            region->start = end;
+            i++;
+        } else {
+            *region = task->lazy_regions[--task->lazy_region_count];
+        }
+    }
+    return true;
+}
+
+// task_range_owned(struct s_task*, void*, size_t) -> bool
+// Returns true if every page in the range is either mapped for the user or reserved.
+bool task_range_owned(struct s_task* task, void* start, size_t page_count) {
+    void* end = start + page_count * PAGE_SIZE;
+    if ((intptr_t) start & (PAGE_SIZE - 1) || end < start)
+        return false;
+
+    void* page = start;
+    while (page < end) {
+        struct lazy_region* region = find_lazy_region(task, page);
+        if (region) {
+            page = region->end;
+        } else if (mmu_range_mapped(task->mmu_data, page, 1, MMU_BIT_USER)) {
+            page += PAGE_SIZE;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// populate_lazy_range(struct mmu_root, struct lazy_region*, void*, size_t) -> int
+// Maps page_count reserved pages of the region, from its file if it has one. Returns 0 on success.
+static int populate_lazy_range(struct mmu_root root, struct lazy_region* region, void* start, size_t page_count) {
+    if (region->file)
+        return populate_file_range(root, region, start, page_count);
+    return mmu_alloc_range(root, start, page_count, region->flags | MMU_BIT_USER);
+}
+
+// handle_page_fault(struct s_task*, void*, uint64_t) -> bool
+// Resolves a page fault of the given cause by reading the page back from swap or populating the reserved pages around the faulting address, from their file if they have one. Returns false if the access isn't allowed.
+bool handle_page_fault(struct s_task* task, void* addr, uint64_t cause) {
+    int needed;
+    switch (cause) {
+        case 12:
+            needed = MMU_BIT_EXEC;
+            break;
+        case 13:
+            needed = MMU_BIT_READ;
+            break;
+        case 15:
+            needed = MMU_BIT_WRITE;
+            break;
+        default:
+            return false;
+    }
+
+    // Faults in the kernel's shared root slots are never the task's to resolve, since anything mapped there would be mapped in every address space
+    void* page = (void*) ((intptr_t) addr & ~(PAGE_SIZE - 1));
+    if (!mmu_user_range(page, PAGE_SIZE))
+        return false;
+
+    // Swap entries keep the permissions the page had
+    struct mmu_entry* swapped = mmu_walk_to_swapped(task->mmu_data, page);
+    if (swapped) {
+        if (!mmu_entry_user(*swapped) || !mmu_entry_flags(*swapped, needed))
+            return false;
+        return swap_in(task->mmu_data, page, needed == MMU_BIT_WRITE);
+    }
+
+    // Neighbours populated by an earlier fault can still be cached as invalid, which only needs a flush
+    struct mmu_entry* entry = mmu_walk_to_leaf(task->mmu_data, page, NULL);
+    if (entry && mmu_entry_valid(*entry) && mmu_entry_frame(*entry)) {
+        if (needed == MMU_BIT_WRITE && mmu_entry_user(*entry) && mmu_entry_cow(*entry))
+            return mmu_resolve_cow(task->mmu_data, page);
+        if (!mmu_entry_user(*entry) || !mmu_entry_flags(*entry, needed))
+            return false;
+
+        // Without hardware updates, the first access after the page is mapped or scanned faults to set its accessed and dirty bits
+        if (!mmu_mark_accessed(task->mmu_data, page, needed == MMU_BIT_WRITE))
+            mmu_flush_page(task->mmu_data, page);
+        return true;
+    }
+
+    struct lazy_region* region = find_lazy_region(task, page);
+    if (!region || !(region->flags & needed))
+        return false;
+
+    void* window = (void*) ((intptr_t) page & ~(FAULT_AROUND_PAGES * PAGE_SIZE - 1));
+    void* start = window < region->start ? region->start : window;
+    void* end = window + FAULT_AROUND_PAGES * PAGE_SIZE;
+    if (end > region->end)
+        end = region->end;
+
+    // Populate every run of unmapped pages in the window. The neighbours are only a guess, so only the faulting page has to succeed
+    bool resolved = false;
+    void* p = start;
+    while (p < end) {
+        if (mmu_range_mapped(task->mmu_data, p, 1, 0)) {
+            p += PAGE_SIZE;
+            continue;
+        }
+
+        void* run = p;
+        while (p < end && !mmu_range_mapped(task->mmu_data, p, 1, 0))
+            p += PAGE_SIZE;
+
+        bool covers = run <= page && page < p;
+        if (populate_lazy_range(task->mmu_data, region, run, (p - run) / PAGE_SIZE) == 0)
+            resolved |= covers;
+        else if (covers)
+            resolved = populate_lazy_range(task->mmu_data, region, page, 1) == 0;
+    }
+
+    // Writes to file pages mapped copy on write take their private copy now, rather than faulting again for it
+    if (resolved && needed == MMU_BIT_WRITE) {
+        struct mmu_entry* populated = mmu_walk_to_leaf(task->mmu_data, page, NULL);
+        if (populated && mmu_entry_cow(*populated))
+            return mmu_resolve_cow(task->mmu_data, page);
+    }
+
+    // Mark the page for the access being retried, rather than faulting again for its accessed bit
+    if (resolved && !mmu_mark_accessed(task->mmu_data, page, needed == MMU_BIT_WRITE))
+        mmu_flush_page(task->mmu_data, page);
+    return resolved;
+}
+
+// scan_working_set(struct s_task*) -> void
+// Samples the accessed and dirty bits of the task's pages into its working set stats and starts a new interval. The task must not be running on another hart.
+void scan_working_set(struct s_task* task) {
+    struct mmu_scan_counts counts;
+    mmu_scan_user(task->mmu_data, &counts);
+    task->working_set = (struct working_set_stats) {
+        .scans = task->working_set.scans + 1,
+        .last_scan = get_time(),
+        .resident = counts.resident,
+        .accessed = counts.accessed,
+        .idle = counts.idle,
+        .cold = counts.cold,
+        .dirty = counts.dirty,
+        .swapped = counts.swapped,
+    };
+}
+
 /*
 struct s_task {
     char name[TASK_NAME_SIZE];
@@ -323,3 +771,24 @@ struct s_task *spawn_task_from_func(
 
 //     return process_ptr;
 // }
+
+// kill_process(pid_t) -> void
+// Kills a process. Only the task running on this hart, which must no longer be in sscratch, or a task no hart has picked up can be killed. Its memory lock is released with the slot.
+void kill_process(pid_t pid) {
+    struct s_task *task = get_task(pid);
+    if (task == NULL || task->state == TASK_STATE_DEAD || task->state == TASK_STATE_CREATING)
+        return;
+
+    // A task running here already holds its lock, and others wait out the swap reclaimer
+    if (task->state != TASK_STATE_RUNNING)
+        spin_lock(&task->memory_lock);
+    unschedule_task(pid);
+    clean_mmu_table(task->mmu_data);
+    task->mmu_data = (struct mmu_root) { 0 };
+    task->lazy_region_count = 0;
+    release_shared_memory(task);
+
+    // The slot can be claimed as soon as it's dead, so nothing may touch it after this
+    spin_unlock(&task->memory_lock);
+    __atomic_store_n(&task->state, TASK_STATE_DEAD, __ATOMIC_RELEASE);
+}
@@ -6,9 +6,13 @@
 #include <stdint.h>
 
 #include "elf.h"
+#include "fat16.h"
 #include "interrupt.h"
 #include "mmu.h"
+#include "scheduler_stats.h"
+#include "sync.h"
 #include "time.h"
+#include "working_set.h"
 
 #define PROCESS_MESSAGE_QUEUE_SIZE  128
 #define TASK_NAME_SIZE              255
@@ -21,6 +25,9 @@ typedef enum {
     TASK_STATE_RUNNING,
     TASK_STATE_BLOCK,
     TASK_STATE_READY,
+
+    // Claimed by spawn or clone, which holds the memory lock until the task is ready
+    TASK_STATE_CREATING,
 } task_state_t;
 
 struct allowed_memory {
@@ -30,7 +37,27 @@ struct allowed_memory {
 };
 
 #define PROCESS_MAX_ALLOWED_MEMORY_RANGES 16
+
+// A reserved part of a task's address space that only gets pages when they are first touched
+struct lazy_region {
+    void* start;
+    void* end;
+    int flags;
+
+    // File in the initrd the pages are read from, or null for zeroed pages, and the offset in the file of the region's first page
+    fat_root_dir_entry_t* file;
+    size_t file_offset;
+};
+
+#define TASK_MAX_LAZY_REGIONS 16
+
+// Stacks are reserved this many pages deep below their initial pages and grow into the reservation on demand
+#define TASK_STACK_MAX_PAGES 256
+
+// Time between working set scans of a task, in timer ticks
+#define WORKING_SET_INTERVAL 1000000
 #define CAPABILITIES_MAX_ALLOWED          1024
+#define TASK_MAX_CAPABILITIES             32
 #define CAPABILITIES_QUEUE_SIZE           1024
 
 typedef enum {
@@ -60,6 +87,8 @@ typedef struct {
     uint64_t data;
 } channel_message_t;
 
+struct shared_memory;
+
 typedef struct {
     char name[16];
 
@@ -69,6 +98,7 @@ typedef struct {
         CAPABILITY_INTERNAL_TYPE_MEMORY_RANGE,
         CAPABILITY_INTERNAL_TYPE_INTERRUPT,
         CAPABILITY_INTERNAL_TYPE_KILL,
+        CAPABILITY_INTERNAL_TYPE_SHARED_MEMORY,
     } type;
 
     union {
@@ -99,6 +129,18 @@ typedef struct {
             uint8_t resume : 2;
             uint8_t segfault : 1;
         } kill;
+
+        struct {
+            struct shared_memory* memory;
+            // Where the holder has the memory mapped, or null
+            void* mapped;
+            uint8_t read : 1;
+            uint8_t write : 1;
+            // Only the capability of the task that created the memory can revoke the others
+            uint8_t owner : 1;
+            // Revoked while the holder was running, and not released yet
+            uint8_t revoked : 1;
+        } shared_memory;
     } data;
 } capability_internal_t;
 
@@ -147,6 +189,29 @@ struct s_task {
     task_state_t state;
     struct mmu_root mmu_data;
 
+    // Held by the hart running the task, and by the swap reclaimer while it takes pages from the task
+    spin_t memory_lock;
+
+    // Start of the unused part of the address space page_alloc hands pages out from
+    void* last_virtual_page;
+
+    // Reserved regions populated by handle_page_fault, in no particular order
+    size_t lazy_region_count;
+    struct lazy_region lazy_regions[TASK_MAX_LAZY_REGIONS];
+
+    // Filled in by scan_working_set every WORKING_SET_INTERVAL the task runs
+    struct working_set_stats working_set;
+
+    // Capabilities the task holds, indexed by the handles syscalls take. Free entries are nil. Guarded by the shared memory lock
+    capability_internal_t capabilities[TASK_MAX_CAPABILITIES];
+
+    // Set when shared memory the task has mapped is revoked while it runs, for timer_switch to unmap
+    atomic_bool shared_memory_revoked;
+
+    // Kept by timer_switch, along with when the task last started running or waiting
+    struct task_scheduler_stats scheduling;
+    time_t scheduling_since;
+
     int priority;
     trap_t trap;
 };
@@ -213,6 +278,10 @@ struct s_task *get_task(pid_t pid);
 // Spawns a process using the given elf file. Returns NULL on failure.
 struct s_task *spawn_task_from_elf(char* name, size_t name_size, elf_t* elf, size_t stack_size, size_t argc, char** args);
 
+// clone_task(pid_t) -> struct s_task*
+// Creates a copy of a task that shares its memory copy on write and resumes from the same point with a0 set to 0. Returns NULL on failure.
+struct s_task *clone_task(pid_t ppid);
+
 // spawn_thread_from_func(pid_t, void*, size_t, void*) -> process_t*
 // Spawns a thread from the given process. Returns NULL on failure.
 process_t* spawn_thread_from_func(pid_t parent_pid, void* func, size_t stack_size, void* args);
@@ -232,8 +301,36 @@ pid_t get_next_waiting_process(pid_t pid);
 // Pushes a capability to a process's list of capabilities.
 void push_capability(pid_t pid, capability_internal_t cap);
 
+// reserve_lazy_range(struct s_task*, void*, size_t, int) -> bool
+// Reserves page_count pages at the given address to be allocated zeroed with the given flags when first touched. Returns false if the task has no free regions.
+bool reserve_lazy_range(struct s_task* task, void* start, size_t page_count, int flags);
+
+// reserve_file_range(struct s_task*, void*, size_t, int, fat_root_dir_entry_t*, size_t) -> bool
+// Reserves page_count pages at the given address to be read from the file, starting at the page aligned offset, with the given flags when first touched. Returns false if the task has no free regions, or if the range reaches past user memory or into the root slots shared with the kernel.
+bool reserve_file_range(struct s_task* task, void* start, size_t page_count, int flags, fat_root_dir_entry_t* file, size_t file_offset);
+
+// protect_lazy_range(struct s_task*, void*, size_t, int) -> bool
+// Changes the flags pages in the range get when they are populated, splitting regions the range only partly covers. Returns false without changing anything if the task has no free regions for the split.
+bool protect_lazy_range(struct s_task* task, void* start, size_t page_count, int flags);
+
+// release_lazy_range(struct s_task*, void*, size_t) -> bool
+// Drops the reservation of every page in the range, splitting regions the range only partly covers. Returns false without changing anything if the task has no free regions for the split.
+bool release_lazy_range(struct s_task* task, void* start, size_t page_count);
+
+// task_range_owned(struct s_task*, void*, size_t) -> bool
+// Returns true if every page in the range is either mapped for the user or reserved.
+bool task_range_owned(struct s_task* task, void* start, size_t page_count);
+
+// handle_page_fault(struct s_task*, void*, uint64_t) -> bool
+// Resolves a page fault of the given cause by reading the page back from swap or populating the reserved pages around the faulting address, from their file if they have one. Returns false if the access isn't allowed.
+bool handle_page_fault(struct s_task* task, void* addr, uint64_t cause);
+
+// scan_working_set(struct s_task*) -> void
+// Samples the accessed and dirty bits of the task's pages into its working set stats and starts a new interval. The task must not be running on another hart.
+void scan_working_set(struct s_task* task);
+
 // kill_process(pid_t) -> void
-// Kills a process.
+// Kills a process. Only the task running on this hart, which must no longer be in sscratch, or a task no hart has picked up can be killed. Its memory lock is released with the slot.
 void kill_process(pid_t pid);
 
 #endif /* PROCESS_H */
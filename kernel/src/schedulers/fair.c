@@ -0,0 +1,359 @@
+#include "scheduler.h"
+
+#ifdef SCHED_FAIR
+
+#include "../interrupt.h"
+#include "../memory.h"
+#include "../sync.h"
+
+// Fair share scheduling. Every task accumulates virtual runtime, the time it
+// has run scaled down by its weight, and the ready task with the least of it
+// runs next, so over time each task gets hart time in proportion to its
+// weight. Ready tasks are kept in an AVL tree ordered by virtual runtime, with
+// ties broken by pid. Slices split a fixed latency between the runnable tasks
+// by weight, so every task runs once per latency period until there are too
+// many for that. All harts share the tree under one lock.
+
+// Period over which every runnable task should get to run once
+#define FAIR_LATENCY        ((time_t) PROCESS_QUANTUM * 6)
+
+// Shortest slice a task is given however many tasks share the latency
+#define FAIR_MIN_SLICE      ((time_t) PROCESS_QUANTUM / 4)
+
+// Virtual runtime a waiting task must be ahead by to preempt the running one
+#define FAIR_WAKEUP_GRANULARITY (PROCESS_QUANTUM / 2)
+
+// Weight of a task with priority 0, which runs at real speed in virtual time
+#define FAIR_WEIGHT_UNIT    1024
+
+// Weights for priorities 20 down to -19, each about 1.25 times the next, so a
+// priority step is worth about a tenth of the hart against an equal task.
+static const uint32_t priority_weights[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+struct fair_task {
+    // Children and height in the tree while queued
+    pid_t left;
+    pid_t right;
+    int height;
+    bool queued;
+
+    // Whether the task counts towards the total weight, from when it's first scheduled until it's unscheduled
+    bool runnable;
+
+    uint32_t weight;
+    uint64_t vruntime;
+
+    // Slice the task was given and when it started running, 0 if it isn't running
+    time_t slice;
+    time_t run_start;
+};
+
+DEFINE_SPINLOCK(fair_lock);
+static struct fair_task *entries = NULL;
+static pid_t entry_count = 0;
+static pid_t root = -1;
+static size_t queued_count = 0;
+
+// Sum of the weights of every runnable task, running or queued
+static uint64_t total_weight = 0;
+
+// Never decreases, and is where new tasks start so they can't run ahead of everyone
+static uint64_t min_vruntime = 0;
+
+// Counters of each hart, only written by the hart itself
+static struct scheduler_stats stats[MAX_TRAP_COUNT];
+static _Atomic uint64_t hart_limit = 0;
+
+// priority_weight(int) -> uint32_t
+// Returns the weight of a task with the given priority.
+static uint32_t priority_weight(int priority) {
+    if (priority > 20)
+        priority = 20;
+    if (priority < -19)
+        priority = -19;
+    return priority_weights[20 - priority];
+}
+
+// running_vruntime(struct fair_task*, time_t) -> uint64_t
+// Returns the virtual runtime of a task including the time it has been running for, if any.
+static uint64_t running_vruntime(struct fair_task *entry, time_t now) {
+    if (entry->run_start == 0)
+        return entry->vruntime;
+    return entry->vruntime + (now - entry->run_start) * FAIR_WEIGHT_UNIT / entry->weight;
+}
+
+// tree_before(pid_t, pid_t) -> bool
+// Returns whether the first task comes before the second in the tree.
+static bool tree_before(pid_t a, pid_t b) {
+    if (entries[a].vruntime != entries[b].vruntime)
+        return entries[a].vruntime < entries[b].vruntime;
+    return a < b;
+}
+
+// tree_height(pid_t) -> int
+// Returns the height of a subtree, which is 0 if it is empty.
+static int tree_height(pid_t node) {
+    return node < 0 ? 0 : entries[node].height;
+}
+
+// tree_update(pid_t) -> void
+// Recomputes the height of a node from its children.
+static void tree_update(pid_t node) {
+    int left = tree_height(entries[node].left);
+    int right = tree_height(entries[node].right);
+    entries[node].height = (left > right ? left : right) + 1;
+}
+
+// tree_rotate_left(pid_t) -> pid_t
+// Rotates a subtree left and returns its new root.
+static pid_t tree_rotate_left(pid_t node) {
+    pid_t right = entries[node].right;
+    entries[node].right = entries[right].left;
+    entries[right].left = node;
+    tree_update(node);
+    tree_update(right);
+    return right;
+}
+
+// tree_rotate_right(pid_t) -> pid_t
+// Rotates a subtree right and returns its new root.
+static pid_t tree_rotate_right(pid_t node) {
+    pid_t left = entries[node].left;
+    entries[node].left = entries[left].right;
+    entries[left].right = node;
+    tree_update(node);
+    tree_update(left);
+    return left;
+}
+
+// tree_balance(pid_t) -> pid_t
+// Restores the AVL invariant at a node whose subtrees differ in height by at most two. Returns the new root of the subtree.
+static pid_t tree_balance(pid_t node) {
+    tree_update(node);
+    int balance = tree_height(entries[node].left) - tree_height(entries[node].right);
+    if (balance > 1) {
+        pid_t left = entries[node].left;
+        if (tree_height(entries[left].left) < tree_height(entries[left].right))
+            entries[node].left = tree_rotate_left(left);
+        return tree_rotate_right(node);
+    }
+    if (balance < -1) {
+        pid_t right = entries[node].right;
+        if (tree_height(entries[right].right) < tree_height(entries[right].left))
+            entries[node].right = tree_rotate_right(right);
+        return tree_rotate_left(node);
+    }
+    return node;
+}
+
+// tree_insert(pid_t, pid_t) -> pid_t
+// Inserts a task into a subtree and returns its new root.
+static pid_t tree_insert(pid_t node, pid_t pid) {
+    if (node < 0) {
+        entries[pid].left = -1;
+        entries[pid].right = -1;
+        entries[pid].height = 1;
+        return pid;
+    }
+
+    if (tree_before(pid, node))
+        entries[node].left = tree_insert(entries[node].left, pid);
+    else
+        entries[node].right = tree_insert(entries[node].right, pid);
+    return tree_balance(node);
+}
+
+// tree_remove_first(pid_t, pid_t*) -> pid_t
+// Removes the first task of a non-empty subtree, which is written to first. Returns the new root of the subtree.
+static pid_t tree_remove_first(pid_t node, pid_t *first) {
+    if (entries[node].left < 0) {
+        *first = node;
+        return entries[node].right;
+    }
+    entries[node].left = tree_remove_first(entries[node].left, first);
+    return tree_balance(node);
+}
+
+// tree_remove(pid_t, pid_t) -> pid_t
+// Removes a task from a subtree that holds it and returns the new root of the subtree.
+static pid_t tree_remove(pid_t node, pid_t pid) {
+    if (node != pid) {
+        if (tree_before(pid, node))
+            entries[node].left = tree_remove(entries[node].left, pid);
+        else
+            entries[node].right = tree_remove(entries[node].right, pid);
+        return tree_balance(node);
+    }
+
+    // The node is replaced by the first task after it, if it has two children
+    pid_t left = entries[node].left;
+    pid_t right = entries[node].right;
+    if (left < 0)
+        return right;
+    if (right < 0)
+        return left;
+
+    pid_t successor;
+    right = tree_remove_first(right, &successor);
+    entries[successor].left = left;
+    entries[successor].right = right;
+    return tree_balance(successor);
+}
+
+// tree_first() -> pid_t
+// Returns the queued task with the least virtual runtime, or -1 if there is none. The lock must be held.
+static pid_t tree_first() {
+    pid_t node = root;
+    if (node < 0)
+        return -1;
+    while (entries[node].left >= 0)
+        node = entries[node].left;
+    return node;
+}
+
+// fair_dequeue(pid_t) -> void
+// Takes a task out of the tree. The lock must be held.
+static void fair_dequeue(pid_t pid) {
+    root = tree_remove(root, pid);
+    entries[pid].queued = false;
+    queued_count--;
+}
+
+// reset_entry(pid_t) -> void
+// Forgets everything about a task.
+static void reset_entry(pid_t pid) {
+    entries[pid] = (struct fair_task) {
+        .left = -1,
+        .right = -1,
+    };
+}
+
+void init_scheduler(pid_t max_pid, void *data) {
+    (void) data;
+    entries = malloc(max_pid * sizeof(struct fair_task));
+    entry_count = entries ? max_pid : 0;
+    for (pid_t pid = 0; pid < entry_count; pid++)
+        reset_entry(pid);
+}
+
+void schedule_task(pid_t pid, task_state_t state, int priority) {
+    if (pid < 0 || pid >= entry_count || state != TASK_STATE_READY)
+        return;
+
+    time_t now = get_time();
+    spin_lock(&fair_lock);
+    struct fair_task *entry = &entries[pid];
+    if (entry->queued) {
+        spin_unlock(&fair_lock);
+        return;
+    }
+
+    // New tasks join at the current minimum, and running ones are charged for the time since they were picked
+    if (!entry->runnable) {
+        entry->runnable = true;
+        entry->weight = priority_weight(priority);
+        entry->vruntime = min_vruntime;
+        total_weight += entry->weight;
+    } else if (entry->run_start != 0) {
+        entry->vruntime = running_vruntime(entry, now);
+        entry->run_start = 0;
+    }
+
+    entry->queued = true;
+    root = tree_insert(root, pid);
+    queued_count++;
+    spin_unlock(&fair_lock);
+}
+
+bool should_switch_now(pid_t pid, int priority) {
+    (void) priority;
+    if (pid < 0 || pid >= entry_count)
+        return false;
+
+    // This is checked on every trap, so a busy lock just means checking again on the next one
+    if (!spin_try_lock(&fair_lock))
+        return false;
+    pid_t first = tree_first();
+    bool preempt = first >= 0 && entries[pid].run_start != 0
+        && entries[first].vruntime + FAIR_WAKEUP_GRANULARITY < running_vruntime(&entries[pid], get_time());
+    spin_unlock(&fair_lock);
+    return preempt;
+}
+
+pid_t next_scheduled_task() {
+    uint64_t hartid = get_hartid();
+    uint64_t limit = hart_limit;
+    while (hartid >= limit && !atomic_compare_exchange_weak(&hart_limit, &limit, hartid + 1));
+
+    time_t now = get_time();
+    pid_t pid = -1;
+    spin_lock(&fair_lock);
+    while (root >= 0) {
+        pid_t candidate = tree_first();
+        fair_dequeue(candidate);
+
+        // Tasks killed while queued are dropped here
+        if (get_task(candidate)->state != TASK_STATE_READY)
+            continue;
+
+        struct fair_task *entry = &entries[candidate];
+        if (entry->vruntime > min_vruntime)
+            min_vruntime = entry->vruntime;
+
+        // The latency is split by weight, so heavier tasks run longer at a time as well as more often
+        entry->slice = FAIR_LATENCY * entry->weight / (total_weight ? total_weight : entry->weight);
+        if (entry->slice < FAIR_MIN_SLICE)
+            entry->slice = FAIR_MIN_SLICE;
+        entry->run_start = now;
+        pid = candidate;
+        break;
+    }
+    spin_unlock(&fair_lock);
+
+    if (pid < 0)
+        stats[hartid].idle++;
+    else
+        stats[hartid].picks++;
+    return pid;
+}
+
+void unschedule_task(pid_t pid) {
+    if (pid < 0 || pid >= entry_count)
+        return;
+
+    spin_lock(&fair_lock);
+    if (entries[pid].queued)
+        fair_dequeue(pid);
+    if (entries[pid].runnable)
+        total_weight -= entries[pid].weight;
+    reset_entry(pid);
+    spin_unlock(&fair_lock);
+}
+
+time_t task_quantum(pid_t pid) {
+    if (pid < 0 || pid >= entry_count)
+        return PROCESS_QUANTUM;
+    return entries[pid].slice;
+}
+
+bool get_scheduler_stats(uint64_t hartid, struct scheduler_stats *result) {
+    if (hartid >= hart_limit)
+        return false;
+
+    // The tree is shared, so every hart reports all the ready tasks as queued
+    *result = stats[hartid];
+    result->queued = queued_count;
+    result->time = get_time();
+    return true;
+}
+
+#endif /* SCHED_FAIR */
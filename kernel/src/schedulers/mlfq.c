@@ -0,0 +1,282 @@
+#include "scheduler.h"
+
+#ifdef SCHED_MLFQ
+
+#include "../interrupt.h"
+#include "../memory.h"
+#include "../sync.h"
+
+// Multilevel feedback queues. Every level has a FIFO list of ready tasks, and
+// a bitmap of the non-empty levels finds the highest one in constant time. A
+// task's level is its base level, set by its priority, plus a bonus earned
+// from its CPU bursts. Tasks that yield within half of their slice are
+// treated as interactive and climb, while tasks that use up whole slices sink
+// and get longer slices instead, so they switch less often. Yielding is the
+// only way to leave the hart early, since tasks can't block yet. A ready task
+// that waits too long runs next regardless of level. All harts share the
+// queues under one lock.
+#define MLFQ_LEVELS         32
+
+// Level of a task with priority 0, with higher priorities above it
+#define MLFQ_DEFAULT_LEVEL  16
+
+// Most levels a task can climb above or sink below its base level
+#define MLFQ_MAX_BONUS      4
+
+// A ready task that has waited this many quanta runs before any other
+#define MLFQ_STARVATION_QUANTA 20
+
+struct mlfq_task {
+    pid_t next;
+    pid_t prev;
+
+    // Level the task is queued on, or -1
+    int queued_level;
+
+    // Levels above or below the base level earned from recent bursts
+    int bonus;
+
+    // Whether the task was switched out by should_switch_now, which says nothing about how long its burst would be
+    bool preempted;
+
+    // Slice the task was given and when it started running, 0 if it hasn't run since it was queued
+    time_t quantum;
+    time_t run_start;
+
+    // When the task was last queued
+    time_t queued_at;
+};
+
+struct mlfq_level {
+    pid_t head;
+    pid_t tail;
+};
+
+DEFINE_SPINLOCK(mlfq_lock);
+static struct mlfq_level levels[MLFQ_LEVELS];
+static uint32_t nonempty = 0;
+static size_t ready_count = 0;
+static struct mlfq_task *entries = NULL;
+static pid_t entry_count = 0;
+
+// Counters of each hart, only written by the hart itself
+static struct scheduler_stats stats[MAX_TRAP_COUNT];
+static _Atomic uint64_t hart_limit = 0;
+
+// base_level(int) -> int
+// Returns the level a task with the given priority sits at without any bonus.
+static int base_level(int priority) {
+    int level = MLFQ_DEFAULT_LEVEL + priority;
+    if (level < 0)
+        return 0;
+    if (level >= MLFQ_LEVELS)
+        return MLFQ_LEVELS - 1;
+    return level;
+}
+
+// task_level(struct mlfq_task*, int) -> int
+// Returns the level a task currently belongs on.
+static int task_level(struct mlfq_task *entry, int priority) {
+    int level = base_level(priority) + entry->bonus;
+    if (level < 0)
+        return 0;
+    if (level >= MLFQ_LEVELS)
+        return MLFQ_LEVELS - 1;
+    return level;
+}
+
+// slice_for(struct mlfq_task*, int) -> time_t
+// Returns the slice a task gets. Higher priorities get longer slices, from half to one and a half quanta, and every level a task has sunk adds another slice.
+static time_t slice_for(struct mlfq_task *entry, int priority) {
+    time_t slice = PROCESS_QUANTUM / 2 + (time_t) PROCESS_QUANTUM * base_level(priority) / (MLFQ_LEVELS - 1);
+    if (entry->bonus < 0)
+        slice *= 1 - entry->bonus;
+    return slice;
+}
+
+// highest_level() -> int
+// Returns the highest level with a ready task, or -1 if there is none. The lock must be held.
+static int highest_level() {
+    if (nonempty == 0)
+        return -1;
+    return 31 - __builtin_clz(nonempty);
+}
+
+// level_push(int, pid_t) -> void
+// Appends a task to the end of a level. The lock must be held.
+static void level_push(int level, pid_t pid) {
+    struct mlfq_level *list = &levels[level];
+    struct mlfq_task *entry = &entries[pid];
+    entry->next = -1;
+    entry->prev = list->tail;
+    entry->queued_level = level;
+    if (list->tail >= 0)
+        entries[list->tail].next = pid;
+    else
+        list->head = pid;
+    list->tail = pid;
+    nonempty |= 1u << level;
+    ready_count++;
+}
+
+// level_remove(pid_t) -> void
+// Takes a task off the level it is queued on. The lock must be held.
+static void level_remove(pid_t pid) {
+    struct mlfq_task *entry = &entries[pid];
+    struct mlfq_level *list = &levels[entry->queued_level];
+    if (entry->prev >= 0)
+        entries[entry->prev].next = entry->next;
+    else
+        list->head = entry->next;
+    if (entry->next >= 0)
+        entries[entry->next].prev = entry->prev;
+    else
+        list->tail = entry->prev;
+
+    if (list->head < 0)
+        nonempty &= ~(1u << entry->queued_level);
+    entry->next = -1;
+    entry->prev = -1;
+    entry->queued_level = -1;
+    ready_count--;
+}
+
+// starved_task(time_t) -> pid_t
+// Returns a queued task that has waited past the starvation limit, or -1 if there is none. Only the head of each level can be the oldest on it. The lock must be held.
+static pid_t starved_task(time_t now) {
+    for (uint32_t bits = nonempty; bits != 0; bits &= bits - 1) {
+        pid_t head = levels[__builtin_ctz(bits)].head;
+        if (now - entries[head].queued_at >= (time_t) PROCESS_QUANTUM * MLFQ_STARVATION_QUANTA)
+            return head;
+    }
+    return -1;
+}
+
+void init_scheduler(pid_t max_pid, void *data) {
+    (void) data;
+    entries = malloc(max_pid * sizeof(struct mlfq_task));
+    entry_count = entries ? max_pid : 0;
+    for (pid_t pid = 0; pid < entry_count; pid++) {
+        entries[pid] = (struct mlfq_task) {
+            .next = -1,
+            .prev = -1,
+            .queued_level = -1,
+        };
+    }
+
+    for (size_t i = 0; i < MLFQ_LEVELS; i++) {
+        levels[i] = (struct mlfq_level) {
+            .head = -1,
+            .tail = -1,
+        };
+    }
+}
+
+void schedule_task(pid_t pid, task_state_t state, int priority) {
+    if (pid < 0 || pid >= entry_count || state != TASK_STATE_READY)
+        return;
+
+    time_t now = get_time();
+    spin_lock(&mlfq_lock);
+    struct mlfq_task *entry = &entries[pid];
+    if (entry->queued_level >= 0) {
+        spin_unlock(&mlfq_lock);
+        return;
+    }
+
+    // A task that used its whole slice sinks a level, and one that yielded within half of it climbs a level
+    if (entry->run_start != 0 && !entry->preempted) {
+        time_t burst = now - entry->run_start;
+        if (burst >= entry->quantum && entry->bonus > -MLFQ_MAX_BONUS)
+            entry->bonus--;
+        else if (burst < entry->quantum / 2 && entry->bonus < MLFQ_MAX_BONUS)
+            entry->bonus++;
+    }
+    entry->preempted = false;
+    entry->run_start = 0;
+    entry->queued_at = now;
+    level_push(task_level(entry, priority), pid);
+    spin_unlock(&mlfq_lock);
+}
+
+bool should_switch_now(pid_t pid, int priority) {
+    if (pid < 0 || pid >= entry_count)
+        return false;
+
+    // Checked without the lock, since a stale answer only delays or hastens one switch
+    struct mlfq_task *entry = &entries[pid];
+    uint32_t bits = nonempty;
+    if (bits == 0 || 31 - __builtin_clz(bits) <= task_level(entry, priority))
+        return false;
+    entry->preempted = true;
+    return true;
+}
+
+pid_t next_scheduled_task() {
+    uint64_t hartid = get_hartid();
+    uint64_t limit = hart_limit;
+    while (hartid >= limit && !atomic_compare_exchange_weak(&hart_limit, &limit, hartid + 1));
+
+    time_t now = get_time();
+    pid_t pid = -1;
+    spin_lock(&mlfq_lock);
+    while (nonempty != 0) {
+        pid_t candidate = starved_task(now);
+        if (candidate < 0)
+            candidate = levels[highest_level()].head;
+        level_remove(candidate);
+
+        // Tasks killed while queued are dropped here
+        struct s_task *task = get_task(candidate);
+        if (task->state != TASK_STATE_READY)
+            continue;
+
+        struct mlfq_task *entry = &entries[candidate];
+        entry->quantum = slice_for(entry, task->priority);
+        entry->run_start = now;
+        pid = candidate;
+        break;
+    }
+    spin_unlock(&mlfq_lock);
+
+    if (pid < 0)
+        stats[hartid].idle++;
+    else
+        stats[hartid].picks++;
+    return pid;
+}
+
+void unschedule_task(pid_t pid) {
+    if (pid < 0 || pid >= entry_count)
+        return;
+
+    // The pid goes to a new task next, which starts with no history
+    spin_lock(&mlfq_lock);
+    if (entries[pid].queued_level >= 0)
+        level_remove(pid);
+    entries[pid] = (struct mlfq_task) {
+        .next = -1,
+        .prev = -1,
+        .queued_level = -1,
+    };
+    spin_unlock(&mlfq_lock);
+}
+
+time_t task_quantum(pid_t pid) {
+    if (pid < 0 || pid >= entry_count)
+        return PROCESS_QUANTUM;
+    return entries[pid].quantum;
+}
+
+bool get_scheduler_stats(uint64_t hartid, struct scheduler_stats *result) {
+    if (hartid >= hart_limit)
+        return false;
+
+    // The queues are shared, so every hart reports all the ready tasks as queued
+    *result = stats[hartid];
+    result->queued = ready_count;
+    result->time = get_time();
+    return true;
+}
+
+#endif /* SCHED_MLFQ */
@@ -0,0 +1,222 @@
+#include "scheduler.h"
+
+#ifdef SCHED_PER_HART
+
+#include "../interrupt.h"
+#include "../memory.h"
+#include "../sync.h"
+#include "../time.h"
+
+// Every hart has its own run queue, a FIFO list threaded through per-task
+// links, with its own lock. A task that is switched out goes back on the queue
+// of the hart it ran on, whose cache may still hold its memory, and new tasks
+// start on the hart that made them. A hart with nothing queued steals the task
+// that has waited longest on the longest queue. Only one queue lock is ever
+// held at a time.
+struct run_link {
+    pid_t next;
+    pid_t prev;
+
+    // Queue the task is on, or -1, changed only with that queue's lock held
+    int64_t hart;
+
+    // Hart the task last ran on, or -1 if it hasn't run yet
+    int64_t last_hart;
+};
+
+struct run_queue {
+    spin_t lock;
+    pid_t head;
+    pid_t tail;
+    size_t length;
+    struct scheduler_stats stats;
+};
+
+static struct run_queue queues[MAX_TRAP_COUNT];
+static struct run_link *links = NULL;
+static pid_t link_count = 0;
+
+// One more than the highest hart that has asked for a task, which bounds the queues stealing looks at
+static _Atomic uint64_t hart_limit = 0;
+
+// run_queue_push(struct run_queue*, int64_t, pid_t) -> void
+// Appends a task to the queue of the given hart. The queue must be locked.
+static void run_queue_push(struct run_queue *queue, int64_t hart, pid_t pid) {
+    links[pid] = (struct run_link) {
+        .next = -1,
+        .prev = queue->tail,
+        .hart = hart,
+        .last_hart = links[pid].last_hart,
+    };
+    if (queue->tail >= 0)
+        links[queue->tail].next = pid;
+    else
+        queue->head = pid;
+    queue->tail = pid;
+    queue->length++;
+}
+
+// run_queue_remove(struct run_queue*, pid_t) -> void
+// Takes a task off the queue it is on. The queue must be locked.
+static void run_queue_remove(struct run_queue *queue, pid_t pid) {
+    struct run_link *link = &links[pid];
+    if (link->prev >= 0)
+        links[link->prev].next = link->next;
+    else
+        queue->head = link->next;
+    if (link->next >= 0)
+        links[link->next].prev = link->prev;
+    else
+        queue->tail = link->prev;
+
+    link->next = -1;
+    link->prev = -1;
+    link->hart = -1;
+    queue->length--;
+}
+
+// run_queue_pop(struct run_queue*) -> pid_t
+// Takes the first ready task off the queue, dropping any that stopped being ready while queued. Returns -1 if there is none.
+static pid_t run_queue_pop(struct run_queue *queue) {
+    spin_lock(&queue->lock);
+    pid_t pid = -1;
+    while (queue->head >= 0) {
+        pid_t head = queue->head;
+        run_queue_remove(queue, head);
+        if (get_task(head)->state == TASK_STATE_READY) {
+            pid = head;
+            break;
+        }
+    }
+    spin_unlock(&queue->lock);
+    return pid;
+}
+
+// steal_task(uint64_t) -> pid_t
+// Takes a ready task from the longest queue of another hart. Returns -1 if no other hart has one.
+static pid_t steal_task(uint64_t hartid) {
+    while (true) {
+        // The lengths are read without the locks, so the victim is rechecked once locked
+        struct run_queue *victim = NULL;
+        size_t longest = 0;
+        for (uint64_t i = 0; i < hart_limit; i++) {
+            if (i != hartid && queues[i].length > longest) {
+                victim = &queues[i];
+                longest = queues[i].length;
+            }
+        }
+        if (victim == NULL)
+            return -1;
+
+        pid_t pid = run_queue_pop(victim);
+        if (pid >= 0)
+            return pid;
+    }
+}
+
+void init_scheduler(pid_t max_pid, void *data) {
+    (void) data;
+    links = malloc(max_pid * sizeof(struct run_link));
+    link_count = links ? max_pid : 0;
+    for (pid_t pid = 0; pid < link_count; pid++) {
+        links[pid] = (struct run_link) {
+            .next = -1,
+            .prev = -1,
+            .hart = -1,
+            .last_hart = -1,
+        };
+    }
+
+    for (size_t i = 0; i < MAX_TRAP_COUNT; i++) {
+        queues[i] = (struct run_queue) {
+            .lock = false,
+            .head = -1,
+            .tail = -1,
+            .length = 0,
+        };
+    }
+}
+
+void schedule_task(pid_t pid, task_state_t state, int priority) {
+    (void) priority;
+    if (pid < 0 || pid >= link_count || state != TASK_STATE_READY)
+        return;
+
+    int64_t hart = links[pid].last_hart >= 0 ? links[pid].last_hart : (int64_t) get_hartid();
+    struct run_queue *queue = &queues[hart];
+    spin_lock(&queue->lock);
+    if (links[pid].hart < 0)
+        run_queue_push(queue, hart, pid);
+    spin_unlock(&queue->lock);
+}
+
+bool should_switch_now(pid_t pid, int priority) {
+    (void) pid;
+    (void) priority;
+    return false;
+}
+
+pid_t next_scheduled_task() {
+    uint64_t hartid = get_hartid();
+    uint64_t limit = hart_limit;
+    while (hartid >= limit && !atomic_compare_exchange_weak(&hart_limit, &limit, hartid + 1));
+
+    struct run_queue *queue = &queues[hartid];
+    pid_t pid = run_queue_pop(queue);
+    if (pid < 0) {
+        pid = steal_task(hartid);
+        if (pid >= 0)
+            queue->stats.steals++;
+    }
+
+    if (pid < 0) {
+        queue->stats.idle++;
+        return -1;
+    }
+
+    queue->stats.picks++;
+    links[pid].last_hart = hartid;
+    return pid;
+}
+
+void unschedule_task(pid_t pid) {
+    if (pid < 0 || pid >= link_count)
+        return;
+
+    // The task can be stolen between reading its queue and locking it, in which case the read is retried
+    while (true) {
+        int64_t hart = links[pid].hart;
+        if (hart < 0)
+            break;
+
+        struct run_queue *queue = &queues[hart];
+        spin_lock(&queue->lock);
+        bool found = links[pid].hart == hart;
+        if (found)
+            run_queue_remove(queue, pid);
+        spin_unlock(&queue->lock);
+        if (found)
+            break;
+    }
+
+    // The pid goes to a new task next, which has no hart yet
+    links[pid].last_hart = -1;
+}
+
+time_t task_quantum(pid_t pid) {
+    (void) pid;
+    return PROCESS_QUANTUM;
+}
+
+bool get_scheduler_stats(uint64_t hartid, struct scheduler_stats *stats) {
+    if (hartid >= hart_limit)
+        return false;
+
+    struct run_queue *queue = &queues[hartid];
+    *stats = queue->stats;
+    stats->queued = queue->length;
+    stats->time = get_time();
+    return true;
+}
+
+#endif /* SCHED_PER_HART */
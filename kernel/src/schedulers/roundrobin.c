@@ -2,9 +2,16 @@
 
 #ifdef SCHED_ROUND_ROBIN
 
+#include "../interrupt.h"
+#include "../time.h"
+
 int next = 0;
 int up_to = 0;
 
+// Counters of each hart, only written by the hart itself
+static struct scheduler_stats stats[MAX_TRAP_COUNT];
+static uint64_t hart_limit = 0;
+
 void init_scheduler(pid_t max_pid, void *data) {
     (void) max_pid;
     (void) data;
@@ -27,15 +34,42 @@ bool should_switch_now(pid_t pid, int priority) {
 }
 
 pid_t next_scheduled_task() {
-    int n = next;
-    next++;
-    if (next > up_to)
-        next = 0;
-    return n;
+    uint64_t hartid = get_hartid();
+    if (hartid >= hart_limit)
+        hart_limit = hartid + 1;
+
+    // Dead and blocked tasks are skipped; -1 if nothing is ready
+    for (int i = 0; i <= up_to; i++) {
+        int n = next;
+        next++;
+        if (next > up_to)
+            next = 0;
+
+        struct s_task *task = get_task(n);
+        if (task != NULL && task->state == TASK_STATE_READY) {
+            stats[hartid].picks++;
+            return n;
+        }
+    }
+    stats[hartid].idle++;
+    return -1;
 }
 
 void unschedule_task(pid_t pid) {
     (void) pid;
 }
 
+time_t task_quantum(pid_t pid) {
+    (void) pid;
+    return PROCESS_QUANTUM;
+}
+
+bool get_scheduler_stats(uint64_t hartid, struct scheduler_stats *result) {
+    if (hartid >= hart_limit)
+        return false;
+    *result = stats[hartid];
+    result->time = get_time();
+    return true;
+}
+
 #endif /* SCHED_ROUND_ROBIN */
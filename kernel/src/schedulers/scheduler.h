@@ -2,8 +2,17 @@
 #define SCHEDULE_H
 
 #include "../process.h"
+#include "../time.h"
+#include "scheduler_stats.h"
 
-#define SCHED_ROUND_ROBIN
+// Exactly one scheduler is built in, picked with SCHED=<name> when building
+// the kernel. Per-hart run queues are the default.
+#if !defined(SCHED_ROUND_ROBIN) && !defined(SCHED_MLFQ) && !defined(SCHED_FAIR)
+#define SCHED_PER_HART
+#endif
+
+// Time slice in timer ticks for schedulers that don't size their own
+extern const int PROCESS_QUANTUM;
 
 // Initialise the scheduler.
 void init_scheduler(pid_t max_pid, void *data);
@@ -16,10 +25,18 @@ void schedule_task(pid_t pid, task_state_t state, int priority);
 bool should_switch_now(pid_t pid, int priority);
 
 // Returns the next scheduled task and removes the task from the
-// scheduler.
+// scheduler, or -1 if the current hart has nothing to run.
 pid_t next_scheduled_task();
 
 // Remove a task from the scheduler without dequeueing it.
 void unschedule_task(pid_t pid);
 
+// Returns how long a task just returned by next_scheduled_task may run
+// before it is switched out, in timer ticks.
+time_t task_quantum(pid_t pid);
+
+// Fills in the counters of the given hart. Returns false if the hart
+// has never asked for a task.
+bool get_scheduler_stats(uint64_t hartid, struct scheduler_stats *stats);
+
 #endif /* SCHEDULE_H */
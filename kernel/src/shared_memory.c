@@ -0,0 +1,348 @@
+#include "memory.h"
+#include "mmu.h"
+#include "shared_memory.h"
+#include "sync.h"
+
+// Shared memory and the capabilities every task holds for it are guarded by
+// one lock. Revoking can't wait for a task running on another hart to stop, so
+// it only try-locks the memory locks of the tasks it takes capabilities from.
+// Tasks it can't lock get their capabilities marked revoked, and unmap them in
+// timer_switch, which takes this lock with the task's memory lock held.
+DEFINE_SPINLOCK(mutating_shared_memory);
+
+// get_capability(struct s_task*, int64_t) -> capability_internal_t*
+// Returns the task's shared memory capability with the given handle, or null if there is none or it was revoked.
+static capability_internal_t* get_capability(struct s_task* task, int64_t handle) {
+    if (handle < 0 || handle >= TASK_MAX_CAPABILITIES)
+        return NULL;
+
+    capability_internal_t* cap = &task->capabilities[handle];
+    if (cap->type != CAPABILITY_INTERNAL_TYPE_SHARED_MEMORY || cap->data.shared_memory.revoked)
+        return NULL;
+    return cap;
+}
+
+// push_shared_memory_capability(struct s_task*, capability_internal_t) -> int64_t
+// Puts a capability in the task's first free entry, taking a reference to its memory. Returns its handle, or -1 if the task has no free entries.
+static int64_t push_shared_memory_capability(struct s_task* task, capability_internal_t cap) {
+    for (int64_t i = 0; i < TASK_MAX_CAPABILITIES; i++) {
+        if (task->capabilities[i].type == CAPABILITY_INTERNAL_TYPE_NIL) {
+            task->capabilities[i] = cap;
+            cap.data.shared_memory.memory->refs++;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// put_shared_memory(struct shared_memory*) -> void
+// Drops a reference to shared memory, freeing it once no capability refers to it. Frames still mapped somewhere stay until they're unmapped.
+static void put_shared_memory(struct shared_memory* memory) {
+    if (--memory->refs != 0)
+        return;
+
+    for (size_t i = 0; i < memory->page_count; i++) {
+        dealloc_pages(memory->frames[i], 1);
+    }
+    free(memory->frames);
+    free(memory);
+}
+
+// capability_flags(capability_internal_t*) -> int
+// Returns the flags the capability's memory is mapped with.
+static int capability_flags(capability_internal_t* cap) {
+    int flags = MMU_BIT_USER;
+    if (cap->data.shared_memory.read)
+        flags |= MMU_BIT_READ;
+    if (cap->data.shared_memory.write)
+        flags |= MMU_BIT_WRITE;
+    return flags;
+}
+
+// unmap_capability(struct s_task*, capability_internal_t*) -> void
+// Removes the capability's mapping from the task, which must be switched out or running on this hart. Other harts that ran the task flush it before running it again.
+static void unmap_capability(struct s_task* task, capability_internal_t* cap) {
+    if (cap->data.shared_memory.mapped == NULL)
+        return;
+
+    mmu_remove_range(task->mmu_data, cap->data.shared_memory.mapped, cap->data.shared_memory.memory->page_count, true);
+    mmu_flush_elsewhere(&task->mmu_data);
+    cap->data.shared_memory.mapped = NULL;
+}
+
+// drop_capability(struct s_task*, capability_internal_t*) -> void
+// Unmaps a capability and frees its entry.
+static void drop_capability(struct s_task* task, capability_internal_t* cap) {
+    unmap_capability(task, cap);
+    put_shared_memory(cap->data.shared_memory.memory);
+    *cap = (capability_internal_t) { 0 };
+}
+
+// create_shared_memory(struct s_task*, size_t) -> int64_t
+// Allocates page_count zeroed pages of shared memory and gives the task an owner capability for them with both rights. Returns the capability's handle, or -1 on failure.
+int64_t create_shared_memory(struct s_task* task, size_t page_count) {
+    if (page_count == 0 || page_count > (size_t) (MMU_USER_TOP - task->last_virtual_page) / PAGE_SIZE)
+        return -1;
+
+    struct shared_memory* memory = malloc(sizeof(struct shared_memory));
+    void** frames = malloc(page_count * sizeof(void*));
+    if (memory == NULL || frames == NULL) {
+        free(memory);
+        free(frames);
+        return -1;
+    }
+
+    // Frames are allocated one at a time, since the memory doesn't need to be physically contiguous
+    for (size_t i = 0; i < page_count; i++) {
+        frames[i] = alloc_pages(1);
+        if (frames[i] == NULL) {
+            for (size_t j = 0; j < i; j++) {
+                dealloc_pages(frames[j], 1);
+            }
+            free(memory);
+            free(frames);
+            return -1;
+        }
+    }
+
+    *memory = (struct shared_memory) {
+        .refs = 0,
+        .page_count = page_count,
+        .frames = frames,
+    };
+
+    capability_internal_t cap = {
+        .name = "shared memory",
+        .type = CAPABILITY_INTERNAL_TYPE_SHARED_MEMORY,
+        .data.shared_memory = {
+            .memory = memory,
+            .mapped = NULL,
+            .read = 1,
+            .write = 1,
+            .owner = 1,
+        },
+    };
+
+    spin_lock(&mutating_shared_memory);
+    int64_t handle = push_shared_memory_capability(task, cap);
+    spin_unlock(&mutating_shared_memory);
+
+    if (handle < 0) {
+        memory->refs = 1;
+        put_shared_memory(memory);
+    }
+    return handle;
+}
+
+// map_shared_memory(struct s_task*, int64_t) -> void*
+// Maps the shared memory of a capability into the task with the capability's rights. Returns where it was mapped, or NULL on failure or if it already is.
+void* map_shared_memory(struct s_task* task, int64_t handle) {
+    spin_lock(&mutating_shared_memory);
+    capability_internal_t* cap = get_capability(task, handle);
+    if (cap == NULL || cap->data.shared_memory.mapped != NULL) {
+        spin_unlock(&mutating_shared_memory);
+        return NULL;
+    }
+
+    struct shared_memory* memory = cap->data.shared_memory.memory;
+    void* start = task->last_virtual_page;
+    if (memory->page_count > (size_t) (MMU_USER_TOP - start) / PAGE_SIZE || !mmu_user_range(start, memory->page_count * PAGE_SIZE)) {
+        spin_unlock(&mutating_shared_memory);
+        return NULL;
+    }
+
+    // Every mapping holds a reference to each frame, so the frames outlive the memory while they're mapped
+    int flags = capability_flags(cap);
+    for (size_t i = 0; i < memory->page_count; i++) {
+        if (mmu_map(task->mmu_data, start + i * PAGE_SIZE, memory->frames[i], flags)) {
+            mmu_remove_range(task->mmu_data, start, i, true);
+            spin_unlock(&mutating_shared_memory);
+            return NULL;
+        }
+        incr_page_ref_count(memory->frames[i], 1);
+    }
+
+    task->last_virtual_page += memory->page_count * PAGE_SIZE;
+    cap->data.shared_memory.mapped = start;
+    spin_unlock(&mutating_shared_memory);
+    return start;
+}
+
+// unmap_shared_memory(struct s_task*, int64_t) -> int
+// Unmaps the shared memory of a capability from the task, which keeps the capability. Returns 0 if successful and -1 if not.
+int unmap_shared_memory(struct s_task* task, int64_t handle) {
+    spin_lock(&mutating_shared_memory);
+    capability_internal_t* cap = get_capability(task, handle);
+    if (cap == NULL || cap->data.shared_memory.mapped == NULL) {
+        spin_unlock(&mutating_shared_memory);
+        return -1;
+    }
+
+    unmap_capability(task, cap);
+    spin_unlock(&mutating_shared_memory);
+    return 0;
+}
+
+// grant_shared_memory(struct s_task*, int64_t, pid_t, int) -> int64_t
+// Gives another task a capability for the same shared memory with at most the rights of the task's own. Returns the handle of the new capability in the other task, or -1 on failure.
+int64_t grant_shared_memory(struct s_task* task, int64_t handle, pid_t pid, int rights) {
+    struct s_task* target = get_task(pid);
+    // Tasks still being created get their capabilities from whoever creates them
+    if (target == NULL || target->state == TASK_STATE_DEAD || target->state == TASK_STATE_CREATING)
+        return -1;
+
+    spin_lock(&mutating_shared_memory);
+    capability_internal_t* cap = get_capability(task, handle);
+    if (cap == NULL || !(rights & SHARED_MEMORY_READ)
+        || ((rights & SHARED_MEMORY_READ) && !cap->data.shared_memory.read)
+        || ((rights & SHARED_MEMORY_WRITE) && !cap->data.shared_memory.write)) {
+        spin_unlock(&mutating_shared_memory);
+        return -1;
+    }
+
+    capability_internal_t granted = {
+        .name = "shared memory",
+        .type = CAPABILITY_INTERNAL_TYPE_SHARED_MEMORY,
+        .data.shared_memory = {
+            .memory = cap->data.shared_memory.memory,
+            .mapped = NULL,
+            .read = (rights & SHARED_MEMORY_READ) != 0,
+            .write = (rights & SHARED_MEMORY_WRITE) != 0,
+        },
+    };
+    int64_t result = push_shared_memory_capability(target, granted);
+    spin_unlock(&mutating_shared_memory);
+    return result;
+}
+
+// revoke_shared_memory(struct s_task*, int64_t) -> int
+// Takes every capability for the shared memory apart from the owner's back, unmapping it wherever it is mapped. Tasks running on other harts lose it at their next switch. Returns 0 if successful and -1 if the handle isn't an owner capability.
+int revoke_shared_memory(struct s_task* task, int64_t handle) {
+    spin_lock(&mutating_shared_memory);
+    capability_internal_t* owner = get_capability(task, handle);
+    if (owner == NULL || !owner->data.shared_memory.owner) {
+        spin_unlock(&mutating_shared_memory);
+        return -1;
+    }
+
+    struct shared_memory* memory = owner->data.shared_memory.memory;
+    struct s_task* holder;
+    // Dead tasks hold no capabilities, and clones still being created hold their memory lock, so theirs are only marked
+    for (pid_t pid = 0; (holder = get_task(pid)) != NULL; pid++) {
+        // The calling task runs on this hart and already holds its own memory lock
+        bool locked = holder == task || spin_try_lock(&holder->memory_lock);
+        for (size_t i = 0; i < TASK_MAX_CAPABILITIES; i++) {
+            capability_internal_t* cap = &holder->capabilities[i];
+            if (cap == owner || cap->type != CAPABILITY_INTERNAL_TYPE_SHARED_MEMORY || cap->data.shared_memory.memory != memory)
+                continue;
+
+            if (locked) {
+                drop_capability(holder, cap);
+            } else {
+                cap->data.shared_memory.revoked = 1;
+                holder->shared_memory_revoked = true;
+            }
+        }
+        if (locked && holder != task)
+            spin_unlock(&holder->memory_lock);
+    }
+
+    spin_unlock(&mutating_shared_memory);
+    return 0;
+}
+
+// shared_memory_info(struct s_task*, int64_t, size_t*) -> int
+// Stores the page count of a capability's shared memory and returns its rights, or returns -1 if the handle isn't a shared memory capability.
+int shared_memory_info(struct s_task* task, int64_t handle, size_t* page_count) {
+    spin_lock(&mutating_shared_memory);
+    capability_internal_t* cap = get_capability(task, handle);
+    if (cap == NULL) {
+        spin_unlock(&mutating_shared_memory);
+        return -1;
+    }
+
+    *page_count = cap->data.shared_memory.memory->page_count;
+    int rights = (cap->data.shared_memory.read ? SHARED_MEMORY_READ : 0) | (cap->data.shared_memory.write ? SHARED_MEMORY_WRITE : 0);
+    spin_unlock(&mutating_shared_memory);
+    return rights;
+}
+
+// task_range_shared(struct s_task*, void*, size_t) -> bool
+// Returns true if any page in the range belongs to mapped shared memory.
+bool task_range_shared(struct s_task* task, void* start, size_t page_count) {
+    void* end = start + page_count * PAGE_SIZE;
+    bool shared = false;
+
+    spin_lock(&mutating_shared_memory);
+    for (size_t i = 0; i < TASK_MAX_CAPABILITIES && !shared; i++) {
+        capability_internal_t* cap = &task->capabilities[i];
+        if (cap->type != CAPABILITY_INTERNAL_TYPE_SHARED_MEMORY || cap->data.shared_memory.mapped == NULL)
+            continue;
+
+        void* mapped = cap->data.shared_memory.mapped;
+        void* mapped_end = mapped + cap->data.shared_memory.memory->page_count * PAGE_SIZE;
+        shared = mapped < end && start < mapped_end;
+    }
+    spin_unlock(&mutating_shared_memory);
+    return shared;
+}
+
+// clone_shared_memory(struct s_task*, struct s_task*) -> void
+// Gives a task cloned from another copies of its shared memory capabilities, and makes the mappings mmu_clone_user turned copy on write writable again in both.
+void clone_shared_memory(struct s_task* parent, struct s_task* child) {
+    spin_lock(&mutating_shared_memory);
+    for (size_t i = 0; i < TASK_MAX_CAPABILITIES; i++) {
+        capability_internal_t* cap = &parent->capabilities[i];
+        child->capabilities[i] = (capability_internal_t) { 0 };
+        if (cap->type != CAPABILITY_INTERNAL_TYPE_SHARED_MEMORY)
+            continue;
+
+        // A revoked mapping was copied into the child too, but the child has never run and can drop it right away
+        if (cap->data.shared_memory.revoked) {
+            if (cap->data.shared_memory.mapped != NULL)
+                mmu_remove_range(child->mmu_data, cap->data.shared_memory.mapped, cap->data.shared_memory.memory->page_count, true);
+            continue;
+        }
+
+        // Only the creator's own capability can revoke the others
+        child->capabilities[i] = *cap;
+        child->capabilities[i].data.shared_memory.owner = 0;
+        cap->data.shared_memory.memory->refs++;
+
+        if (cap->data.shared_memory.mapped != NULL && cap->data.shared_memory.write) {
+            mmu_share_writable(parent->mmu_data, cap->data.shared_memory.mapped, cap->data.shared_memory.memory->page_count);
+            mmu_share_writable(child->mmu_data, cap->data.shared_memory.mapped, cap->data.shared_memory.memory->page_count);
+        }
+    }
+    child->shared_memory_revoked = false;
+    spin_unlock(&mutating_shared_memory);
+}
+
+// release_revoked_shared_memory(struct s_task*) -> void
+// Unmaps and drops the capabilities revoked while the task was running. The task must be switched out or running on this hart.
+void release_revoked_shared_memory(struct s_task* task) {
+    if (!atomic_exchange(&task->shared_memory_revoked, false))
+        return;
+
+    spin_lock(&mutating_shared_memory);
+    for (size_t i = 0; i < TASK_MAX_CAPABILITIES; i++) {
+        capability_internal_t* cap = &task->capabilities[i];
+        if (cap->type == CAPABILITY_INTERNAL_TYPE_SHARED_MEMORY && cap->data.shared_memory.revoked)
+            drop_capability(task, cap);
+    }
+    spin_unlock(&mutating_shared_memory);
+}
+
+// release_shared_memory(struct s_task*) -> void
+// Drops every shared memory capability of a dead task. Its mappings go with its address space.
+void release_shared_memory(struct s_task* task) {
+    spin_lock(&mutating_shared_memory);
+    for (size_t i = 0; i < TASK_MAX_CAPABILITIES; i++) {
+        capability_internal_t* cap = &task->capabilities[i];
+        if (cap->type == CAPABILITY_INTERNAL_TYPE_SHARED_MEMORY)
+            put_shared_memory(cap->data.shared_memory.memory);
+        *cap = (capability_internal_t) { 0 };
+    }
+    task->shared_memory_revoked = false;
+    spin_unlock(&mutating_shared_memory);
+}
@@ -0,0 +1,63 @@
+#ifndef SHARED_MEMORY_H
+#define SHARED_MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "process.h"
+
+// Rights of a shared memory capability, with the same values as page permissions
+#define SHARED_MEMORY_READ  4
+#define SHARED_MEMORY_WRITE 2
+
+struct shared_memory {
+    // Capabilities referring to the memory, across every task
+    size_t refs;
+
+    // One physical frame per page, each holding a reference for the memory itself. Mappings take references of their own
+    size_t page_count;
+    void** frames;
+};
+
+// create_shared_memory(struct s_task*, size_t) -> int64_t
+// Allocates page_count zeroed pages of shared memory and gives the task an owner capability for them with both rights. Returns the capability's handle, or -1 on failure.
+int64_t create_shared_memory(struct s_task* task, size_t page_count);
+
+// map_shared_memory(struct s_task*, int64_t) -> void*
+// Maps the shared memory of a capability into the task with the capability's rights. Returns where it was mapped, or NULL on failure or if it already is.
+void* map_shared_memory(struct s_task* task, int64_t handle);
+
+// unmap_shared_memory(struct s_task*, int64_t) -> int
+// Unmaps the shared memory of a capability from the task, which keeps the capability. Returns 0 if successful and -1 if not.
+int unmap_shared_memory(struct s_task* task, int64_t handle);
+
+// grant_shared_memory(struct s_task*, int64_t, pid_t, int) -> int64_t
+// Gives another task a capability for the same shared memory with at most the rights of the task's own. Pages can't be writable without being readable, so the rights must include reading. Returns the handle of the new capability in the other task, or -1 on failure.
+int64_t grant_shared_memory(struct s_task* task, int64_t handle, pid_t pid, int rights);
+
+// revoke_shared_memory(struct s_task*, int64_t) -> int
+// Takes every capability for the shared memory apart from the owner's back, unmapping it wherever it is mapped. Tasks running on other harts lose it at their next switch. Returns 0 if successful and -1 if the handle isn't an owner capability.
+int revoke_shared_memory(struct s_task* task, int64_t handle);
+
+// shared_memory_info(struct s_task*, int64_t, size_t*) -> int
+// Stores the page count of a capability's shared memory and returns its rights, or returns -1 if the handle isn't a shared memory capability.
+int shared_memory_info(struct s_task* task, int64_t handle, size_t* page_count);
+
+// task_range_shared(struct s_task*, void*, size_t) -> bool
+// Returns true if any page in the range belongs to mapped shared memory.
+bool task_range_shared(struct s_task* task, void* start, size_t page_count);
+
+// clone_shared_memory(struct s_task*, struct s_task*) -> void
+// Gives a task cloned from another copies of its shared memory capabilities, and makes the mappings mmu_clone_user turned copy on write writable again in both.
+void clone_shared_memory(struct s_task* parent, struct s_task* child);
+
+// release_revoked_shared_memory(struct s_task*) -> void
+// Unmaps and drops the capabilities revoked while the task was running. The task must be switched out or running on this hart.
+void release_revoked_shared_memory(struct s_task* task);
+
+// release_shared_memory(struct s_task*) -> void
+// Drops every shared memory capability of a dead task. Its mappings go with its address space.
+void release_shared_memory(struct s_task* task);
+
+#endif /* SHARED_MEMORY_H */
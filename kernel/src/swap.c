@@ -0,0 +1,385 @@
+#include "console.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "mmu.h"
+#include "process.h"
+#include "swap.h"
+#include "sync.h"
+#include "virtio_blk.h"
+
+// Anonymous pages are swapped out to the first GPT partition on the virtio
+// block device with the Linux swap partition type. The partition is split
+// into page sized slots, each with a reference count; a swap entry (an
+// invalid leaf marked with MMU_BIT_SWAPPED) holds one reference to its slot.
+//
+// Pages are reclaimed by a clock that runs as the last shrinker, once the
+// kernel caches have nothing left to give. The hand is a task and an address
+// in it. Each step clears the accessed bit of the pages used since the hand
+// last passed them and writes out the first run of up to SWAP_CLUSTER_PAGES
+// neighbouring pages that weren't, to consecutive slots. A fault on any of
+// them reads back the neighbours that still sit in consecutive slots with it.
+//
+// A task's pages are only reclaimed while it isn't running, which is what
+// its memory_lock guarantees, or from the hart it is running on.
+#define SECTORS_PER_SLOT (PAGE_SIZE / VIRTIO_BLK_SECTOR_SIZE)
+
+// The hand moves around every task at most this many times per call, which is enough to clear every accessed bit and come back for the pages
+#define SWAP_RECLAIM_TURNS 3
+
+// Reclaiming writes at least this many pages once it has started, so the next allocations don't go straight back to it
+#define SWAP_RECLAIM_MIN 32
+
+#define GPT_HEADER_LBA 1
+#define GPT_SIGNATURE  0x5452415020494645
+
+// 0657FD6D-A4AB-43C4-84E5-0933C84B4F4F as it is stored on disk
+static uint8_t gpt_swap_type[16] = {
+    0x6d, 0xfd, 0x57, 0x06, 0xab, 0xa4, 0xc4, 0x43,
+    0x84, 0xe5, 0x09, 0x33, 0xc8, 0x4b, 0x4f, 0x4f,
+};
+
+struct __attribute__((packed)) gpt_header {
+    uint64_t signature;
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc;
+    uint32_t reserved;
+    uint64_t current_lba;
+    uint64_t backup_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t entries_lba;
+    uint32_t entry_count;
+    uint32_t entry_size;
+    uint32_t entries_crc;
+};
+
+struct __attribute__((packed)) gpt_entry {
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba;
+    uint64_t attributes;
+};
+
+static uint64_t swap_start = 0;
+static size_t swap_slots = 0;
+static uint16_t* slot_refs = NULL;
+static size_t next_slot = 0;
+static struct swap_stats stats = { 0 };
+DEFINE_SPINLOCK(mutating_swap);
+DEFINE_SPINLOCK(using_swap_disk);
+
+static pid_t hand_pid = 0;
+static void* hand_addr = NULL;
+DEFINE_SPINLOCK(reclaiming);
+
+// find_swap_partition(uint64_t*, uint64_t*) -> bool
+// Reads the GPT of the block device and finds the first swap partition. Returns false if there is none.
+static bool find_swap_partition(uint64_t* first, uint64_t* last) {
+    void* buffer = alloc_pages(1);
+    if (buffer == NULL)
+        return false;
+
+    bool found = false;
+    struct gpt_header header = { 0 };
+    if (virtio_blk_transfer(false, GPT_HEADER_LBA, &buffer, 1))
+        header = *(struct gpt_header*) phys2safe(buffer);
+
+    if (header.signature == GPT_SIGNATURE && header.entry_size >= sizeof(struct gpt_entry)
+        && PAGE_SIZE % header.entry_size == 0) {
+        size_t per_page = PAGE_SIZE / header.entry_size;
+        for (size_t i = 0; i < header.entry_count && !found; i += per_page) {
+            uint64_t lba = header.entries_lba + i * header.entry_size / VIRTIO_BLK_SECTOR_SIZE;
+            if (!virtio_blk_transfer(false, lba, &buffer, 1))
+                break;
+
+            for (size_t j = 0; j < per_page && i + j < header.entry_count; j++) {
+                struct gpt_entry* entry = phys2safe(buffer + j * header.entry_size);
+                if (memeq(entry->type_guid, gpt_swap_type, sizeof(gpt_swap_type)) && entry->last_lba >= entry->first_lba) {
+                    *first = entry->first_lba;
+                    *last = entry->last_lba;
+                    found = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    dealloc_pages(buffer, 1);
+    return found;
+}
+
+// alloc_slots(size_t, size_t*, size_t*) -> bool
+// Finds up to wanted consecutive free slots, going on from where the last search ended, and takes a reference to each. Returns false if swap is full.
+static bool alloc_slots(size_t wanted, size_t* first, size_t* count) {
+    for (size_t searched = 0; searched < swap_slots;) {
+        size_t slot = (next_slot + searched) % swap_slots;
+        if (slot_refs[slot] != 0) {
+            searched++;
+            continue;
+        }
+
+        size_t length = 0;
+        while (length < wanted && slot + length < swap_slots && slot_refs[slot + length] == 0) {
+            slot_refs[slot + length] = 1;
+            length++;
+        }
+
+        *first = slot;
+        *count = length;
+        next_slot = (slot + length) % swap_slots;
+        stats.used += length;
+        return true;
+    }
+    return false;
+}
+
+// release_slot(size_t) -> void
+// Drops a reference to a slot. Must be called with mutating_swap held.
+static void release_slot(size_t slot) {
+    if (slot >= swap_slots || slot_refs[slot] == 0)
+        return;
+    if (--slot_refs[slot] == 0)
+        stats.used--;
+}
+
+// swap_slot_dup(size_t) -> void
+// Takes another reference to a swap slot, for a swap entry copied into another address space.
+void swap_slot_dup(size_t slot) {
+    spin_lock(&mutating_swap);
+    if (slot < swap_slots && slot_refs[slot] != 0 && slot_refs[slot] != UINT16_MAX)
+        slot_refs[slot]++;
+    spin_unlock(&mutating_swap);
+}
+
+// swap_slot_free(size_t) -> void
+// Drops a reference to a swap slot, freeing the slot once no swap entry holds it.
+void swap_slot_free(size_t slot) {
+    spin_lock(&mutating_swap);
+    release_slot(slot);
+    spin_unlock(&mutating_swap);
+}
+
+// swap_out_run(struct mmu_entry*, size_t, bool*) -> size_t
+// Writes out a run of neighbouring leaves to consecutive slots and turns them into swap entries. Sets stop if swap is full or busy. Returns the number of pages freed.
+static size_t swap_out_run(struct mmu_entry* run, size_t length, bool* stop) {
+    // The allocator may be entered with other locks held, so nothing is waited for here
+    if (!spin_try_lock(&mutating_swap)) {
+        *stop = true;
+        return 0;
+    }
+    size_t first;
+    bool allocated = alloc_slots(length, &first, &length);
+    spin_unlock(&mutating_swap);
+    if (!allocated) {
+        *stop = true;
+        return 0;
+    }
+
+    void* frames[SWAP_CLUSTER_PAGES];
+    for (size_t i = 0; i < length; i++) {
+        frames[i] = safe2phys(mmu_entry_phys(run[i]));
+    }
+
+    bool written = spin_try_lock(&using_swap_disk);
+    if (written) {
+        written = virtio_blk_transfer(true, swap_start + first * SECTORS_PER_SLOT, frames, length);
+        spin_unlock(&using_swap_disk);
+    }
+
+    if (!written) {
+        spin_lock(&mutating_swap);
+        for (size_t i = 0; i < length; i++) {
+            release_slot(first + i);
+        }
+        spin_unlock(&mutating_swap);
+        *stop = true;
+        return 0;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        dealloc_pages(mmu_entry_swap_out(&run[i], first + i), 1);
+    }
+    stats.swapped_out += length;
+    return length;
+}
+
+// reclaim_task(struct s_task*, bool, size_t, bool*) -> size_t
+// Moves the hand through a task's pages until the given number of pages is freed or the hand reaches the end of the task. Sets stop if swapping can't go on. Returns the number of pages freed.
+static size_t reclaim_task(struct s_task* task, bool running_here, size_t wanted, bool* stop) {
+    size_t freed = 0;
+    while (freed < wanted && !*stop) {
+        struct mmu_entry* run;
+        size_t length = mmu_reclaim_scan(task->mmu_data, &hand_addr, &run, SWAP_CLUSTER_PAGES);
+        if (length == 0)
+            break;
+        freed += swap_out_run(run, length, stop);
+    }
+
+    // Accessed bits were cleared even if nothing was written out
+    if (running_here)
+        mmu_flush_asid(task->mmu_data);
+    else
+        mmu_flush_elsewhere(&task->mmu_data);
+    return freed;
+}
+
+// reclaim_swap(size_t) -> size_t
+// Shrinker that writes out pages not accessed since the clock hand last passed them. Returns the number of pages freed.
+static size_t reclaim_swap(size_t count) {
+    if (!spin_try_lock(&reclaiming))
+        return 0;
+
+    trap_t* trap;
+    asm volatile("csrr %0, sscratch" : "=r" (trap));
+    pid_t current = trap->pid;
+
+    if (count < SWAP_RECLAIM_MIN)
+        count = SWAP_RECLAIM_MIN;
+
+    size_t freed = 0;
+    size_t turns = 0;
+    bool stop = false;
+    while (freed < count && turns < SWAP_RECLAIM_TURNS && !stop) {
+        struct s_task* task = get_task(hand_pid);
+        if (task == NULL) {
+            hand_pid = 0;
+            hand_addr = NULL;
+            turns++;
+            continue;
+        }
+
+        // The task running on this hart is already held by it, and tasks running elsewhere are skipped
+        bool running_here = hand_pid == current;
+        if (task->state == TASK_STATE_DEAD || (!running_here && !spin_try_lock(&task->memory_lock))) {
+            hand_pid++;
+            hand_addr = NULL;
+            continue;
+        }
+
+        if (task->state != TASK_STATE_DEAD && mmu_root_valid(task->mmu_data))
+            freed += reclaim_task(task, running_here, count - freed, &stop);
+        if (!running_here)
+            spin_unlock(&task->memory_lock);
+
+        // The hand stays in the middle of a task it took enough pages from
+        if (hand_addr == NULL)
+            hand_pid++;
+    }
+
+    spin_unlock(&reclaiming);
+    return freed;
+}
+
+// swap_in(struct mmu_root, void*, bool) -> bool
+// Reads the page at the given address back from swap, along with neighbouring pages that were swapped out with it. The page is marked accessed, and dirty for writes. Returns false if the page isn't in swap or it can't be read back.
+bool swap_in(struct mmu_root root, void* page, bool write) {
+    page = (void*) ((intptr_t) page & ~(PAGE_SIZE - 1));
+    struct mmu_entry* entry = mmu_walk_to_swapped(root, page);
+    if (entry == NULL)
+        return false;
+
+    // Read ahead the naturally aligned cluster around the page, as far as its entries are in swap in consecutive slots. Clusters never cross a leaf table
+    size_t slot = mmu_entry_swap_slot(*entry);
+    size_t index = ((intptr_t) page / PAGE_SIZE) % SWAP_CLUSTER_PAGES;
+    struct mmu_entry* window = entry - index;
+    size_t window_slot = slot - index;
+    size_t start = index;
+    size_t end = index + 1;
+    while (start > 0 && mmu_entry_swapped(window[start - 1]) && mmu_entry_swap_slot(window[start - 1]) == window_slot + start - 1)
+        start--;
+    while (end < SWAP_CLUSTER_PAGES && mmu_entry_swapped(window[end]) && mmu_entry_swap_slot(window[end]) == window_slot + end)
+        end++;
+
+    // Only the faulting page has to get a frame; the cluster shrinks to it otherwise
+    void* frames[SWAP_CLUSTER_PAGES];
+    size_t allocated = 0;
+    for (; allocated < end - start; allocated++) {
+        frames[allocated] = alloc_pages_nozero(1);
+        if (frames[allocated] == NULL)
+            break;
+    }
+    if (allocated < end - start) {
+        for (size_t i = 0; i < allocated; i++) {
+            dealloc_pages(frames[i], 1);
+        }
+        frames[0] = alloc_pages_nozero(1);
+        if (frames[0] == NULL)
+            return false;
+        start = index;
+        end = index + 1;
+    }
+
+    spin_lock(&using_swap_disk);
+    bool read = virtio_blk_transfer(false, swap_start + (window_slot + start) * SECTORS_PER_SLOT, frames, end - start);
+    spin_unlock(&using_swap_disk);
+    if (!read) {
+        for (size_t i = 0; i < end - start; i++) {
+            dealloc_pages(frames[i], 1);
+        }
+        console_printf("[swap_in] unable to read slot 0x%lx\n", slot);
+        return false;
+    }
+
+    // Pages read ahead start unaccessed, so they are the first to go again if they aren't used
+    int bits = MMU_BIT_ACCESSED | (write ? MMU_BIT_DIRTY : 0);
+    spin_lock(&mutating_swap);
+    for (size_t i = start; i < end; i++) {
+        release_slot(mmu_entry_swap_in(&window[i], frames[i - start], i == index ? bits : 0));
+    }
+    stats.swapped_in++;
+    stats.read_ahead += end - start - 1;
+    spin_unlock(&mutating_swap);
+
+    void* window_page = page - index * PAGE_SIZE;
+    for (size_t i = start; i < end; i++) {
+        mmu_flush_page(root, window_page + i * PAGE_SIZE);
+    }
+    return true;
+}
+
+// init_swap(fdt_t*) -> void
+// Finds the swap partition on the virtio block device and registers the reclaimer with the page allocator. Swapping stays off if there is no such partition. Must be called after init_processes.
+void init_swap(fdt_t* tree) {
+    if (!init_virtio_blk(tree)) {
+        console_puts("[init_swap] no block device, swapping is off\n");
+        return;
+    }
+
+    uint64_t first;
+    uint64_t last;
+    if (virtio_blk_read_only() || virtio_blk_max_pages() < SWAP_CLUSTER_PAGES || !find_swap_partition(&first, &last)) {
+        console_puts("[init_swap] no usable swap partition, swapping is off\n");
+        return;
+    }
+
+    // Slots start on a page boundary of the disk
+    uint64_t start = (first + SECTORS_PER_SLOT - 1) / SECTORS_PER_SLOT * SECTORS_PER_SLOT;
+    size_t slots = last + 1 > start ? (last + 1 - start) / SECTORS_PER_SLOT : 0;
+    if (slots == 0 || (slot_refs = malloc(slots * sizeof(uint16_t))) == NULL) {
+        console_puts("[init_swap] swap partition is unusable, swapping is off\n");
+        return;
+    }
+
+    memset(slot_refs, 0, slots * sizeof(uint16_t));
+    swap_start = start;
+    swap_slots = slots;
+    stats.slots = slots;
+    register_shrinker(reclaim_swap);
+    console_printf("[init_swap] swapping to 0x%lx pages at sector 0x%lx\n", swap_slots, swap_start);
+}
+
+// get_swap_stats() -> struct swap_stats
+// Returns the swap counters.
+struct swap_stats get_swap_stats() {
+    return stats;
+}
+
+// debug_swap() -> void
+// Prints out the swap counters.
+void debug_swap() {
+    console_printf("[debug_swap] 0x%lx of 0x%lx slots used, 0x%lx pages out, 0x%lx faults in, 0x%lx pages read ahead\n",
+        stats.used, stats.slots, stats.swapped_out, stats.swapped_in, stats.read_ahead);
+}
@@ -0,0 +1,49 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fdt.h"
+#include "mmu.h"
+
+// Most neighbouring pages written out or read back by a single transfer
+#define SWAP_CLUSTER_PAGES 16
+
+struct swap_stats {
+    // Slots in the swap partition and slots holding a page
+    uint64_t slots;
+    uint64_t used;
+
+    // Pages written out, pages read back on a fault, and pages read back ahead of a fault
+    uint64_t swapped_out;
+    uint64_t swapped_in;
+    uint64_t read_ahead;
+};
+
+// init_swap(fdt_t*) -> void
+// Finds the swap partition on the virtio block device and registers the reclaimer with the page allocator. Swapping stays off if there is no such partition. Must be called after init_processes.
+void init_swap(fdt_t* tree);
+
+// swap_in(struct mmu_root, void*, bool) -> bool
+// Reads the page at the given address back from swap, along with neighbouring pages that were swapped out with it. The page is marked accessed, and dirty for writes. Returns false if the page isn't in swap or it can't be read back.
+bool swap_in(struct mmu_root root, void* page, bool write);
+
+// swap_slot_dup(size_t) -> void
+// Takes another reference to a swap slot, for a swap entry copied into another address space.
+void swap_slot_dup(size_t slot);
+
+// swap_slot_free(size_t) -> void
+// Drops a reference to a swap slot, freeing the slot once no swap entry holds it.
+void swap_slot_free(size_t slot);
+
+// get_swap_stats() -> struct swap_stats
+// Returns the swap counters.
+struct swap_stats get_swap_stats();
+
+// debug_swap() -> void
+// Prints out the swap counters.
+void debug_swap();
+
+#endif /* SWAP_H */
@@ -8,6 +8,11 @@ void spin_lock(spin_t *lock) {
         expected = false;
 }
 
+bool spin_try_lock(spin_t *lock) {
+    bool expected = false;
+    return atomic_compare_exchange_strong(lock, &expected, true);
+}
+
 void spin_unlock(spin_t *lock) {
     atomic_exchange(lock, false);
 }
@@ -2,6 +2,7 @@
 #define SYNC_H
 
 #include <stdatomic.h>
+#include <stdbool.h>
 
 typedef volatile atomic_bool spin_t;
 
@@ -10,6 +11,9 @@ typedef volatile atomic_bool spin_t;
 
 void spin_lock(spin_t *lock);
 
+// Returns true if the lock was acquired.
+bool spin_try_lock(spin_t *lock);
+
 void spin_unlock(spin_t *lock);
 
 #endif /* SYNC_H */
@@ -0,0 +1,96 @@
+.section .text
+
+.global copy_user
+.global strncpy_user
+
+# Every load or store here that touches user memory gets an entry in
+# .ex_table pairing its address with a fixup. If it faults and the fault
+# can't be resolved, kernel_exception_fixup resumes at the fixup instead.
+# sstatus.SUM is only set between user_access_on and user_access_off, so
+# any other kernel access to user memory still faults.
+.macro ex_table insn, fixup
+    .pushsection .ex_table, "a"
+    .balign 8
+    .dword \insn, \fixup
+    .popsection
+.endm
+
+# sstatus.SUM = 1
+.macro user_access_on
+    li t0, 0x40000
+    csrs sstatus, t0
+.endm
+
+# sstatus.SUM = 0
+.macro user_access_off
+    li t0, 0x40000
+    csrc sstatus, t0
+.endm
+
+# copy_user(void*, const void*, size_t) -> int
+# Copies n bytes between kernel and user memory, a doubleword at a time when
+# both addresses are aligned. Returns 0 on success and -1 on a fault. The
+# caller checks that the user side of the copy is user memory.
+copy_user:
+    user_access_on
+    or t1, a0, a1
+    andi t1, t1, 7
+    bnez t1, 2f
+    li t2, 8
+1:
+    bltu a2, t2, 2f
+3:
+    ld t3, 0(a1)
+4:
+    sd t3, 0(a0)
+    addi a0, a0, 8
+    addi a1, a1, 8
+    addi a2, a2, -8
+    j 1b
+2:
+    beqz a2, 7f
+5:
+    lbu t3, 0(a1)
+6:
+    sb t3, 0(a0)
+    addi a0, a0, 1
+    addi a1, a1, 1
+    addi a2, a2, -1
+    j 2b
+7:
+    user_access_off
+    li a0, 0
+    ret
+
+    ex_table 3b, copy_user_fault
+    ex_table 4b, copy_user_fault
+    ex_table 5b, copy_user_fault
+    ex_table 6b, copy_user_fault
+
+copy_user_fault:
+    user_access_off
+    li a0, -1
+    ret
+
+# strncpy_user(char*, const char*, size_t) -> int64_t
+# Copies a nul terminated string of at most n bytes, nul included, from user
+# memory. Returns its length, or n if it didn't fit, in which case the last
+# byte copied is replaced with a nul. Returns -1 on a fault. n must not be 0.
+strncpy_user:
+    user_access_on
+    li t1, 0
+1:
+    lbu t3, 0(a1)
+    add t2, a0, t1
+    sb t3, 0(t2)
+    beqz t3, 2f
+    addi a1, a1, 1
+    addi t1, t1, 1
+    bne t1, a2, 1b
+    sb zero, 0(t2)
+2:
+    user_access_off
+    mv a0, t1
+    ret
+
+    ex_table 1b, copy_user_fault
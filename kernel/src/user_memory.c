@@ -0,0 +1,54 @@
+#include "user_memory.h"
+
+struct exception_fixup {
+    uint64_t pc;
+    uint64_t fixup;
+};
+
+// Implemented in user_access.s
+extern int copy_user(void* dest, const void* src, size_t n);
+extern int64_t strncpy_user(char* dest, const char* src, size_t n);
+
+// copy_from_user(void*, const void __user*, size_t) -> int
+// Copies n bytes from the current task's memory. Returns 0 on success and -1 if the range isn't readable user memory.
+int copy_from_user(void* dest, const void __user* src, size_t n) {
+    if (!user_range_valid(src, n))
+        return -1;
+    return copy_user(dest, (const void*) src, n);
+}
+
+// copy_to_user(void __user*, const void*, size_t) -> int
+// Copies n bytes into the current task's memory. Returns 0 on success and -1 if the range isn't writable user memory.
+int copy_to_user(void __user* dest, const void* src, size_t n) {
+    if (!user_range_valid(dest, n))
+        return -1;
+    return copy_user((void*) dest, src, n);
+}
+
+// strncpy_from_user(char*, const char __user*, size_t) -> int64_t
+// Copies a nul terminated string of at most n bytes, nul included, from the current task's memory. Returns its length, n if it was cut short (dest is still terminated), or -1 if it isn't readable user memory.
+int64_t strncpy_from_user(char* dest, const char __user* src, size_t n) {
+    if (n == 0 || !user_range_valid(src, 1))
+        return -1;
+
+    // Strings running up to the end of user memory, or up to kernel memory, are cut short there
+    size_t limit = mmu_user_extent((const void*) src, n);
+    if (n <= limit)
+        return strncpy_user(dest, (const char*) src, n);
+
+    int64_t length = strncpy_user(dest, (const char*) src, limit);
+    return length == (int64_t) limit ? (int64_t) n : length;
+}
+
+// find_exception_fixup(uint64_t) -> uint64_t
+// Returns where to resume after a fault in the user memory access at the given address, or 0 if the address doesn't access user memory.
+uint64_t find_exception_fixup(uint64_t pc) {
+    extern struct exception_fixup ex_table_start;
+    extern struct exception_fixup ex_table_end;
+
+    for (struct exception_fixup* entry = &ex_table_start; entry < &ex_table_end; entry++) {
+        if (entry->pc == pc)
+            return entry->fixup;
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef USER_MEMORY_H
+#define USER_MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "memory.h"
+#include "mmu.h"
+
+// user_range_valid(const void __user*, size_t) -> bool
+// Returns true if the range lies below MMU_USER_TOP and outside the root slots shared with the kernel, which the kernel can reach without faulting. Past this check, the pages themselves are only checked by the access faulting.
+static inline bool user_range_valid(const void __user* addr, size_t n) {
+    return mmu_user_range((const void*) addr, n);
+}
+
+// copy_from_user(void*, const void __user*, size_t) -> int
+// Copies n bytes from the current task's memory. Returns 0 on success and -1 if the range isn't readable user memory.
+int copy_from_user(void* dest, const void __user* src, size_t n);
+
+// copy_to_user(void __user*, const void*, size_t) -> int
+// Copies n bytes into the current task's memory. Returns 0 on success and -1 if the range isn't writable user memory.
+int copy_to_user(void __user* dest, const void* src, size_t n);
+
+// strncpy_from_user(char*, const char __user*, size_t) -> int64_t
+// Copies a nul terminated string of at most n bytes, nul included, from the current task's memory. Returns its length, n if it was cut short (dest is still terminated), or -1 if it isn't readable user memory.
+int64_t strncpy_from_user(char* dest, const char __user* src, size_t n);
+
+// find_exception_fixup(uint64_t) -> uint64_t
+// Returns where to resume after a fault in the user memory access at the given address, or 0 if the address doesn't access user memory.
+uint64_t find_exception_fixup(uint64_t pc);
+
+#endif /* USER_MEMORY_H */
@@ -0,0 +1,262 @@
+#include "console.h"
+#include "memory.h"
+#include "mmu.h"
+#include "virtio_blk.h"
+
+// The block device is driven through the virtio-mmio transport (version 2)
+// with a single request queue, and requests are completed by polling: the
+// driver asks the device not to interrupt, submits one descriptor chain at a
+// time and spins on the used ring. The descriptor table, the available and
+// used rings and the request header all live in one page.
+#define VIRTIO_MMIO_MAGIC               0x000
+#define VIRTIO_MMIO_VERSION             0x004
+#define VIRTIO_MMIO_DEVICE_ID           0x008
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_READY         0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW    0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH   0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW    0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH   0x0a4
+#define VIRTIO_MMIO_CONFIG              0x100
+
+#define VIRTIO_MAGIC            0x74726976
+#define VIRTIO_DEVICE_BLOCK     2
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   1
+#define VIRTIO_STATUS_DRIVER        2
+#define VIRTIO_STATUS_DRIVER_OK     4
+#define VIRTIO_STATUS_FEATURES_OK   8
+
+// Feature bits, split into the 32 bit words the transport selects between
+#define VIRTIO_BLK_F_RO         (1 << 5)
+#define VIRTIO_F_VERSION_1      (1 << 0)
+
+#define VIRTQ_DESC_F_NEXT       1
+#define VIRTQ_DESC_F_WRITE      2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+
+#define VIRTIO_BLK_QUEUE_SIZE   32
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[VIRTIO_BLK_QUEUE_SIZE];
+    uint16_t used_event;
+};
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[VIRTIO_BLK_QUEUE_SIZE];
+    uint16_t avail_event;
+};
+
+struct virtio_blk_request {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+// Offsets into the queue page, each aligned as the virtio spec requires
+#define QUEUE_AVAIL_OFFSET      0x200
+#define QUEUE_USED_OFFSET       0x400
+#define QUEUE_REQUEST_OFFSET    0x800
+#define QUEUE_STATUS_OFFSET     0x810
+
+static volatile uint8_t* blk_base = NULL;
+static void* queue_page = NULL;
+static uint16_t queue_size = 0;
+static uint16_t last_used = 0;
+static uint64_t capacity = 0;
+static bool read_only = false;
+
+static inline uint32_t mmio_read(size_t offset) {
+    return *(volatile uint32_t*) (blk_base + offset);
+}
+
+static inline void mmio_write(size_t offset, uint32_t value) {
+    *(volatile uint32_t*) (blk_base + offset) = value;
+}
+
+// virtio_blk_probe(volatile uint8_t*) -> bool
+// Resets the device at the given registers and brings it up with a single polled request queue. Returns false if it isn't a version 2 block device or refuses the queue.
+static bool virtio_blk_probe(volatile uint8_t* base) {
+    blk_base = base;
+    if (mmio_read(VIRTIO_MMIO_MAGIC) != VIRTIO_MAGIC || mmio_read(VIRTIO_MMIO_DEVICE_ID) != VIRTIO_DEVICE_BLOCK)
+        return false;
+    if (mmio_read(VIRTIO_MMIO_VERSION) != 2) {
+        console_puts("[virtio_blk_probe] legacy virtio devices aren't supported\n");
+        return false;
+    }
+
+    mmio_write(VIRTIO_MMIO_STATUS, 0);
+    mmio_write(VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    mmio_write(VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    mmio_write(VIRTIO_MMIO_DEVICE_FEATURES_SEL, 0);
+    uint32_t features = mmio_read(VIRTIO_MMIO_DEVICE_FEATURES);
+    mmio_write(VIRTIO_MMIO_DEVICE_FEATURES_SEL, 1);
+    if (!(mmio_read(VIRTIO_MMIO_DEVICE_FEATURES) & VIRTIO_F_VERSION_1))
+        return false;
+
+    // Only the read only bit is taken, to learn whether writes will fail
+    mmio_write(VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+    mmio_write(VIRTIO_MMIO_DRIVER_FEATURES, features & VIRTIO_BLK_F_RO);
+    mmio_write(VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
+    mmio_write(VIRTIO_MMIO_DRIVER_FEATURES, VIRTIO_F_VERSION_1);
+    mmio_write(VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
+    if (!(mmio_read(VIRTIO_MMIO_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+        return false;
+
+    mmio_write(VIRTIO_MMIO_QUEUE_SEL, 0);
+    uint32_t max = mmio_read(VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if (max < 3)
+        return false;
+    queue_size = max < VIRTIO_BLK_QUEUE_SIZE ? max : VIRTIO_BLK_QUEUE_SIZE;
+
+    queue_page = alloc_pages(1);
+    if (queue_page == NULL)
+        return false;
+
+    struct virtq_avail* avail = phys2safe(queue_page + QUEUE_AVAIL_OFFSET);
+    avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+    uint64_t desc = (uint64_t) queue_page;
+    uint64_t driver = desc + QUEUE_AVAIL_OFFSET;
+    uint64_t device = desc + QUEUE_USED_OFFSET;
+    mmio_write(VIRTIO_MMIO_QUEUE_NUM, queue_size);
+    mmio_write(VIRTIO_MMIO_QUEUE_DESC_LOW, desc);
+    mmio_write(VIRTIO_MMIO_QUEUE_DESC_HIGH, desc >> 32);
+    mmio_write(VIRTIO_MMIO_QUEUE_DRIVER_LOW, driver);
+    mmio_write(VIRTIO_MMIO_QUEUE_DRIVER_HIGH, driver >> 32);
+    mmio_write(VIRTIO_MMIO_QUEUE_DEVICE_LOW, device);
+    mmio_write(VIRTIO_MMIO_QUEUE_DEVICE_HIGH, device >> 32);
+    mmio_write(VIRTIO_MMIO_QUEUE_READY, 1);
+    mmio_write(VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK | VIRTIO_STATUS_DRIVER_OK);
+
+    capacity = *(volatile uint64_t*) (blk_base + VIRTIO_MMIO_CONFIG);
+    read_only = (features & VIRTIO_BLK_F_RO) != 0;
+    return true;
+}
+
+// init_virtio_blk(fdt_t*) -> bool
+// Finds the first virtio block device in the device tree and sets up its request queue. Returns false if there is none or it can't be used.
+bool init_virtio_blk(fdt_t* tree) {
+    void* node = NULL;
+    while ((node = fdt_find(tree, "virtio_mmio", node))) {
+        // TODO: use #address-cells and #size-cells
+        struct fdt_property reg = fdt_get_property(tree, node, "reg");
+        if (reg.data == NULL)
+            continue;
+
+        if (virtio_blk_probe(phys2safe((void*) be_to_le(64, reg.data)))) {
+            console_printf("[init_virtio_blk] block device at %p with 0x%lx sectors%s\n", (void*) blk_base, capacity, read_only ? ", read only" : "");
+            return true;
+        }
+    }
+
+    blk_base = NULL;
+    return false;
+}
+
+// virtio_blk_capacity() -> uint64_t
+// Returns the size of the block device in sectors, or 0 if there is no device.
+uint64_t virtio_blk_capacity() {
+    return blk_base != NULL ? capacity : 0;
+}
+
+// virtio_blk_read_only() -> bool
+// Returns true if the device refuses writes.
+bool virtio_blk_read_only() {
+    return read_only;
+}
+
+// virtio_blk_max_pages() -> size_t
+// Returns the most pages a single transfer can move.
+size_t virtio_blk_max_pages() {
+    // Every request also takes a descriptor for its header and one for its status
+    return blk_base != NULL ? queue_size - 2 : 0;
+}
+
+// virtio_blk_transfer(bool, uint64_t, void**, size_t) -> bool
+// Reads or writes count pages starting at the given sector, one physical page frame per page, and waits for the device to finish. Callers serialise transfers themselves. Returns false if the device reports an error.
+bool virtio_blk_transfer(bool write, uint64_t sector, void** frames, size_t count) {
+    if (blk_base == NULL || count == 0 || count > virtio_blk_max_pages())
+        return false;
+    if (sector + count * (PAGE_SIZE / VIRTIO_BLK_SECTOR_SIZE) > capacity)
+        return false;
+
+    struct virtq_desc* desc = phys2safe(queue_page);
+    struct virtq_avail* avail = phys2safe(queue_page + QUEUE_AVAIL_OFFSET);
+    volatile struct virtq_used* used = phys2safe(queue_page + QUEUE_USED_OFFSET);
+    struct virtio_blk_request* request = phys2safe(queue_page + QUEUE_REQUEST_OFFSET);
+    volatile uint8_t* status = phys2safe(queue_page + QUEUE_STATUS_OFFSET);
+
+    *request = (struct virtio_blk_request) {
+        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+        .sector = sector,
+    };
+    *status = 0xff;
+
+    // The chain is always built from descriptor 0, since only one request is ever in flight
+    desc[0] = (struct virtq_desc) {
+        .addr = (uint64_t) queue_page + QUEUE_REQUEST_OFFSET,
+        .len = sizeof(struct virtio_blk_request),
+        .flags = VIRTQ_DESC_F_NEXT,
+        .next = 1,
+    };
+    for (size_t i = 0; i < count; i++) {
+        desc[i + 1] = (struct virtq_desc) {
+            .addr = (uint64_t) frames[i],
+            .len = PAGE_SIZE,
+            .flags = VIRTQ_DESC_F_NEXT | (write ? 0 : VIRTQ_DESC_F_WRITE),
+            .next = i + 2,
+        };
+    }
+    desc[count + 1] = (struct virtq_desc) {
+        .addr = (uint64_t) queue_page + QUEUE_STATUS_OFFSET,
+        .len = 1,
+        .flags = VIRTQ_DESC_F_WRITE,
+    };
+
+    avail->ring[avail->idx % queue_size] = 0;
+    asm volatile("fence" : : : "memory");
+    avail->idx++;
+    asm volatile("fence" : : : "memory");
+    mmio_write(VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+
+    while (used->idx == last_used);
+    asm volatile("fence" : : : "memory");
+    last_used++;
+
+    // The device may still raise an interrupt, which would otherwise stay pending at the PLIC
+    mmio_write(VIRTIO_MMIO_INTERRUPT_ACK, mmio_read(VIRTIO_MMIO_INTERRUPT_STATUS));
+    return *status == 0;
+}
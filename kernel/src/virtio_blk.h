@@ -0,0 +1,32 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fdt.h"
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+// init_virtio_blk(fdt_t*) -> bool
+// Finds the first virtio block device in the device tree and sets up its request queue. Returns false if there is none or it can't be used.
+bool init_virtio_blk(fdt_t* tree);
+
+// virtio_blk_capacity() -> uint64_t
+// Returns the size of the block device in sectors, or 0 if there is no device.
+uint64_t virtio_blk_capacity();
+
+// virtio_blk_read_only() -> bool
+// Returns true if the device refuses writes.
+bool virtio_blk_read_only();
+
+// virtio_blk_max_pages() -> size_t
+// Returns the most pages a single transfer can move.
+size_t virtio_blk_max_pages();
+
+// virtio_blk_transfer(bool, uint64_t, void**, size_t) -> bool
+// Reads or writes count pages starting at the given sector, one physical page frame per page, and waits for the device to finish. Callers serialise transfers themselves. Returns false if the device reports an error.
+bool virtio_blk_transfer(bool write, uint64_t sector, void** frames, size_t count);
+
+#endif /* VIRTIO_BLK_H */
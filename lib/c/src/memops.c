@@ -0,0 +1,151 @@
+#include <stdint.h>
+
+#include "memops.h"
+
+// These are shared by the kernel and the C library. Copies between buffers
+// with the same alignment modulo 8 move a word at a time after a byte head,
+// and copies between differently aligned buffers shift and merge aligned
+// source words. Sizes of MEMOPS_VECTOR_MIN bytes and up go to the RVV loops in
+// memops_vector.s once the kernel has seen the V extension in the device tree.
+#define WORD_SIZE           sizeof(uint64_t)
+#define WORD_MASK           (WORD_SIZE - 1)
+#define MEMOPS_VECTOR_MIN   256
+
+void* memops_vector_copy(void* dest, const void* src, unsigned long int n);
+void* memops_vector_set(void* p, int i, unsigned long int n);
+bool memops_vector_equal(void* p, void* q, size_t size);
+
+static bool use_vector = false;
+
+// memops_use_vector(bool) -> void
+// Selects the RVV versions of memcpy, memset and memeq for large sizes. Only the kernel can enable this, since it toggles sstatus.VS.
+void memops_use_vector(bool enable) {
+    use_vector = enable;
+}
+
+// memops_vector_enabled() -> bool
+// Returns true if the RVV versions of memcpy, memset and memeq are in use.
+bool memops_vector_enabled() {
+    return use_vector;
+}
+
+// memcpy(void*, const void*, unsigned long int) -> void*
+// Copys the data from one pointer to another.
+void* memcpy(void* dest, const void* src, unsigned long int n) {
+    if (use_vector && n >= MEMOPS_VECTOR_MIN)
+        return memops_vector_copy(dest, src, n);
+
+    unsigned char* d1 = dest;
+    const unsigned char* s1 = src;
+
+    if (n >= WORD_SIZE * 2) {
+        for (; ((uintptr_t) d1 & WORD_MASK) != 0; n--) {
+            *d1++ = *s1++;
+        }
+
+        uint64_t* d8 = (uint64_t*) d1;
+        size_t shift = ((uintptr_t) s1 & WORD_MASK) * 8;
+        if (shift == 0) {
+            const uint64_t* s8 = (const uint64_t*) s1;
+            for (; n >= WORD_SIZE * 4; n -= WORD_SIZE * 4, d8 += 4, s8 += 4) {
+                uint64_t a = s8[0];
+                uint64_t b = s8[1];
+                uint64_t c = s8[2];
+                uint64_t d = s8[3];
+                d8[0] = a;
+                d8[1] = b;
+                d8[2] = c;
+                d8[3] = d;
+            }
+            for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+                *d8++ = *s8++;
+            }
+            s1 = (const unsigned char*) s8;
+        } else {
+            // Only aligned words are loaded, and each one holds at least one byte of the source
+            const uint64_t* s8 = (const uint64_t*) ((uintptr_t) s1 & ~WORD_MASK);
+            uint64_t low = *s8++;
+            for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+                uint64_t high = *s8++;
+                *d8++ = (low >> shift) | (high << (64 - shift));
+                low = high;
+                s1 += WORD_SIZE;
+            }
+        }
+        d1 = (unsigned char*) d8;
+    }
+
+    for (; n > 0; n--) {
+        *d1++ = *s1++;
+    }
+
+    return dest;
+}
+
+// memset(void*, int, unsigned long int) -> void*
+// Sets a value over a space. Returns the original pointer.
+void* memset(void* p, int i, unsigned long int n) {
+    if (use_vector && n >= MEMOPS_VECTOR_MIN)
+        return memops_vector_set(p, i, n);
+
+    unsigned char c = i;
+    unsigned char* p1 = p;
+
+    if (n >= WORD_SIZE * 2) {
+        for (; ((uintptr_t) p1 & WORD_MASK) != 0; n--) {
+            *p1++ = c;
+        }
+
+        uint64_t word = (uint64_t) c * 0x0101010101010101;
+        uint64_t* p8 = (uint64_t*) p1;
+        for (; n >= WORD_SIZE * 4; n -= WORD_SIZE * 4, p8 += 4) {
+            p8[0] = word;
+            p8[1] = word;
+            p8[2] = word;
+            p8[3] = word;
+        }
+        for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+            *p8++ = word;
+        }
+        p1 = (unsigned char*) p8;
+    }
+
+    for (; n > 0; n--) {
+        *p1++ = c;
+    }
+
+    return p;
+}
+
+// memeq(void*, void*, size_t) -> bool
+// Returns true if the two pointers have identical data.
+bool memeq(void* p, void* q, size_t size) {
+    if (use_vector && size >= MEMOPS_VECTOR_MIN)
+        return memops_vector_equal(p, q, size);
+
+    uint8_t* p1 = p;
+    uint8_t* q1 = q;
+
+    if (size >= WORD_SIZE * 2 && (((uintptr_t) p1 ^ (uintptr_t) q1) & WORD_MASK) == 0) {
+        for (; ((uintptr_t) p1 & WORD_MASK) != 0; size--) {
+            if (*p1++ != *q1++)
+                return false;
+        }
+
+        uint64_t* p8 = (uint64_t*) p1;
+        uint64_t* q8 = (uint64_t*) q1;
+        for (; size >= WORD_SIZE; size -= WORD_SIZE) {
+            if (*p8++ != *q8++)
+                return false;
+        }
+        p1 = (uint8_t*) p8;
+        q1 = (uint8_t*) q8;
+    }
+
+    for (; size > 0; size--) {
+        if (*p1++ != *q1++)
+            return false;
+    }
+
+    return true;
+}
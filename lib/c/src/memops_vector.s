@@ -0,0 +1,89 @@
+.section .text
+
+.global memops_vector_copy
+.global memops_vector_set
+.global memops_vector_equal
+
+# RVV 1.0 loops for memops.c. They are only called after the kernel has
+# checked for the V extension, and they turn the vector unit on through
+# sstatus.VS for their own duration so user code never sees live vector state.
+# The vector instructions are emitted as words so the file assembles with
+# rv64gc toolchains:
+#   0x0c3672d7  vsetvli t0, a2, e8, m8, ta, ma
+#   0x02058007  vle8.v v0, (a1)
+#   0x02068027  vse8.v v0, (a3)
+#   0x5e05c057  vmv.v.x v0, a1
+#   0x02050007  vle8.v v0, (a0)
+#   0x02058407  vle8.v v8, (a1)
+#   0x66040857  vmsne.vv v16, v0, v8
+#   0x4308a357  vfirst.m t1, v16
+
+# sstatus.VS = Initial
+.macro vector_on
+    li t2, 0x200
+    csrs sstatus, t2
+.endm
+
+# sstatus.VS = Off
+.macro vector_off
+    li t2, 0x600
+    csrc sstatus, t2
+.endm
+
+# memops_vector_copy(void*, const void*, unsigned long int) -> void*
+# Copies n bytes with vector loads and stores. Returns dest.
+memops_vector_copy:
+    vector_on
+    mv a3, a0
+1:
+    .word 0x0c3672d7
+    .word 0x02058007
+    .word 0x02068027
+    sub a2, a2, t0
+    add a1, a1, t0
+    add a3, a3, t0
+    bnez a2, 1b
+    vector_off
+    ret
+
+# memops_vector_set(void*, int, unsigned long int) -> void*
+# Sets n bytes to the low byte of i with vector stores. Returns p.
+memops_vector_set:
+    vector_on
+    mv a3, a0
+    andi a1, a1, 0xff
+    .word 0x0c3672d7
+    .word 0x5e05c057
+1:
+    .word 0x0c3672d7
+    .word 0x02068027
+    sub a2, a2, t0
+    add a3, a3, t0
+    bnez a2, 1b
+    vector_off
+    ret
+
+# memops_vector_equal(void*, void*, size_t) -> bool
+# Compares n bytes with vector loads, stopping at the first difference.
+memops_vector_equal:
+    vector_on
+1:
+    beqz a2, 2f
+    .word 0x0c3672d7
+    .word 0x02050007
+    .word 0x02058407
+    .word 0x66040857
+    .word 0x4308a357
+    bgez t1, 3f
+    sub a2, a2, t0
+    add a0, a0, t0
+    add a1, a1, t0
+    j 1b
+2:
+    vector_off
+    li a0, 1
+    ret
+3:
+    vector_off
+    li a0, 0
+    ret
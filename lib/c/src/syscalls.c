@@ -11,23 +11,23 @@ void uart_puts(char* msg) {
     syscall(0, (uint64_t) msg, 0, 0, 0, 0, 0);
 }
 
-// // page_alloc(size_t page_count, int permissions) -> void*
-// // Allocates a page with the given permissions.
-// void* page_alloc(size_t page_count, int permissions) {
-//     return (void*) syscall(1, page_count, permissions, 0, 0, 0, 0);
-// }
+// page_alloc(size_t page_count, int permissions) -> void*
+// Allocates a page with the given permissions.
+void* page_alloc(size_t page_count, int permissions) {
+    return (void*) syscall(1, page_count, permissions, 0, 0, 0, 0);
+}
 
-// // page_perms(void* page, size_t page_count, int permissions) -> int
-// // Changes the page's permissions. Returns 0 if successful and 1 if not.
-// int page_perms(void* page, size_t page_count, int permissions) {
-//     return syscall(2, (intptr_t) page, page_count, permissions, 0, 0, 0);
-// }
+// page_perms(void* page, size_t page_count, int permissions) -> int
+// Changes the page's permissions. Returns 0 if successful and 1 if not.
+int page_perms(void* page, size_t page_count, int permissions) {
+    return syscall(2, (intptr_t) page, page_count, permissions, 0, 0, 0);
+}
 
-// // page_dealloc(void* page, size_t page_count) -> int
-// // Deallocates a page. Returns 0 if successful and 1 if not.
-// int page_dealloc(void* page, size_t page_count) {
-//     return syscall(3, (intptr_t) page,page_count, 0, 0, 0, 0);
-// }
+// page_dealloc(void* page, size_t page_count) -> int
+// Deallocates a page. Returns 0 if successful and 1 if not.
+int page_dealloc(void* page, size_t page_count) {
+    return syscall(3, (intptr_t) page,page_count, 0, 0, 0, 0);
+}
 
 // // sleep(uint64_t seconds, uint64_t micros) -> void
 // // Sleeps for the given amount of time.
@@ -47,13 +47,13 @@ void uart_puts(char* msg) {
 //     return syscall(6, (intptr_t) func, (intptr_t) data, 0, 0, 0, 0);
 // }
 
-// // exit(int64_t code) -> !
-// // Exits the current process.
-// __attribute__((noreturn))
-// void exit(int64_t code) {
-//     syscall(7, code, 0, 0, 0, 0, 0);
-//     while(1);
-// }
+// exit(int64_t code) -> !
+// Exits the current process.
+__attribute__((noreturn))
+void exit(int64_t code) {
+    syscall(7, code, 0, 0, 0, 0, 0);
+    while(1);
+}
 
 // // set_fault_handler(void (*handler)(int cause, uint64_t pc, uint64_t sp, uint64_t fp)) -> void
 // // Sets the fault handler for the current process.
@@ -93,3 +93,75 @@ void uart_puts(char* msg) {
 // int capability_data(size_t* index, char* name, uint64_t* data_top, uint64_t* data_bot) {
 //     return syscall(10, (intptr_t) index, (intptr_t) name, (intptr_t) data_top, (intptr_t) data_bot, 0, 0);
 // }
+
+// clone() -> int64_t
+// Creates a copy of the current process that shares its memory copy on write. Returns the pid of the copy in the original, 0 in the copy and -1 on failure.
+int64_t clone() {
+    return syscall(11, 0, 0, 0, 0, 0, 0);
+}
+
+// working_set(int64_t pid, struct working_set_stats* stats) -> int
+// Gets the working set stats of a task, or of the current task if pid is -1. The stats are sampled from the accessed and dirty bits of its pages while it runs. Returns 0 if successful and -1 if not.
+int working_set(int64_t pid, struct working_set_stats* stats) {
+    return syscall(12, pid, (intptr_t) stats, 0, 0, 0, 0);
+}
+
+// map_file(char* name, size_t offset, size_t page_count, int permissions) -> void*
+// Maps page_count pages of a file in the initrd, starting at the page aligned offset, with the given permissions. Pages are only read in once touched. Read only pages share memory with the initrd, and writable pages are private copies made on the first write. Pages past the end of the file are zeroed. Returns NULL on failure.
+void* map_file(char* name, size_t offset, size_t page_count, int permissions) {
+    return (void*) syscall(13, (intptr_t) name, offset, page_count, permissions, 0, 0);
+}
+
+// shm_create(size_t page_count) -> int64_t
+// Creates page_count zeroed pages of shared memory owned by the current process. Returns a capability for it with read and write rights, or -1 on failure.
+int64_t shm_create(size_t page_count) {
+    return syscall(14, page_count, 0, 0, 0, 0, 0);
+}
+
+// shm_map(int64_t cap) -> void*
+// Maps the shared memory of a capability with the capability's rights. Returns NULL on failure or if it is mapped already.
+void* shm_map(int64_t cap) {
+    return (void*) syscall(15, cap, 0, 0, 0, 0, 0);
+}
+
+// shm_unmap(int64_t cap) -> int
+// Unmaps the shared memory of a capability, keeping the capability. Returns 0 if successful and -1 if not.
+int shm_unmap(int64_t cap) {
+    return syscall(16, cap, 0, 0, 0, 0, 0);
+}
+
+// shm_grant(int64_t cap, int64_t pid, int rights) -> int64_t
+// Gives another process a capability for the same shared memory. The rights are PAGE_PERM_READ, optionally with PAGE_PERM_WRITE, and can't be more than the capability's own. Returns the capability in the other process, or -1 on failure.
+int64_t shm_grant(int64_t cap, int64_t pid, int rights) {
+    return syscall(17, cap, pid, rights, 0, 0, 0);
+}
+
+// shm_revoke(int64_t cap) -> int
+// Takes back every capability granted for shared memory the current process created, unmapping it from every other process. Returns 0 if successful and -1 if the capability isn't the creator's.
+int shm_revoke(int64_t cap) {
+    return syscall(18, cap, 0, 0, 0, 0, 0);
+}
+
+// shm_info(int64_t cap, size_t* page_count) -> int
+// Gets the page count of the shared memory of a capability. Returns the capability's rights, or -1 if it isn't a shared memory capability.
+int shm_info(int64_t cap, size_t* page_count) {
+    return syscall(19, cap, (intptr_t) page_count, 0, 0, 0, 0);
+}
+
+// scheduler_stats(int64_t hartid, struct scheduler_stats* stats) -> int
+// Gets the scheduling counters of a hart since boot, along with the current time in timer ticks. Returns 0 if successful and -1 if the hart doesn't exist or hasn't scheduled anything yet.
+int scheduler_stats(int64_t hartid, struct scheduler_stats* stats) {
+    return syscall(20, hartid, (intptr_t) stats, 0, 0, 0, 0);
+}
+
+// task_scheduler_stats(int64_t pid, struct task_scheduler_stats* stats) -> int
+// Gets how long a task has run and waited to run since it was created, or of the current task if pid is -1. Returns 0 if successful and -1 if not.
+int task_scheduler_stats(int64_t pid, struct task_scheduler_stats* stats) {
+    return syscall(21, pid, (intptr_t) stats, 0, 0, 0, 0);
+}
+
+// yield() -> void
+// Gives up the rest of the current slice, letting other ready tasks run. Tasks that yield early are favoured by schedulers that track bursts.
+void yield() {
+    syscall(22, 0, 0, 0, 0, 0, 0);
+}